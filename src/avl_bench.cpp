@@ -0,0 +1,1362 @@
+/*
+ *  Headless throughput benchmark for the AVL tree core. This file is its
+ *  own platform layer: it is the only file that gets built and it pulls in
+ *  avl_tree_core.cpp directly, so no window or opengl context is needed.
+ *
+ *  Every key stream is inserted into the AVL tree, the compact AVL tree
+ *  (no parent pointers, top down insert), the AVL tree again starting
+ *  each insert/lookup from a finger on the last node, a std::set and a
+ *  simple B-tree, then looked up again in the same order. Random 64 bit IDs and
+ *  short strings are run through the AVL tree and std::set as well, since
+ *  the B-tree only takes ints. Range scans and point lookups over random
+ *  keys (the lookups also through a frozen copy of the tree), set
+ *  operations between two random trees and batch inserts into an
+ *  existing tree (the AVL ones on one thread and on all of them, and
+ *  small batches into ever bigger trees) are
+ *  timed separately, as are delete/insert churn through the AVL and rank
+ *  balanced (WAVL) rebalancing and published snapshot inserts with
+ *  reader threads looking keys up at the same time, saving a tree to a
+ *  file and loading it back against building it with inserts, and how
+ *  many nodes and cache lines lookups touch (see AVLHeat). For each
+ *  run it reports ns per insert/lookup, rotations per insert, peak bytes
+ *  held by the structure and, on linux when perf_event is available,
+ *  cache misses per insert.
+ *
+ *  Build with bench.bat, or anywhere with a C++ compiler e.g.
+ *      g++ -O2 -DDEBUG=0 avl_bench.cpp -o avl_bench
+ *
+ *  Usage: avl_bench [max_power_of_10]   (default 6, max 7)
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iterator>
+#include <set>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "avl_tree_core.cpp"
+
+#define INTERNAL static
+#define GLOBAL static
+
+// Small runs get repeated until at least this many keys went through
+// so the timings aren't just noise.
+#define BENCH_MIN_KEYS_PER_RUN 1000000
+
+typedef enum {
+	BENCH_STREAM_SEQUENTIAL,
+	BENCH_STREAM_RANDOM,
+	BENCH_STREAM_ZIPFIAN,
+	BENCH_STREAM_ZIGZAG,
+	BENCH_STREAM_NEARLY_SORTED,
+	BENCH_NUM_STREAMS // THIS NEEDS TO BE THE LAST ENUM IN THE LIST
+} BenchStream;
+
+GLOBAL const char* global_stream_names[BENCH_NUM_STREAMS] = {
+	"sequential",
+	"random",
+	"zipfian",
+	"zigzag",
+	"nearly-sort"
+};
+
+typedef struct {
+	double insert_ns;
+	double find_ns;
+	double rotations_per_insert; // < 0 when it doesn't apply
+	size_t peak_bytes;
+	double cache_misses_per_insert; // < 0 when not available
+	int size;
+} BenchResult;
+
+/*********************************************
+ * Timing and counters                       *
+ *********************************************/
+INTERNAL inline double Bench_Seconds() {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#if defined(__linux__)
+// Returns -1 if the kernel or the machine doesn't allow it
+INTERNAL int Bench_OpenCacheMissCounter() {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+INTERNAL inline void Bench_StartCounter(int fd) {
+	if(fd >= 0) {
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+INTERNAL inline uint64_t Bench_StopCounter(int fd) {
+	uint64_t count = 0;
+	if(fd >= 0) {
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		if(read(fd, &count, sizeof(count)) != sizeof(count)) {
+			count = 0;
+		}
+	}
+	return count;
+}
+#else
+INTERNAL int Bench_OpenCacheMissCounter() { return -1; }
+INTERNAL inline void Bench_StartCounter(int fd) {}
+INTERNAL inline uint64_t Bench_StopCounter(int fd) { return 0; }
+#endif
+
+GLOBAL int global_cache_miss_fd = -1;
+
+/*********************************************
+ * Key streams                               *
+ *********************************************/
+GLOBAL uint64_t global_rng_state = 0x9E3779B97F4A7C15ull;
+
+// xorshift64*, good enough for keys and the same on every platform
+INTERNAL inline uint64_t Bench_Random() {
+	global_rng_state ^= global_rng_state >> 12;
+	global_rng_state ^= global_rng_state << 25;
+	global_rng_state ^= global_rng_state >> 27;
+	return global_rng_state * 0x2545F4914F6CDD1Dull;
+}
+
+// Spreads ranks out over the key space so popular keys aren't
+// all next to each other in the tree
+INTERNAL inline int Bench_ScrambleKey(uint64_t x) {
+	x ^= x >> 33;
+	x *= 0xFF51AFD7ED558CCDull;
+	x ^= x >> 33;
+	return (int)(x & 0x7FFFFFFF);
+}
+
+/* Zipfian ranks with skew theta over n items using the method from
+ * Gray et al. "Quickly Generating Billion-Record Synthetic Databases".
+ * Setup is O(n) for the zeta constant and each draw is O(1).
+ */
+INTERNAL void Bench_GenZipfian(int* keys, int n, double theta) {
+	double zeta_n = 0.0;
+	for(int i = 1; i <= n; ++i) {
+		zeta_n += 1.0 / pow((double)i, theta);
+	}
+	double zeta_2 = 1.0 + (1.0 / pow(2.0, theta));
+	double alpha = 1.0 / (1.0 - theta);
+	double eta = (1.0 - pow(2.0 / (double)n, 1.0 - theta)) / (1.0 - (zeta_2 / zeta_n));
+
+	for(int i = 0; i < n; ++i) {
+		double u = (double)(Bench_Random() >> 11) * (1.0 / 9007199254740992.0);
+		double uz = u * zeta_n;
+		uint64_t rank;
+		if(uz < 1.0) {
+			rank = 0;
+		}
+		else if(uz < zeta_2) {
+			rank = 1;
+		}
+		else {
+			rank = (uint64_t)((double)n * pow((eta * u) - eta + 1.0, alpha));
+		}
+		keys[i] = Bench_ScrambleKey(rank);
+	}
+}
+
+typedef AVLFixedString<16> BenchString;
+
+INTERNAL void Bench_GenIDs(uint64_t* keys, int n) {
+	for(int i = 0; i < n; ++i) {
+		keys[i] = Bench_Random();
+	}
+}
+
+// Shared prefix like real names/paths so compares can't stop at byte 0
+INTERNAL void Bench_GenStrings(BenchString* keys, int n) {
+	for(int i = 0; i < n; ++i) {
+		char buffer[32];
+		snprintf(buffer, sizeof(buffer), "user_%010u", (unsigned int)(Bench_Random() >> 32));
+		keys[i] = AVLFixedString_Make<16>(buffer);
+	}
+}
+
+INTERNAL void Bench_GenKeys(int* keys, int n, BenchStream stream) {
+	switch(stream) {
+		case BENCH_STREAM_SEQUENTIAL:
+		{
+			for(int i = 0; i < n; ++i) {
+				keys[i] = i;
+			}
+		} break;
+
+		case BENCH_STREAM_RANDOM:
+		{
+			for(int i = 0; i < n; ++i) {
+				keys[i] = (int)(Bench_Random() & 0x7FFFFFFF);
+			}
+		} break;
+
+		case BENCH_STREAM_ZIPFIAN:
+		{
+			Bench_GenZipfian(keys, n, 0.99);
+		} break;
+
+		// Alternates between the smallest and largest key left so every
+		// insert lands on the outside edge of the tree opposite to the
+		// last one. Keeps the tree rebalancing about as often as a
+		// sorted stream but with longer searches.
+		case BENCH_STREAM_ZIGZAG:
+		{
+			int low = 0;
+			int high = n - 1;
+			for(int i = 0; i < n; ++i) {
+				keys[i] = (i & 1) ? high-- : low++;
+			}
+		} break;
+
+		// Timestamps as they arrive from several sources: increasing
+		// overall but each key can be up to ~16 places out of order.
+		case BENCH_STREAM_NEARLY_SORTED:
+		{
+			for(int i = 0; i < n; ++i) {
+				keys[i] = (i * 4) + (int)(Bench_Random() & 63);
+			}
+		} break;
+
+		default:
+		{
+			assert(!"Unknown BenchStream");
+		} break;
+	}
+}
+
+/*********************************************
+ * B-tree                                    *
+ *********************************************/
+// A plain in memory B-tree of ints so there is something cache
+// friendly to compare against. Insert and lookup only.
+#define BTREE_MIN_DEGREE 16
+#define BTREE_MAX_KEYS ((2 * BTREE_MIN_DEGREE) - 1)
+
+typedef struct BTreeNode {
+	int num_keys;
+	bool leaf;
+	int keys[BTREE_MAX_KEYS];
+	struct BTreeNode* children[BTREE_MAX_KEYS + 1];
+} BTreeNode;
+
+typedef struct {
+	BTreeNode* root;
+	int size;
+	size_t bytes;
+} BTree;
+
+INTERNAL BTreeNode* BTree_AllocNode(BTree* tree, bool leaf) {
+	BTreeNode* node = (BTreeNode*)calloc(1, sizeof(BTreeNode));
+	if(!node) {
+		fprintf(stderr, "Couldn't calloc for BTreeNode\n");
+		exit(1);
+	}
+	node->leaf = leaf;
+	tree->bytes += sizeof(BTreeNode);
+	return node;
+}
+
+INTERNAL void BTree_FreeNode(BTreeNode* node) {
+	if(!node->leaf) {
+		for(int i = 0; i <= node->num_keys; ++i) {
+			BTree_FreeNode(node->children[i]);
+		}
+	}
+	free(node);
+}
+
+INTERNAL void BTree_Release(BTree* tree) {
+	if(tree->root) {
+		BTree_FreeNode(tree->root);
+	}
+	tree->root = NULL;
+	tree->size = 0;
+	tree->bytes = 0;
+}
+
+// Index of the first key >= val
+INTERNAL inline int BTree_LowerBound(const BTreeNode* node, int val) {
+	int i = 0;
+	while((i < node->num_keys) && (node->keys[i] < val)) {
+		++i;
+	}
+	return i;
+}
+
+INTERNAL bool BTree_Find(const BTree* tree, int val) {
+	const BTreeNode* node = tree->root;
+	while(node) {
+		int i = BTree_LowerBound(node, val);
+		if((i < node->num_keys) && (node->keys[i] == val)) {
+			return true;
+		}
+		node = node->leaf ? NULL : node->children[i];
+	}
+	return false;
+}
+
+// In order walk of every key in [low, high] under node
+INTERNAL void BTree_ScanRange(const BTreeNode* node, int low, int high, int* count, int64_t* sum) {
+	for(int i = BTree_LowerBound(node, low); i <= node->num_keys; ++i) {
+		if(!node->leaf) {
+			BTree_ScanRange(node->children[i], low, high, count, sum);
+		}
+		if((i == node->num_keys) || (high < node->keys[i])) {
+			return;
+		}
+		(*count)++;
+		*sum += node->keys[i];
+	}
+}
+
+// Splits the full child at index i of parent
+INTERNAL void BTree_SplitChild(BTree* tree, BTreeNode* parent, int i) {
+	BTreeNode* child = parent->children[i];
+	BTreeNode* sibling = BTree_AllocNode(tree, child->leaf);
+	sibling->num_keys = BTREE_MIN_DEGREE - 1;
+	memcpy(sibling->keys, child->keys + BTREE_MIN_DEGREE, (BTREE_MIN_DEGREE - 1) * sizeof(int));
+	if(!child->leaf) {
+		memcpy(sibling->children, child->children + BTREE_MIN_DEGREE, BTREE_MIN_DEGREE * sizeof(BTreeNode*));
+	}
+	child->num_keys = BTREE_MIN_DEGREE - 1;
+
+	memmove(parent->children + i + 2, parent->children + i + 1, (parent->num_keys - i) * sizeof(BTreeNode*));
+	memmove(parent->keys + i + 1, parent->keys + i, (parent->num_keys - i) * sizeof(int));
+	parent->children[i + 1] = sibling;
+	parent->keys[i] = child->keys[BTREE_MIN_DEGREE - 1];
+	parent->num_keys++;
+}
+
+// Splits full nodes on the way down so an insert never has to back up
+INTERNAL void BTree_Insert(BTree* tree, int val) {
+	if(!tree->root) {
+		tree->root = BTree_AllocNode(tree, true);
+	}
+
+	if(tree->root->num_keys == BTREE_MAX_KEYS) {
+		BTreeNode* new_root = BTree_AllocNode(tree, false);
+		new_root->children[0] = tree->root;
+		tree->root = new_root;
+		BTree_SplitChild(tree, new_root, 0);
+	}
+
+	BTreeNode* node = tree->root;
+	for(;;) {
+		int i = BTree_LowerBound(node, val);
+		if((i < node->num_keys) && (node->keys[i] == val)) {
+			return;
+		}
+
+		if(node->leaf) {
+			memmove(node->keys + i + 1, node->keys + i, (node->num_keys - i) * sizeof(int));
+			node->keys[i] = val;
+			node->num_keys++;
+			tree->size++;
+			return;
+		}
+
+		if(node->children[i]->num_keys == BTREE_MAX_KEYS) {
+			BTree_SplitChild(tree, node, i);
+			if(node->keys[i] == val) {
+				return;
+			}
+			if(node->keys[i] < val) {
+				++i;
+			}
+		}
+		node = node->children[i];
+	}
+}
+
+/*********************************************
+ * std::set allocator                        *
+ *********************************************/
+GLOBAL size_t global_set_bytes;
+GLOBAL size_t global_set_peak_bytes;
+
+// Only there to count the bytes std::set asks for
+template <typename T>
+struct BenchCountingAllocator {
+	typedef T value_type;
+
+	BenchCountingAllocator() {}
+	template <typename U> BenchCountingAllocator(const BenchCountingAllocator<U>&) {}
+
+	T* allocate(size_t count) {
+		global_set_bytes += count * sizeof(T);
+		if(global_set_peak_bytes < global_set_bytes) {
+			global_set_peak_bytes = global_set_bytes;
+		}
+		T* result = (T*)malloc(count * sizeof(T));
+		if(!result) {
+			fprintf(stderr, "Couldn't malloc for std::set node\n");
+			exit(1);
+		}
+		return result;
+	}
+
+	void deallocate(T* p, size_t count) {
+		global_set_bytes -= count * sizeof(T);
+		free(p);
+	}
+};
+
+template <typename T, typename U>
+bool operator==(const BenchCountingAllocator<T>&, const BenchCountingAllocator<U>&) { return true; }
+template <typename T, typename U>
+bool operator!=(const BenchCountingAllocator<T>&, const BenchCountingAllocator<U>&) { return false; }
+
+// Same ordering as the AVL tree so both do the same work per compare
+template <typename Key>
+struct BenchLess {
+	inline bool operator()(const Key& a, const Key& b) const {
+		return AVLCompare<Key>()(a, b) < 0;
+	}
+};
+
+/*********************************************
+ * Runs                                      *
+ *********************************************/
+// Keeps lookups from being optimized away
+GLOBAL volatile int global_sink;
+
+INTERNAL size_t Bench_PoolBytes(const AVLNodePool* pool) {
+	size_t bytes = 0;
+	for(AVLNodePoolBlock* block = pool->blocks; block; block = block->next) {
+		bytes += AVL_POOL_BLOCK_HEADER_SIZE + (block->capacity * pool->node_size);
+	}
+	return bytes;
+}
+
+// Lets Bench_RunAVL time the parent linked and the compact insert alike
+template <typename Key, typename Compare>
+INTERNAL inline void Bench_InsertKey(AVLTreeCoreT<Key, Compare>* tree, const Key& val) {
+	AVLTree_Insert(tree, val);
+}
+
+template <typename Key, typename Compare>
+INTERNAL inline void Bench_InsertKey(AVLCompactTreeT<Key, Compare>* tree, const Key& val) {
+	AVLCompact_Insert(tree, val);
+}
+
+template <typename Tree>
+INTERNAL BenchResult Bench_RunAVL(const typename Tree::KeyType* keys, int n, int reps) {
+	BenchResult result = {0};
+	double insert_seconds = 0.0;
+	double find_seconds = 0.0;
+	uint64_t cache_misses = 0;
+
+	for(int rep = 0; rep < reps; ++rep) {
+		Tree tree = {0};
+
+		Bench_StartCounter(global_cache_miss_fd);
+		double start = Bench_Seconds();
+		for(int i = 0; i < n; ++i) {
+			Bench_InsertKey(&tree, keys[i]);
+		}
+		insert_seconds += Bench_Seconds() - start;
+		cache_misses += Bench_StopCounter(global_cache_miss_fd);
+
+		int found = 0;
+		start = Bench_Seconds();
+		for(int i = 0; i < n; ++i) {
+			found += (AVLTree_Find(&tree, keys[i]) != NULL);
+		}
+		find_seconds += Bench_Seconds() - start;
+		global_sink = found;
+
+		result.rotations_per_insert = (double)tree.rotations / (double)n;
+		result.peak_bytes = Bench_PoolBytes(&tree.pool);
+		result.size = tree.size;
+		AVLNodePool_Release(&tree.pool);
+	}
+
+	result.insert_ns = insert_seconds * 1e9 / ((double)n * reps);
+	result.find_ns = find_seconds * 1e9 / ((double)n * reps);
+	result.cache_misses_per_insert = (global_cache_miss_fd >= 0) ? ((double)cache_misses / ((double)n * reps)) : -1.0;
+	return result;
+}
+
+// Same as Bench_RunAVL but every insert and lookup starts from a
+// finger on the last node, see AVLTree_InsertNear
+INTERNAL BenchResult Bench_RunFinger(const int* keys, int n, int reps) {
+	BenchResult result = {0};
+	double insert_seconds = 0.0;
+	double find_seconds = 0.0;
+	uint64_t cache_misses = 0;
+
+	for(int rep = 0; rep < reps; ++rep) {
+		AVLTreeCore tree = {0};
+		AVLFingerT<AVLNode> finger = {NULL};
+
+		Bench_StartCounter(global_cache_miss_fd);
+		double start = Bench_Seconds();
+		for(int i = 0; i < n; ++i) {
+			AVLTree_InsertNear(&tree, &finger, keys[i]);
+		}
+		insert_seconds += Bench_Seconds() - start;
+		cache_misses += Bench_StopCounter(global_cache_miss_fd);
+
+		int found = 0;
+		start = Bench_Seconds();
+		for(int i = 0; i < n; ++i) {
+			found += (AVLTree_FindNear(&tree, &finger, keys[i]) != NULL);
+		}
+		find_seconds += Bench_Seconds() - start;
+		global_sink = found;
+
+		result.rotations_per_insert = (double)tree.rotations / (double)n;
+		result.peak_bytes = Bench_PoolBytes(&tree.pool);
+		result.size = tree.size;
+		AVLNodePool_Release(&tree.pool);
+	}
+
+	result.insert_ns = insert_seconds * 1e9 / ((double)n * reps);
+	result.find_ns = find_seconds * 1e9 / ((double)n * reps);
+	result.cache_misses_per_insert = (global_cache_miss_fd >= 0) ? ((double)cache_misses / ((double)n * reps)) : -1.0;
+	return result;
+}
+
+template <typename Key>
+INTERNAL BenchResult Bench_RunSet(const Key* keys, int n, int reps) {
+	BenchResult result = {0};
+	double insert_seconds = 0.0;
+	double find_seconds = 0.0;
+	uint64_t cache_misses = 0;
+
+	for(int rep = 0; rep < reps; ++rep) {
+		global_set_bytes = 0;
+		global_set_peak_bytes = 0;
+		{
+			std::set<Key, BenchLess<Key>, BenchCountingAllocator<Key> > set;
+
+			Bench_StartCounter(global_cache_miss_fd);
+			double start = Bench_Seconds();
+			for(int i = 0; i < n; ++i) {
+				set.insert(keys[i]);
+			}
+			insert_seconds += Bench_Seconds() - start;
+			cache_misses += Bench_StopCounter(global_cache_miss_fd);
+
+			int found = 0;
+			start = Bench_Seconds();
+			for(int i = 0; i < n; ++i) {
+				found += (set.find(keys[i]) != set.end());
+			}
+			find_seconds += Bench_Seconds() - start;
+			global_sink = found;
+
+			result.size = (int)set.size();
+		}
+		result.peak_bytes = global_set_peak_bytes;
+	}
+
+	result.insert_ns = insert_seconds * 1e9 / ((double)n * reps);
+	result.find_ns = find_seconds * 1e9 / ((double)n * reps);
+	result.rotations_per_insert = -1.0;
+	result.cache_misses_per_insert = (global_cache_miss_fd >= 0) ? ((double)cache_misses / ((double)n * reps)) : -1.0;
+	return result;
+}
+
+INTERNAL BenchResult Bench_RunBTree(const int* keys, int n, int reps) {
+	BenchResult result = {0};
+	double insert_seconds = 0.0;
+	double find_seconds = 0.0;
+	uint64_t cache_misses = 0;
+
+	for(int rep = 0; rep < reps; ++rep) {
+		BTree tree = {0};
+
+		Bench_StartCounter(global_cache_miss_fd);
+		double start = Bench_Seconds();
+		for(int i = 0; i < n; ++i) {
+			BTree_Insert(&tree, keys[i]);
+		}
+		insert_seconds += Bench_Seconds() - start;
+		cache_misses += Bench_StopCounter(global_cache_miss_fd);
+
+		int found = 0;
+		start = Bench_Seconds();
+		for(int i = 0; i < n; ++i) {
+			found += BTree_Find(&tree, keys[i]);
+		}
+		find_seconds += Bench_Seconds() - start;
+		global_sink = found;
+
+		result.peak_bytes = tree.bytes;
+		result.size = tree.size;
+		BTree_Release(&tree);
+	}
+
+	result.insert_ns = insert_seconds * 1e9 / ((double)n * reps);
+	result.find_ns = find_seconds * 1e9 / ((double)n * reps);
+	result.rotations_per_insert = -1.0;
+	result.cache_misses_per_insert = (global_cache_miss_fd >= 0) ? ((double)cache_misses / ((double)n * reps)) : -1.0;
+	return result;
+}
+
+/* Scans of about BENCH_RANGE_KEYS keys each starting at random keys in 
+ * the tree. The key counts and sums are compared across structures to 
+ * make sure they all did the same work.
+ */
+#define BENCH_RANGE_KEYS 100
+#define BENCH_RANGE_QUERIES 20000
+
+INTERNAL void Bench_PrintRangeResult(int n, const char* structure, double seconds, int count) {
+	printf("%-12s %9d %-9s %9d %12.1f %10.2f\n", "range", n, structure, BENCH_RANGE_QUERIES, 
+		   seconds * 1e9 / BENCH_RANGE_QUERIES, seconds * 1e9 / (double)(count ? count : 1));
+	fflush(stdout);
+}
+
+INTERNAL void Bench_RunRangeScans(const int* keys, int n) {
+	int* lows = (int*)malloc(BENCH_RANGE_QUERIES * sizeof(int));
+	if(!lows) {
+		fprintf(stderr, "Couldn't malloc for range queries\n");
+		return;
+	}
+	for(int i = 0; i < BENCH_RANGE_QUERIES; ++i) {
+		lows[i] = keys[Bench_Random() % (uint64_t)n];
+	}
+	// keys are spread evenly over 31 bits
+	int width = (int)(((int64_t)BENCH_RANGE_KEYS << 31) / n);
+
+	int avl_count = 0;
+	int64_t avl_sum = 0;
+	{
+		AVLTreeCore tree = {0};
+		for(int i = 0; i < n; ++i) {
+			AVLTree_Insert(&tree, keys[i]);
+		}
+
+		double start = Bench_Seconds();
+		for(int q = 0; q < BENCH_RANGE_QUERIES; ++q) {
+			int high = (lows[q] < INT32_MAX - width) ? (lows[q] + width) : INT32_MAX;
+			AVLRangeCursorT<AVLNode> cursor = AVLTree_Range(&tree, lows[q], high);
+			while(AVLNode* node = AVLTree_RangeNext(&cursor)) {
+				avl_count++;
+				avl_sum += node->val;
+			}
+		}
+		Bench_PrintRangeResult(n, "avl", Bench_Seconds() - start, avl_count);
+		AVLNodePool_Release(&tree.pool);
+	}
+
+	int set_count = 0;
+	int64_t set_sum = 0;
+	{
+		std::set<int, BenchLess<int>, BenchCountingAllocator<int> > set(keys, keys + n);
+
+		double start = Bench_Seconds();
+		for(int q = 0; q < BENCH_RANGE_QUERIES; ++q) {
+			int high = (lows[q] < INT32_MAX - width) ? (lows[q] + width) : INT32_MAX;
+			auto end = set.upper_bound(high);
+			for(auto it = set.lower_bound(lows[q]); it != end; ++it) {
+				set_count++;
+				set_sum += *it;
+			}
+		}
+		Bench_PrintRangeResult(n, "std::set", Bench_Seconds() - start, set_count);
+	}
+
+	int btree_count = 0;
+	int64_t btree_sum = 0;
+	{
+		BTree tree = {0};
+		for(int i = 0; i < n; ++i) {
+			BTree_Insert(&tree, keys[i]);
+		}
+
+		double start = Bench_Seconds();
+		for(int q = 0; q < BENCH_RANGE_QUERIES; ++q) {
+			int high = (lows[q] < INT32_MAX - width) ? (lows[q] + width) : INT32_MAX;
+			BTree_ScanRange(tree.root, lows[q], high, &btree_count, &btree_sum);
+		}
+		Bench_PrintRangeResult(n, "btree", Bench_Seconds() - start, btree_count);
+		BTree_Release(&tree);
+	}
+
+	if((avl_count != set_count) || (avl_count != btree_count) || 
+	   (avl_sum != set_sum) || (avl_sum != btree_sum)) {
+		fprintf(stderr, "Range scans disagree: avl %d std::set %d btree %d\n", avl_count, set_count, btree_count);
+	}
+	free(lows);
+}
+
+/* Random point lookups of keys that are in the tree, through the tree
+ * itself and through a frozen copy of it.
+ */
+#define BENCH_LOOKUP_QUERIES 1000000
+
+INTERNAL void Bench_PrintLookupResult(int n, const char* structure, double seconds) {
+	printf("%-12s %9d %-9s %9d %12.1f %10s\n", "lookup", n, structure, BENCH_LOOKUP_QUERIES, 
+		   seconds * 1e9 / BENCH_LOOKUP_QUERIES, "-");
+	fflush(stdout);
+}
+
+INTERNAL void Bench_RunLookups(const int* keys, int n) {
+	int* queries = (int*)malloc(BENCH_LOOKUP_QUERIES * sizeof(int));
+	if(!queries) {
+		fprintf(stderr, "Couldn't malloc for lookups\n");
+		return;
+	}
+	for(int i = 0; i < BENCH_LOOKUP_QUERIES; ++i) {
+		queries[i] = keys[Bench_Random() % (uint64_t)n];
+	}
+
+	AVLTreeCore tree = {0};
+	for(int i = 0; i < n; ++i) {
+		AVLTree_Insert(&tree, keys[i]);
+	}
+
+	int avl_found = 0;
+	double start = Bench_Seconds();
+	for(int q = 0; q < BENCH_LOOKUP_QUERIES; ++q) {
+		avl_found += (AVLTree_Find(&tree, queries[q]) != NULL);
+	}
+	Bench_PrintLookupResult(n, "avl", Bench_Seconds() - start);
+
+	AVLFrozenTree frozen = {0};
+	AVLTree_Freeze(&tree, &frozen);
+	int frozen_found = 0;
+	start = Bench_Seconds();
+	for(int q = 0; q < BENCH_LOOKUP_QUERIES; ++q) {
+		frozen_found += (AVLFrozen_Find(&frozen, queries[q]) != 0);
+	}
+	Bench_PrintLookupResult(n, "frozen", Bench_Seconds() - start);
+
+	if(avl_found != frozen_found) {
+		fprintf(stderr, "Lookups disagree: avl %d frozen %d\n", avl_found, frozen_found);
+	}
+	global_sink = frozen_found;
+	AVLFrozen_Release(&frozen);
+	AVLNodePool_Release(&tree.pool);
+	free(queries);
+}
+
+/*********************************************
+ * Set operations                            *
+ *********************************************/
+GLOBAL const char* global_set_operation_names[] = {
+	"union",
+	"intersect",
+	"difference"
+};
+
+INTERNAL void Bench_PrintSetOpResult(AVLSetOperation operation, int n, const char* structure, 
+		                             int threads, double seconds, int reps) {
+	printf("%-12s %9d %-9s %7d %12.3f %10.2f\n", global_set_operation_names[operation], n, structure, 
+		   threads, seconds * 1e3 / reps, seconds * 1e9 / (2.0 * n * reps));
+	fflush(stdout);
+}
+
+// Building the inputs isn't timed, only the operation itself
+INTERNAL int Bench_RunAVLSetOp(const int* a, const int* b, int n, int reps, 
+		                       AVLSetOperation operation, ThreadPool* threads) {
+	double seconds = 0.0;
+	int size = 0;
+	for(int rep = 0; rep < reps; ++rep) {
+		AVLTreeCore tree_a = {0};
+		AVLTreeCore tree_b = {0};
+		AVLTree_Build(&tree_a, a, n);
+		AVLTree_Build(&tree_b, b, n);
+
+		double start = Bench_Seconds();
+		AVLTree_SetOperation(&tree_a, &tree_b, threads, operation);
+		seconds += Bench_Seconds() - start;
+
+		size = tree_a.size;
+		AVLNodePool_Release(&tree_a.pool);
+	}
+
+	Bench_PrintSetOpResult(operation, n, "avl", threads ? threads->num_threads : 1, seconds, reps);
+	return size;
+}
+
+INTERNAL int Bench_RunSetSetOp(const int* a, const int* b, int n, int reps, AVLSetOperation operation) {
+	typedef std::set<int, BenchLess<int>, BenchCountingAllocator<int> > Set;
+
+	double seconds = 0.0;
+	int size = 0;
+	for(int rep = 0; rep < reps; ++rep) {
+		Set set_a(a, a + n);
+		Set set_b(b, b + n);
+
+		double start = Bench_Seconds();
+		Set result;
+		std::insert_iterator<Set> out(result, result.end());
+		switch(operation) {
+			case AVL_SET_UNION: {
+				std::set_union(set_a.begin(), set_a.end(), set_b.begin(), set_b.end(), out, BenchLess<int>());
+			} break;
+			case AVL_SET_INTERSECTION: {
+				std::set_intersection(set_a.begin(), set_a.end(), set_b.begin(), set_b.end(), out, BenchLess<int>());
+			} break;
+			case AVL_SET_DIFFERENCE: {
+				std::set_difference(set_a.begin(), set_a.end(), set_b.begin(), set_b.end(), out, BenchLess<int>());
+			} break;
+		}
+		seconds += Bench_Seconds() - start;
+
+		size = (int)result.size();
+	}
+
+	Bench_PrintSetOpResult(operation, n, "std::set", 1, seconds, reps);
+	return size;
+}
+
+// b shares about half of its keys with a
+INTERNAL void Bench_RunSetOps(int* a, int* b, int n, ThreadPool* threads) {
+	Bench_GenKeys(a, n, BENCH_STREAM_RANDOM);
+	Bench_GenKeys(b, n, BENCH_STREAM_RANDOM);
+	for(int i = 0; i < n; i += 2) {
+		b[i] = a[Bench_Random() % (uint64_t)n];
+	}
+
+	int reps = (n < BENCH_MIN_KEYS_PER_RUN) ? (BENCH_MIN_KEYS_PER_RUN / n) : 1;
+	for(int operation = AVL_SET_UNION; operation <= AVL_SET_DIFFERENCE; ++operation) {
+		int serial_size = Bench_RunAVLSetOp(a, b, n, reps, (AVLSetOperation)operation, NULL);
+		int parallel_size = Bench_RunAVLSetOp(a, b, n, reps, (AVLSetOperation)operation, threads);
+		int set_size = Bench_RunSetSetOp(a, b, n, reps, (AVLSetOperation)operation);
+		if((serial_size != set_size) || (parallel_size != set_size)) {
+			fprintf(stderr, "%s sizes disagree: avl %d avl parallel %d std::set %d\n", 
+					global_set_operation_names[operation], serial_size, parallel_size, set_size);
+		}
+	}
+}
+
+/*********************************************
+ * Batch insert                              *
+ *********************************************/
+// ms is per batch
+INTERNAL void Bench_PrintBatchResult(int existing_count, int n, const char* structure, int threads, 
+		                             double seconds, int batches) {
+	printf("%-12s %9d %9d %-9s %7d %12.3f %10.2f\n", "batch", existing_count, n, structure, 
+		   threads, seconds * 1e3 / batches, seconds * 1e9 / ((double)n * batches));
+	fflush(stdout);
+}
+
+/* Inserts n random keys into a tree that already holds n, either as
+ * one AVLTree_InsertBatch or one AVLTree_Insert at a time. Building
+ * the existing tree isn't timed.
+ */
+INTERNAL int Bench_RunAVLBatch(const int* existing, const int* batch, int n, int reps, 
+		                       ThreadPool* threads, bool one_at_a_time) {
+	double seconds = 0.0;
+	int size = 0;
+	for(int rep = 0; rep < reps; ++rep) {
+		AVLTreeCore tree = {0};
+		AVLTree_Build(&tree, existing, n);
+
+		double start = Bench_Seconds();
+		if(one_at_a_time) {
+			for(int i = 0; i < n; ++i) {
+				AVLTree_Insert(&tree, batch[i]);
+			}
+		}
+		else {
+			AVLTree_InsertBatch(&tree, batch, n, threads);
+		}
+		seconds += Bench_Seconds() - start;
+
+		size = tree.size;
+		AVLNodePool_Release(&tree.pool);
+	}
+
+	Bench_PrintBatchResult(n, n, one_at_a_time ? "avl loop" : "avl", threads ? threads->num_threads : 1, seconds, reps);
+	return size;
+}
+
+INTERNAL int Bench_RunSetBatch(const int* existing, const int* batch, int n, int reps) {
+	double seconds = 0.0;
+	int size = 0;
+	for(int rep = 0; rep < reps; ++rep) {
+		std::set<int, BenchLess<int>, BenchCountingAllocator<int> > set(existing, existing + n);
+
+		double start = Bench_Seconds();
+		set.insert(batch, batch + n);
+		seconds += Bench_Seconds() - start;
+
+		size = (int)set.size();
+	}
+
+	Bench_PrintBatchResult(n, n, "std::set", 1, seconds, reps);
+	return size;
+}
+
+INTERNAL void Bench_RunBatches(int* existing, int* batch, int n, ThreadPool* threads) {
+	Bench_GenKeys(existing, n, BENCH_STREAM_RANDOM);
+	Bench_GenKeys(batch, n, BENCH_STREAM_RANDOM);
+
+	int reps = (n < BENCH_MIN_KEYS_PER_RUN) ? (BENCH_MIN_KEYS_PER_RUN / n) : 1;
+	int serial_size = Bench_RunAVLBatch(existing, batch, n, reps, NULL, false);
+	int parallel_size = Bench_RunAVLBatch(existing, batch, n, reps, threads, false);
+	int loop_size = Bench_RunAVLBatch(existing, batch, n, reps, NULL, true);
+	int set_size = Bench_RunSetBatch(existing, batch, n, reps);
+	if((serial_size != set_size) || (parallel_size != set_size) || (loop_size != set_size)) {
+		fprintf(stderr, "batch sizes disagree: avl %d avl parallel %d avl loop %d std::set %d\n", 
+				serial_size, parallel_size, loop_size, set_size);
+	}
+}
+
+/* Small batches into a tree of existing_count keys, so it shows how a
+ * batch scales with the tree it goes into. Up to BENCH_SWEEP_BATCHES
+ * batches of BENCH_SWEEP_BATCH_KEYS go into the same tree one after
+ * another, batch has to hold that many keys.
+ */
+#define BENCH_SWEEP_BATCH_KEYS 1000
+#define BENCH_SWEEP_BATCHES 16
+
+INTERNAL void Bench_RunBatchSweep(int* existing, int existing_count, int* batch, int batch_capacity, 
+		                          ThreadPool* threads) {
+	int batches = batch_capacity / BENCH_SWEEP_BATCH_KEYS;
+	if(batches > BENCH_SWEEP_BATCHES) {
+		batches = BENCH_SWEEP_BATCHES;
+	}
+	Bench_GenKeys(existing, existing_count, BENCH_STREAM_RANDOM);
+	Bench_GenKeys(batch, batches * BENCH_SWEEP_BATCH_KEYS, BENCH_STREAM_RANDOM);
+
+	for(int mode = 0; mode < 3; ++mode) {
+		ThreadPool* mode_threads = (mode == 1) ? threads : NULL;
+		AVLTreeCore tree = {0};
+		AVLTree_Build(&tree, existing, existing_count);
+
+		double start = Bench_Seconds();
+		for(int b = 0; b < batches; ++b) {
+			const int* keys = batch + (b * BENCH_SWEEP_BATCH_KEYS);
+			if(mode == 2) {
+				for(int i = 0; i < BENCH_SWEEP_BATCH_KEYS; ++i) {
+					AVLTree_Insert(&tree, keys[i]);
+				}
+			}
+			else {
+				AVLTree_InsertBatch(&tree, keys, BENCH_SWEEP_BATCH_KEYS, mode_threads);
+			}
+		}
+		double seconds = Bench_Seconds() - start;
+
+		Bench_PrintBatchResult(existing_count, BENCH_SWEEP_BATCH_KEYS, (mode == 2) ? "avl loop" : "avl", 
+				               mode_threads ? mode_threads->num_threads : 1, seconds, batches);
+		AVLNodePool_Release(&tree.pool);
+	}
+}
+
+/*********************************************
+ * Churn                                     *
+ *********************************************/
+/* Starts from n random keys, then deletes the oldest key still around
+ * and inserts a fresh one, BENCH_CHURN_OPS_PER_KEY times per key. The
+ * AVL and rank balanced trees see the same keys in the same order.
+ */
+#define BENCH_CHURN_OPS_PER_KEY 4
+
+typedef struct {
+	double ns_per_op;
+	double rotations_per_op;
+	int height;
+	int size;
+} BenchChurnResult;
+
+INTERNAL int Bench_TreeHeight(const AVLNode* node) {
+	if(node == NULL) {
+		return -1;
+	}
+	int left = Bench_TreeHeight(node->left);
+	int right = Bench_TreeHeight(node->right);
+	return 1 + ((left > right) ? left : right);
+}
+
+INTERNAL BenchChurnResult Bench_RunChurnTree(const int* keys, const int* fresh, int n, bool weak) {
+	BenchChurnResult result = {0};
+	AVLTreeCore tree = {0};
+	for(int i = 0; i < n; ++i) {
+		if(weak) {
+			AVLWeak_Insert(&tree, keys[i]);
+		}
+		else {
+			AVLTree_Insert(&tree, keys[i]);
+		}
+	}
+
+	// the oldest key lives in keys until it's been replaced once
+	int ops = BENCH_CHURN_OPS_PER_KEY * n;
+	tree.rotations = 0;
+	double start = Bench_Seconds();
+	for(int i = 0; i < ops; ++i) {
+		int oldest = (i < n) ? keys[i] : fresh[i - n];
+		if(weak) {
+			AVLWeak_Delete(&tree, oldest);
+			AVLWeak_Insert(&tree, fresh[i]);
+		}
+		else {
+			AVLTree_Delete(&tree, oldest);
+			AVLTree_Insert(&tree, fresh[i]);
+		}
+	}
+	double seconds = Bench_Seconds() - start;
+
+	result.ns_per_op = seconds * 1e9 / (2.0 * ops);
+	result.rotations_per_op = (double)tree.rotations / (2.0 * ops);
+	result.height = Bench_TreeHeight(tree.root);
+	result.size = tree.size;
+	AVLNodePool_Release(&tree.pool);
+	return result;
+}
+
+INTERNAL void Bench_PrintChurnResult(int n, const char* structure, BenchChurnResult result) {
+	printf("%-12s %9d %-9s %9d %10.1f %10.3f %7d\n", "churn", n, structure, result.size,
+		   result.ns_per_op, result.rotations_per_op, result.height);
+	fflush(stdout);
+}
+
+INTERNAL void Bench_RunChurn(const int* keys, int n) {
+	int ops = BENCH_CHURN_OPS_PER_KEY * n;
+	int* fresh = (int*)malloc((size_t)ops * sizeof(int));
+	if(!fresh) {
+		fprintf(stderr, "Couldn't malloc for churn\n");
+		return;
+	}
+	for(int i = 0; i < ops; ++i) {
+		fresh[i] = Bench_ScrambleKey(Bench_Random());
+	}
+
+	BenchChurnResult avl = Bench_RunChurnTree(keys, fresh, n, false);
+	BenchChurnResult weak = Bench_RunChurnTree(keys, fresh, n, true);
+	Bench_PrintChurnResult(n, "avl", avl);
+	Bench_PrintChurnResult(n, "wavl", weak);
+	if(avl.size != weak.size) {
+		fprintf(stderr, "Churn disagrees: avl %d wavl %d\n", avl.size, weak.size);
+	}
+	free(fresh);
+}
+
+/*********************************************
+ * Published snapshots                       *
+ *********************************************/
+/* One writer inserts keys into an AVLSnapshotTree while num_readers
+ * threads keep looking up random keys in whatever version was last
+ * published. Reports ns per insert and ns per lookup.
+ */
+INTERNAL void Bench_RunSnapshots(const int* keys, int n, int num_readers) {
+	static AVLSnapshotTree tree;
+	AVLSnapshot_Init(&tree);
+
+	std::atomic<bool> done(false);
+	std::atomic<int64_t> lookups(0);
+	std::thread readers[AVL_SNAPSHOT_MAX_READERS];
+	for(int r = 0; r < num_readers; ++r) {
+		readers[r] = std::thread([&, r]() {
+			uint64_t state = 0x9E3779B97F4A7C15ull * (uint64_t)(r + 1);
+			int64_t count = 0;
+			int found = 0;
+			while(!done.load(std::memory_order_relaxed)) {
+				AVLPersistentNodeT<int>* node = AVLSnapshot_BeginRead(&tree, r);
+				for(int i = 0; i < 64; ++i) {
+					state ^= state >> 12;
+					state ^= state << 25;
+					state ^= state >> 27;
+					int val = keys[(state * 0x2545F4914F6CDD1Dull) % (uint64_t)n];
+					AVLPersistentNodeT<int>* current = node;
+					while(current && (current->val != val)) {
+						current = (val < current->val) ? current->left : current->right;
+					}
+					found += (current != NULL);
+				}
+				AVLSnapshot_EndRead(&tree, r);
+				count += 64;
+			}
+			lookups += count;
+			global_sink = found;
+		});
+	}
+
+	double start = Bench_Seconds();
+	for(int i = 0; i < n; ++i) {
+		AVLSnapshot_Insert(&tree, keys[i]);
+	}
+	double seconds = Bench_Seconds() - start;
+	done.store(true);
+	for(int r = 0; r < num_readers; ++r) {
+		readers[r].join();
+	}
+
+	double reader_seconds = seconds * num_readers;
+	char lookup_ns[32] = "-";
+	if(lookups.load()) {
+		snprintf(lookup_ns, sizeof(lookup_ns), "%.1f", reader_seconds * 1e9 / (double)lookups.load());
+	}
+	printf("%-12s %9d %7d %12.1f %12s %12.2f\n", "snapshot", n, num_readers, seconds * 1e9 / n, 
+		   lookup_ns, (double)Bench_PoolBytes(&tree.pool) / (1024.0 * 1024.0));
+	fflush(stdout);
+	AVLSnapshot_Release(&tree);
+}
+
+#define BENCH_FILE_PATH "avl_bench.avlt"
+
+/* Builds a tree from random keys the slow way, one insert at a time,
+ * then saves it and loads it back, which is what opening a saved tree
+ * costs instead.
+ */
+INTERNAL void Bench_RunFile(const int* keys, int n) {
+	AVLTreeCore tree = {0};
+	double start = Bench_Seconds();
+	for(int i = 0; i < n; ++i) {
+		AVLTree_Insert(&tree, keys[i]);
+	}
+	double insert_seconds = Bench_Seconds() - start;
+
+	start = Bench_Seconds();
+	bool saved = AVLTree_Save(&tree, BENCH_FILE_PATH);
+	double save_seconds = Bench_Seconds() - start;
+
+	AVLTreeCore loaded = {0};
+	start = Bench_Seconds();
+	bool load_ok = saved && AVLTree_Load(&loaded, BENCH_FILE_PATH);
+	double load_seconds = Bench_Seconds() - start;
+
+	if(load_ok && (loaded.size == tree.size)) {
+		size_t file_bytes = sizeof(AVLFileHeader) + AVLFile_PayloadSize((uint64_t)tree.size, sizeof(int), 0);
+		printf("%-12s %9d %12.2f %12.2f %12.2f %10.2f\n", "file", n, insert_seconds * 1e3, save_seconds * 1e3,
+			   load_seconds * 1e3, (double)file_bytes / (1024.0 * 1024.0));
+	}
+	else {
+		printf("%-12s %9d couldn't save and load the tree\n", "file", n);
+	}
+	fflush(stdout);
+
+	remove(BENCH_FILE_PATH);
+	AVLNodePool_Release(&tree.pool);
+	AVLNodePool_Release(&loaded.pool);
+}
+
+/* Looks up every key of a stream again with access counting on, in a
+ * tree built with inserts (nodes wherever the pool had room when each
+ * key came in) and one bulk built from the same keys (nodes packed in
+ * key order). Reports nodes and estimated cache lines per lookup and
+ * the share of all node visits that went to the hottest 1% of nodes.
+ */
+INTERNAL void Bench_PrintHeat(const char* stream, int n, const char* structure, AVLTreeCore* tree) {
+	int* visits = (int*)malloc((size_t)tree->size * sizeof(int));
+	if(!visits) {
+		fprintf(stderr, "Couldn't malloc for heat\n");
+		return;
+	}
+	int count = 0;
+	for(AVLNode* node = AVLTree_First(tree); node; node = AVLTree_Next(node)) {
+		visits[count++] = node->visits;
+	}
+	int hot_count = (count + 99) / 100;
+	std::nth_element(visits, visits + hot_count, visits + count, std::greater<int>());
+	uint64_t hot_visits = 0;
+	for(int i = 0; i < hot_count; ++i) {
+		hot_visits += (uint64_t)visits[i];
+	}
+	free(visits);
+
+	AVLHeat* heat = tree->heat;
+	printf("%-12s %9d %-9s %10.2f %10.2f %10.1f\n", stream, n, structure, AVLHeat_VisitsPerOperation(heat),
+		   AVLHeat_LinesPerOperation(heat), heat->visits ? (100.0 * hot_visits / (double)heat->visits) : 0.0);
+	fflush(stdout);
+}
+
+INTERNAL void Bench_RunHeat(const char* stream, const int* keys, int n) {
+	AVLTreeCore inserted = {0};
+	for(int i = 0; i < n; ++i) {
+		AVLTree_Insert(&inserted, keys[i]);
+	}
+	AVLTreeCore built = {0};
+	AVLTree_Build(&built, keys, n);
+
+	AVLHeat heat = {0};
+	inserted.heat = &heat;
+	int found = 0;
+	for(int i = 0; i < n; ++i) {
+		found += (AVLTree_Find(&inserted, keys[i]) != NULL);
+	}
+	Bench_PrintHeat(stream, n, "inserted", &inserted);
+
+	memset(&heat, 0, sizeof(heat));
+	built.heat = &heat;
+	for(int i = 0; i < n; ++i) {
+		found -= (AVLTree_Find(&built, keys[i]) != NULL);
+	}
+	Bench_PrintHeat(stream, n, "built", &built);
+
+	if(found != 0) {
+		fprintf(stderr, "Heat lookups disagree between the inserted and built trees\n");
+	}
+	AVLNodePool_Release(&inserted.pool);
+	AVLNodePool_Release(&built.pool);
+}
+
+INTERNAL void Bench_PrintResult(const char* stream, int n, const char* structure, BenchResult result) {
+	char rotations[32] = "-";
+	char misses[32] = "n/a";
+	if(result.rotations_per_insert >= 0.0) {
+		snprintf(rotations, sizeof(rotations), "%.3f", result.rotations_per_insert);
+	}
+	if(result.cache_misses_per_insert >= 0.0) {
+		snprintf(misses, sizeof(misses), "%.2f", result.cache_misses_per_insert);
+	}
+
+	printf("%-12s %9d %-9s %9d %10.1f %10.1f %10s %12.2f %10.1f %12s\n",
+		   stream, n, structure, result.size, result.insert_ns, result.find_ns, rotations,
+		   (double)result.peak_bytes / (1024.0 * 1024.0),
+		   (double)result.peak_bytes / (double)(result.size ? result.size : 1), misses);
+	fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+	int max_power = (argc > 1) ? atoi(argv[1]) : 6;
+	if(max_power < 3) {
+		max_power = 3;
+	}
+	if(max_power > 7) {
+		max_power = 7;
+	}
+
+	global_cache_miss_fd = Bench_OpenCacheMissCounter();
+	if(global_cache_miss_fd < 0) {
+		printf("NOTE: cache miss counter not available\n");
+	}
+
+	int max_n = 1;
+	for(int i = 0; i < max_power; ++i) {
+		max_n *= 10;
+	}
+	int* keys = (int*)malloc((size_t)max_n * sizeof(int));
+	if(!keys) {
+		fprintf(stderr, "Couldn't malloc for keys\n");
+		return 1;
+	}
+
+	printf("%-12s %9s %-9s %9s %10s %10s %10s %12s %10s %12s\n",
+		   "stream", "keys", "structure", "distinct", "insert ns", "find ns",
+		   "rot/insert", "peak MB", "bytes/key", "misses/ins");
+
+	for(int stream = 0; stream < BENCH_NUM_STREAMS; ++stream) {
+		for(int n = 1000; n <= max_n; n *= 10) {
+			Bench_GenKeys(keys, n, (BenchStream)stream);
+			int reps = (n < BENCH_MIN_KEYS_PER_RUN) ? (BENCH_MIN_KEYS_PER_RUN / n) : 1;
+
+			const char* name = global_stream_names[stream];
+			Bench_PrintResult(name, n, "avl", Bench_RunAVL<AVLTreeCore>(keys, n, reps));
+			Bench_PrintResult(name, n, "compact", Bench_RunAVL<AVLCompactTree>(keys, n, reps));
+			Bench_PrintResult(name, n, "finger", Bench_RunFinger(keys, n, reps));
+			Bench_PrintResult(name, n, "std::set", Bench_RunSet(keys, n, reps));
+			Bench_PrintResult(name, n, "btree", Bench_RunBTree(keys, n, reps));
+		}
+	}
+
+	printf("\n%-12s %9s %-9s %9s %12s %10s\n", "query", "keys", "structure", "queries", "ns/query", "ns/key");
+	for(int n = 1000; n <= max_n; n *= 10) {
+		Bench_GenKeys(keys, n, BENCH_STREAM_RANDOM);
+		Bench_RunRangeScans(keys, n);
+		Bench_RunLookups(keys, n);
+	}
+
+	ThreadPool* threads = ThreadPool_Create(0);
+	int* other_keys = (int*)malloc((size_t)max_n * sizeof(int));
+	if(!threads || !other_keys) {
+		fprintf(stderr, "Couldn't set up set operations\n");
+		return 1;
+	}
+	printf("\n%-12s %9s %-9s %7s %12s %10s\n", "set op", "keys", "structure", "threads", "ms", "ns/key");
+	for(int n = 1000; n <= max_n; n *= 10) {
+		Bench_RunSetOps(keys, other_keys, n, threads);
+	}
+	printf("\n%-12s %9s %9s %-9s %7s %12s %10s\n", "insert", "existing", "keys", "structure", "threads", "ms", "ns/key");
+	for(int n = 1000; n <= max_n; n *= 10) {
+		Bench_RunBatches(keys, other_keys, n, threads);
+	}
+	for(int n = 1000; n <= max_n; n *= 10) {
+		Bench_RunBatchSweep(keys, n, other_keys, max_n, threads);
+	}
+	free(other_keys);
+
+	int num_readers = threads->num_threads - 1;
+	if(num_readers < 1) {
+		num_readers = 1;
+	}
+	if(num_readers > AVL_SNAPSHOT_MAX_READERS) {
+		num_readers = AVL_SNAPSHOT_MAX_READERS;
+	}
+	ThreadPool_Destroy(threads);
+	printf("\n%-12s %9s %-9s %9s %10s %10s %7s\n", "churn", "keys", "structure", "distinct", "ns/op", "rot/op", "height");
+	for(int n = 1000; n <= max_n; n *= 10) {
+		Bench_GenKeys(keys, n, BENCH_STREAM_RANDOM);
+		Bench_RunChurn(keys, n);
+	}
+
+	printf("\n%-12s %9s %7s %12s %12s %12s\n", "publish", "keys", "readers", "insert ns", "lookup ns", "peak MB");
+	for(int n = 1000; n <= max_n; n *= 10) {
+		Bench_GenKeys(keys, n, BENCH_STREAM_RANDOM);
+		Bench_RunSnapshots(keys, n, 0);
+		Bench_RunSnapshots(keys, n, num_readers);
+	}
+
+	printf("\n%-12s %9s %12s %12s %12s %10s\n", "file", "keys", "insert ms", "save ms", "load ms", "MB");
+	for(int n = 1000; n <= max_n; n *= 10) {
+		Bench_GenKeys(keys, n, BENCH_STREAM_RANDOM);
+		Bench_RunFile(keys, n);
+	}
+
+	printf("\n%-12s %9s %-9s %10s %10s %10s\n", "heat", "keys", "structure", "nodes/op", "lines/op", "top 1% %");
+	for(int n = 1000; n <= max_n; n *= 10) {
+		Bench_GenKeys(keys, n, BENCH_STREAM_RANDOM);
+		Bench_RunHeat("random", keys, n);
+		Bench_GenKeys(keys, n, BENCH_STREAM_ZIPFIAN);
+		Bench_RunHeat("zipfian", keys, n);
+	}
+
+	printf("\n");
+	uint64_t* ids = (uint64_t*)malloc((size_t)max_n * sizeof(uint64_t));
+	BenchString* strings = (BenchString*)malloc((size_t)max_n * sizeof(BenchString));
+	if(!ids || !strings) {
+		fprintf(stderr, "Couldn't malloc for keys\n");
+		return 1;
+	}
+
+	for(int n = 1000; n <= max_n; n *= 10) {
+		int reps = (n < BENCH_MIN_KEYS_PER_RUN) ? (BENCH_MIN_KEYS_PER_RUN / n) : 1;
+
+		Bench_GenIDs(ids, n);
+		Bench_PrintResult("random-u64", n, "avl", Bench_RunAVL<AVLTreeCoreT<uint64_t> >(ids, n, reps));
+		Bench_PrintResult("random-u64", n, "compact", Bench_RunAVL<AVLCompactTreeT<uint64_t> >(ids, n, reps));
+		Bench_PrintResult("random-u64", n, "std::set", Bench_RunSet(ids, n, reps));
+
+		Bench_GenStrings(strings, n);
+		Bench_PrintResult("random-str16", n, "avl", Bench_RunAVL<AVLTreeCoreT<BenchString> >(strings, n, reps));
+		Bench_PrintResult("random-str16", n, "compact", Bench_RunAVL<AVLCompactTreeT<BenchString> >(strings, n, reps));
+		Bench_PrintResult("random-str16", n, "std::set", Bench_RunSet(strings, n, reps));
+	}
+
+	free(strings);
+	free(ids);
+	free(keys);
+	return 0;
+}
@@ -8,9 +8,13 @@ static float const global_node_margin = 0.75f; // space between the nodes at the
 static float const global_y_spacing = 3.0f; // space between successive levels of the tree
 static float const global_y_insert_node_start = 1.3f; // where insert node begins, this should be 
                                                       // subtracted on final insert
+static char const* global_avl_tree_file = "avl_tree.avlt"; // 'k' saves here, loaded on startup
+static char const* global_avl_tree_heat_file = "avl_tree_heat.csv"; // 'k' saves node visits here
 
 #include "engine.h"
 #include "windows.h"
+#include <string.h>
+#include "avl_tree_core.cpp"
 
 #define AVL_THRESHOLD 0.001f
 
@@ -25,16 +29,32 @@ typedef enum {
 	AVLTREE_ROTATING,
 	AVLTREE_LEFT_RIGHT_ROTATE,
 	AVLTREE_RIGHT_LEFT_ROTATE,
+	AVLTREE_SELECT,
+	AVLTREE_SELECT_FOUND,
+	AVLTREE_RANGE_SEARCH,
+	AVLTREE_RANGE_SCAN,
+	AVLTREE_RANGE_FOUND,
+	AVLTREE_SPLIT,
+	AVLTREE_SCRUBBING,
 	AVLTREE_PAUSED
 } AVLTreeState;
 
-typedef struct AVLNode {
-	// data
-	struct AVLNode* parent;
-	struct AVLNode* left;
-	struct AVLNode* right;
-	int val;
-	int height;
+// What the digits on each node show, 'e' cycles through them
+typedef enum {
+	AVLTREE_LABEL_KEYS,
+	AVLTREE_LABEL_SUBTREE_SIZES,
+	AVLTREE_LABEL_COUNTS, // copies of the key, see AVLTreeCoreT::multiset
+	AVLTREE_LABEL_FROZEN_ORDER, // index into a frozen copy, see AVLTree_Freeze
+	AVLTREE_NUM_LABELS // THIS NEEDS TO BE THE LAST ENUM IN THE LIST
+} AVLTreeLabel;
+
+// Geometry is kept out of AVLNode so trees that are only
+// used as data (e.g. bulk built) don't pay for a GameCube
+// per node.
+// NOTE: node must stay the first member so an AVLNode* that
+//       came from a drawable tree can be cast to AVLViewNode*.
+typedef struct AVLViewNode {
+	AVLNode node;
 
 	// geometry
 	GameCube cube;
@@ -42,491 +62,1145 @@ typedef struct AVLNode {
 	float x_vel;
 	float y_dest;
 	float y_vel;
-} AVLNode;
+
+	// tidy layout, see AVLTree_TidyMerge
+	float layout_offset; // x offset from parent
+	int layout_height;
+	bool layout_dirty;
+	AVLNode* thread_left;
+	AVLNode* thread_right;
+	float thread_left_offset;
+	float thread_right_offset;
+	AVLNode* extreme_left;
+	AVLNode* extreme_right;
+	float extreme_left_offset;
+	float extreme_right_offset;
+
+	// edge to parent, see AVLTree_UploadEdges
+	int edge_slot; // 1 based index into AVLTree::edges, 0 = not assigned yet
+	bool edge_dirty;
+} AVLViewNode;
+
+// Line from the top of a child to the bottom of its parent
+typedef struct {
+	Vertex vertices[2];
+} AVLEdge;
+
+typedef struct {
+	AVLNode** nodes;
+	int count;
+	int capacity;
+} AVLNodeList;
 
 typedef struct {
 	// data
-	int size;
-	AVLNode* root;
-	bool initializing;
+	AVLTreeCore core;
 
 	// opengl
 	GameCamera camera;
 	unsigned int vao;
 	unsigned int vbo;
+	unsigned int edge_vao;
+	unsigned int edge_vbo;
+	int edge_buffer_capacity; // in edges
 	unsigned int shader;
 	GameBackground background;
 
+	// Parent edges live in their own buffer so they only get
+	// rebuilt and uploaded when one of their endpoints moved
+	// or the child got a new parent.
+	AVLEdge* edges;
+	int num_edges;
+	int edges_capacity;
+	AVLNodeList dirty_edges;
+
 	// state machine stuff
 	AVLTreeState current_state;
 	AVLTreeState previous_state;
-	AVLNode* detached_node;
-	AVLNode* inserted_node;
+	AVLViewNode* detached_node;
+	bool insert_left; // side of compare_node the detached node lands on
 	AVLNode* compare_node;
 
+	// the last key inserted, inserts start comparing from wherever
+	// AVLTree_FingerStart says instead of from the root
+	AVLFingerT<AVLNode> finger;
+
 	// These are used for left_right rotations and
 	// right_left rotations. It makes the state 
 	// machine code a bit simpler than it otherwise
 	// would be.
 	bool left_rotate;
 	bool right_rotate;
+
+	// order statistics: node labels can show subtree sizes
+	// instead of keys and select walks down to the kth key
+	AVLTreeLabel label;
+	AVLNode* select_node;
+	int select_k;
+
+	// labels can also show where each key ends up in memory once
+	// the tree is frozen
+	AVLFrozenTree frozen;
+
+	// range query: walk down to the lower bound of
+	// [range_low, range_high] then step through successors
+	int range_low;
+	int range_high;
+	AVLNode* range_node;
+	AVLNode* range_first;
+	AVLNode* range_end;
+
+	// split/join: the tree is split around one of its keys, which
+	// hovers over the two halves until they are joined back up.
+	// core.root holds the left half and the hovering key is the
+	// detached node.
+	AVLNode* split_right;
+
+	// history: every insert, and each rotation step it took, is kept
+	// as a persistent version that b/f scrub back and forth through.
+	// Keys never leave the tree so any version can be shown by
+	// relinking the live nodes, which are looked up by key.
+	AVLPersistentTree history;
+	int scrub_version;
+	AVLNode* nodes_by_key[MAX_DIGITS];
+
+	// rebalance as a rank balanced (weak AVL) tree instead, see
+	// AVLWeak_Insert. Deleted keys keep their node in nodes_by_key
+	// for the versions in history that still have them.
+	bool weak;
+
+	// every node an animated insert or search walks through counts
+	// a visit, which 'h' colors the nodes by, see AVLHeat
+	AVLHeat heat;
+	bool show_heat;
+	uint64_t heat_colored_visits; // heat.visits when the colors were last set
+
+	// Nodes that were given new destinations by the last
+	// layout. AVLTREE_ROTATING only has to wait on these.
+	AVLNodeList animating_nodes;
 } AVLTree;
 
+static inline AVLViewNode* AVLTree_View(AVLNode* node) {
+	return (AVLViewNode*)node;
+}
+
+static void AVLNodeList_Push(AVLNodeList* list, AVLNode* node) {
+	assert(list);
+	assert(node);
+
+	if(list->count == list->capacity) {
+		int new_capacity = list->capacity ? (2 * list->capacity) : 64;
+		AVLNode** new_nodes = (AVLNode**)realloc(list->nodes, (size_t)new_capacity * sizeof(AVLNode*));
+		if(!new_nodes) {
+			fprintf(stderr, "Couldn't realloc for AVLNodeList\n");
+			return;
+		}
+		list->nodes = new_nodes;
+		list->capacity = new_capacity;
+	}
+
+	list->nodes[list->count++] = node;
+}
+
+
+/* Streams nodes from a tree in BFS fashion, e.g.:
+ 
+AVLTreeBFSNode bfs_node = AVLTree_BFS(avl_tree);
+while(bfs_node.node) {                          
+	AVLNode* node = bfs_node.node;                 
+	bfs_node = AVLTree_BFS(avl_tree);          
+}                                               
+ *
+ */
+typedef struct {
+	AVLNode* node;
+	int level;
+	uint64_t level_index;
+} AVLTreeBFSNode;
+
+// TODO: Restart if called w/ new tree.
+static AVLTreeBFSNode AVLTree_BFS(AVLTree* avl_tree) {
+	AVLTreeBFSNode result;
+	result.node = NULL;
+	result.level = -1;
+	result.level_index = 0;
+
+	if(!avl_tree || (!avl_tree->core.root && !avl_tree->split_right)) {
+		return result;
+	}
+
+	// NOTE: level and level_index come straight from the
+	//       node's slot so only nodes need to be queued
+	static AVLTree* tree = NULL;
+	static AVLNode* node_queue[MAX_DIGITS];
+	static int push;
+	static int pop;
+	static int size;
+	if(tree == NULL) {
+		push = 0;
+		pop = 0;
+		size = 0;
+		tree = avl_tree;
+
+		// a split tree streams both halves
+		AVLNode* roots[2] = {avl_tree->core.root, avl_tree->split_right};
+		for(int i = 0; i < 2; ++i) {
+			if(roots[i]) {
+				node_queue[push] = roots[i];
+				++push;
+				++size;
+			}
+		}
+	}
+
+	if(size > 0) {
+		AVLNode* node = node_queue[pop];
+		pop = (pop + 1) % MAX_DIGITS;
+		--size;
+
+		if(node->left) {
+			node_queue[push] = node->left;
+			push = (push + 1) % MAX_DIGITS;
+			++size;
+		}
+
+		if(node->right) {
+			node_queue[push] = node->right;
+			push = (push + 1) % MAX_DIGITS;
+			++size;
+		}
+
+		result.node = node;
+		AVLTree_GetNodeSlot(&avl_tree->core, node, &result.level, &result.level_index);
+		return result;
+	}
+
+	tree = NULL;
+	return result;
+}
 
 /*********************************************
- * AVLTree data functions					 *
+ * State machine helper functions			 *
  *********************************************/
-static int AVLTree_GetHeight(const AVLNode* node) {
-	return (node == NULL) ? -1 : node->height;
+// Redraws the digits on a node's cube with whatever avl_tree->label
+// says to show, wherever the cube currently is.
+static void AVLTree_RefreshLabel(AVLTree* avl_tree, AVLNode* node) {
+	if(node == NULL) {
+		return;
+	}
+
+	GameCube* cube = &AVLTree_View(node)->cube;
+	int label = node->val;
+	if(avl_tree->label == AVLTREE_LABEL_SUBTREE_SIZES) {
+		// NOTE: GenDigit only draws 2 digits so the root of
+		//       a completely full tree (100 nodes) shows 99
+		label = (node->subtree_size < MAX_DIGITS) ? node->subtree_size : (MAX_DIGITS - 1);
+	}
+	else if(avl_tree->label == AVLTREE_LABEL_COUNTS) {
+		int count = node->duplicates + 1;
+		label = (count < MAX_DIGITS) ? count : (MAX_DIGITS - 1);
+	}
+	else if(avl_tree->label == AVLTREE_LABEL_FROZEN_ORDER) {
+		// 0 for a key that isn't in the frozen copy
+		int index = AVLFrozen_Find(&avl_tree->frozen, node->val);
+		label = (index < MAX_DIGITS) ? index : (MAX_DIGITS - 1);
+	}
+
+	// cube_vertices[0] is the top left front corner
+	float x = cube->cube_vertices[0].x + 0.5f;
+	float y = cube->cube_vertices[0].y - 0.5f;
+	float z = cube->cube_vertices[0].z - 0.5f;
+	memset(cube->digit_vertices, 0, sizeof(cube->digit_vertices));
+	GenDigit(x, y, z, label, cube);
 }
 
-static void AVLTree_UpdateHeight(AVLNode* node) {
-	assert(node);
+// Nodes at rest are blue, or purple once they count more than
+// one copy of their key. The heat map goes from blue to red instead
+// the more visits a node has, on a log scale since every walk
+// visits the root.
+static inline void AVLTree_ResetColor(AVLTree* avl_tree, AVLNode* node) {
+	if(avl_tree->show_heat) {
+		float heat = 0.0f;
+		if(avl_tree->heat.max_visits > 0) {
+			heat = logf(1.0f + (float)node->visits) / logf(1.0f + (float)avl_tree->heat.max_visits);
+		}
+		GameCube_SetColor(&AVLTree_View(node)->cube, heat, 0.0f, 1.0f - heat);
+	}
+	else if(node->duplicates > 0) {
+		GameCube_SetColor(&AVLTree_View(node)->cube, 0.6f, 0.0f, 1.0f);
+	}
+	else {
+		GameCube_SetColor(&AVLTree_View(node)->cube, 0.0f, 0.0f, 1.0f);
+	}
+}
+
+// Walks in order for the same reason as AVLTree_RefreshFrozenLabels
+static void AVLTree_ResetColors(AVLTree* avl_tree) {
+	for(AVLNode* node = AVLTree_First(&avl_tree->core); node; node = AVLTree_Next(node)) {
+		AVLTree_ResetColor(avl_tree, node);
+	}
+	avl_tree->heat_colored_visits = avl_tree->heat.visits;
+}
+
+// Refreezes the tree and relabels every node in it. Walks the tree
+// in order instead of with AVLTree_BFS, which callers might be in
+// the middle of.
+static void AVLTree_RefreshFrozenLabels(AVLTree* avl_tree) {
+	AVLTree_Freeze(&avl_tree->core, &avl_tree->frozen);
+	for(AVLNode* node = AVLTree_First(&avl_tree->core); node; node = AVLTree_Next(node)) {
+		AVLTree_RefreshLabel(avl_tree, node);
+	}
+}
+
+// A rotation or insert changes the size of a node and its children
+static inline void AVLTree_RefreshLabels(AVLTree* avl_tree, AVLNode* node) {
+	if((avl_tree->label == AVLTREE_LABEL_KEYS) || (node == NULL)) {
+		return;
+	}
+
+	// Rotations keep the keys in the same order so frozen indices
+	// only move when a key comes or goes. A split tree keeps the
+	// labels it had until it's joined back up.
+	if(avl_tree->label == AVLTREE_LABEL_FROZEN_ORDER) {
+		if(!avl_tree->split_right && (avl_tree->frozen.size != avl_tree->core.size)) {
+			AVLTree_RefreshFrozenLabels(avl_tree);
+		}
+		return;
+	}
+
+	AVLTree_RefreshLabel(avl_tree, node);
+	AVLTree_RefreshLabel(avl_tree, node->left);
+	AVLTree_RefreshLabel(avl_tree, node->right);
+}
+
+static inline bool AVLTree_AnimationFinished(AVLViewNode* node) {
+	float x_dist = fabs(node->x_dest - node->cube.cube_vertices[0].x);
+	float y_dist = fabs(node->y_dest - node->cube.cube_vertices[0].y);
+	bool x_finished = x_dist <= AVL_THRESHOLD;
+	bool y_finished = y_dist <= AVL_THRESHOLD;
+	if(x_finished) {
+		node->x_vel = 0.0f;
+	}
+	if(y_finished) {
+		node->y_vel = 0.0f;
+	}
+
+	return (node->x_vel == 0.0f) && (node->y_vel == 0.0f);
+}
+
+// Automatically syncs x_vel and y_vel so they land at the same time.
+inline void AVLTree_SetVelocity(AVLViewNode* node) {
+	float x_dist = node->x_dest - node->cube.cube_vertices[0].x;
+	float y_dist = node->y_dest - node->cube.cube_vertices[0].y;
+
+	float units_per_frame = global_avl_tree_units_per_second / global_avl_tree_frames_per_second;
+	float x_frames_to_reach_dest = fabs(x_dist / units_per_frame);
+	float y_frames_to_reach_dest = fabs(y_dist / units_per_frame);
+	int frames_to_reach_dest;
+	if(x_frames_to_reach_dest < y_frames_to_reach_dest) {
+		frames_to_reach_dest = (int)(y_frames_to_reach_dest + 1);
+	}
+	else {
+		frames_to_reach_dest = (int)(x_frames_to_reach_dest + 1);
+	}
+	node->x_vel = x_dist / (float)frames_to_reach_dest;
+	node->y_vel = y_dist / (float)frames_to_reach_dest;
+}
+
+INTERNAL void AVLTree_DrawBackground(GameBackground gb, float window_width, float window_height) {
+	GLCall(glBindVertexArray(gb.vao));
+	GLCall(glBindBuffer(GL_ARRAY_BUFFER, gb.vbo));
+	GLCall(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gb.ibo));
+	glBindTexture(GL_TEXTURE_2D, gb.texture);
+	glUseProgram(gb.shader);
+
+	int projection_location = glGetUniformLocation(gb.shader, "projection");
+	glm::mat4 projection = glm::perspective(glm::radians(75.0f), window_width / window_height, 0.1f, 100.0f);
+	glUniformMatrix4fv(projection_location, 1, GL_FALSE, glm::value_ptr(projection));
+
+	glDisable(GL_DEPTH_TEST);
+	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, (void*)0);
+
+	GLCall(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0));
+	GLCall(glBindBuffer(GL_ARRAY_BUFFER, 0));
+	GLCall(glBindVertexArray(0));
+}
+
+/*********************************************
+ * Edge functions                            *
+ *********************************************/
+static void AVLTree_MarkEdgeDirty(AVLTree* avl_tree, AVLNode* node) {
+	if(node == NULL) {
+		return;
+	}
 
-	int hl = AVLTree_GetHeight(node->left);
-	int hr = AVLTree_GetHeight(node->right);
-	node->height = (hl > hr) ? (hl + 1) : (hr + 1);
+	AVLViewNode* view = AVLTree_View(node);
+	if(!view->edge_dirty) {
+		view->edge_dirty = true;
+		AVLNodeList_Push(&avl_tree->dirty_edges, node);
+	}
 }
 
-static int AVLTree_GetBalance(const AVLNode* node) {
+// A node moving drags the edge to its parent and the
+// edges to both of its children along with it.
+static inline void AVLTree_MarkEdgesAroundDirty(AVLTree* avl_tree, AVLNode* node) {
 	assert(node);
-	int hl = AVLTree_GetHeight(node->left);
-	int hr = AVLTree_GetHeight(node->right);
-	return hl - hr;
+
+	AVLTree_MarkEdgeDirty(avl_tree, node);
+	AVLTree_MarkEdgeDirty(avl_tree, node->left);
+	AVLTree_MarkEdgeDirty(avl_tree, node->right);
 }
 
-static AVLNode* AVLTree_RightRotate(AVLNode* const node) {
+// lines will go from center top of child
+// to center bottom of parent
+// TODO: Change this if I ever #define node width
+static void AVLTree_BuildEdge(AVLNode* node, AVLEdge* edge) {
 	assert(node);
+	assert(edge);
+
+	AVLViewNode* view = AVLTree_View(node);
+	if(node->parent == NULL) {
+		// root has no parent, leave a zero length line
+		memset(edge, 0, sizeof(AVLEdge));
+		return;
+	}
+
+	AVLViewNode* parent = AVLTree_View(node->parent);
+	if(node == node->parent->left) {
+		// line will go from top right of this cube
+		// to bottom left of parent
+		edge->vertices[0] = view->cube.cube_vertices[1];
+		edge->vertices[1] = parent->cube.cube_vertices[5];
+		edge->vertices[0].x -= 0.5f;
+		edge->vertices[1].x += 0.5f;
+	}
+	else {
+		// line will go from top left of this cube
+		// to bottom right of parent
+		edge->vertices[0] = view->cube.cube_vertices[0];
+		edge->vertices[1] = parent->cube.cube_vertices[3];
+		edge->vertices[0].x += 0.5f;
+		edge->vertices[1].x -= 0.5f;
+	}
 
-	AVLNode* const parent   = node->parent;
-	AVLNode* const left     = node->left;
-	AVLNode* const new_left = left->right;
+	for(int i = 0; i < 2; ++i) {
+		edge->vertices[i].z -= 0.5f;
+		edge->vertices[i].r = 1.0f;
+		edge->vertices[i].g = 1.0f;
+		edge->vertices[i].b = 153.0f / 255.0f;
+	}
+}
 
-	// shift left node to this node's position
-	node->parent = left;
-	left->right = node;
+// Rebuilds dirty edges and sends just those to the GPU. Expects 
+// the edge vbo to be bound. Nothing is done when no edge changed.
+static void AVLTree_UploadEdges(AVLTree* avl_tree) {
+	assert(avl_tree);
 
-	// attach left's right subtree to this node's left
-	node->left = new_left;
-	if(new_left != NULL) {
-		new_left->parent = node;
+	AVLNodeList* dirty = &avl_tree->dirty_edges;
+	if(dirty->count == 0) {
+		return;
 	}
 
-	// attach parent to new node
-	left->parent = parent;
-	if(parent != NULL) {
-		if(parent->left == node) {
-			parent->left = left;
+	for(int i = 0; i < dirty->count; ++i) {
+		AVLViewNode* view = AVLTree_View(dirty->nodes[i]);
+		if(view->edge_slot == 0) {
+			if(avl_tree->num_edges == avl_tree->edges_capacity) {
+				int new_capacity = avl_tree->edges_capacity ? (2 * avl_tree->edges_capacity) : 64;
+				AVLEdge* new_edges = (AVLEdge*)realloc(avl_tree->edges, (size_t)new_capacity * sizeof(AVLEdge));
+				if(!new_edges) {
+					fprintf(stderr, "Couldn't realloc for AVLEdge\n");
+					view->edge_dirty = false;
+					continue;
+				}
+				avl_tree->edges = new_edges;
+				avl_tree->edges_capacity = new_capacity;
+			}
+			view->edge_slot = ++avl_tree->num_edges;
 		}
-		else {
-			parent->right = left;
+		AVLTree_BuildEdge(&view->node, &avl_tree->edges[view->edge_slot - 1]);
+	}
+
+	if(avl_tree->edge_buffer_capacity < avl_tree->num_edges) {
+		// buffer has to grow so send everything over once
+		avl_tree->edge_buffer_capacity = avl_tree->edges_capacity;
+		GLCall(glBufferData(GL_ARRAY_BUFFER, avl_tree->edge_buffer_capacity * sizeof(AVLEdge), 
+					        NULL, GL_DYNAMIC_DRAW));
+		GLCall(glBufferSubData(GL_ARRAY_BUFFER, 0, avl_tree->num_edges * sizeof(AVLEdge), avl_tree->edges));
+		for(int i = 0; i < dirty->count; ++i) {
+			AVLTree_View(dirty->nodes[i])->edge_dirty = false;
 		}
 	}
+	else {
+		for(int i = 0; i < dirty->count; ++i) {
+			AVLViewNode* view = AVLTree_View(dirty->nodes[i]);
+			if(view->edge_dirty && view->edge_slot) {
+				GLCall(glBufferSubData(GL_ARRAY_BUFFER, (view->edge_slot - 1) * sizeof(AVLEdge), 
+							           sizeof(AVLEdge), &avl_tree->edges[view->edge_slot - 1]));
+			}
+			view->edge_dirty = false;
+		}
+	}
+	dirty->count = 0;
+}
+
+static inline void AVLTree_MoveCube(AVLViewNode* node) {
+	GameCube* cube = &node->cube;
+
+	int cube_vertices = sizeof(cube->cube_vertices) / sizeof(Vertex);
+	for(int j = 0; j < cube_vertices; ++j) {
+		cube->cube_vertices[j].x += node->x_vel;
+		cube->cube_vertices[j].y += node->y_vel;
+	}
+	int digit_vertices = sizeof(cube->digit_vertices) / sizeof(Vertex);
+	for(int j = 0; j < digit_vertices; ++j) {
+		cube->digit_vertices[j].x += node->x_vel;
+		cube->digit_vertices[j].y += node->y_vel;
+	}
+}
+
+static void AVLTree_UpdateGeometry(AVLTree* avl_tree) {
+	assert(avl_tree);
+
+	if(avl_tree->current_state == AVLTREE_PAUSED) {
+		return;
+	}
+
+	// Only nodes the last layout gave a new destination can
+	// have a velocity, so a static tree does no work here.
+	for(int i = 0; i < avl_tree->animating_nodes.count; ++i) {
+		AVLNode* node = avl_tree->animating_nodes.nodes[i];
+		AVLViewNode* view = AVLTree_View(node);
+		if((view->x_vel != 0.0f) || (view->y_vel != 0.0f)) {
+			AVLTree_MoveCube(view);
+			AVLTree_MarkEdgesAroundDirty(avl_tree, node);
+		}
+	}
+	
+	// NOTE: a split key sits through AVLTREE_SPLIT, which never
+	//       checks on it, so it stops itself once it lands
+	if(avl_tree->detached_node && !AVLTree_AnimationFinished(avl_tree->detached_node)) {
+		AVLTree_MoveCube(avl_tree->detached_node);
+	}
+}
 
-	// NOTE: must be in this order
-	//       because height of left
-	//       relies on new height of node
-	AVLTree_UpdateHeight(node);
-	AVLTree_UpdateHeight(left);
+/* Tidy tree layout (Reingold-Tilford).
+ *
+ * Each node stores its x offset from its parent. Offsets are computed
+ * bottom up: the two child subtrees of a node are pushed apart until
+ * the right contour of the left subtree and the left contour of the 
+ * right subtree are at least one node separation apart on every level
+ * they share, and the children are centered under the node.
+ *
+ * Walking a contour follows children when there are any and threads
+ * otherwise. A thread links the bottom of the shorter subtree's outer
+ * contour to the next level of the taller one, so contours can be
+ * walked in time proportional to their height without visiting the
+ * interior of a subtree. That makes the full layout O(n).
+ *
+ * Absolute positions come from summing offsets top down. Only nodes
+ * flagged with layout_dirty (and their ancestors) get merged again
+ * after an insert or rotation. Subtrees whose absolute position did
+ * not change are skipped entirely on the way down.
+ *
+ * The view never holds more than MAX_DIGITS nodes (one per key, see
+ * nodes_by_key), far below AVL_PARALLEL_CUTOFF, so all of this stays
+ * on the main thread.
+ */
+#define AVL_NODE_SEPARATION (global_node_width + global_node_margin)
 
-	// return left node which is taking the place of the node
-	// passed in
-	return left;
+static inline AVLNode* AVLTree_NextLeftContour(AVLNode* node, float* offset) {
+	if(node->left) {
+		*offset += AVLTree_View(node->left)->layout_offset;
+		return node->left;
+	}
+	if(node->right) {
+		*offset += AVLTree_View(node->right)->layout_offset;
+		return node->right;
+	}
+	AVLViewNode* view = AVLTree_View(node);
+	*offset += view->thread_left_offset;
+	return view->thread_left;
+}
+
+static inline AVLNode* AVLTree_NextRightContour(AVLNode* node, float* offset) {
+	if(node->right) {
+		*offset += AVLTree_View(node->right)->layout_offset;
+		return node->right;
+	}
+	if(node->left) {
+		*offset += AVLTree_View(node->left)->layout_offset;
+		return node->left;
+	}
+	AVLViewNode* view = AVLTree_View(node);
+	*offset += view->thread_right_offset;
+	return view->thread_right;
 }
 
-static AVLNode* AVLTree_LeftRotate(AVLNode* const node) {
+// Positions the children of node relative to it. Both child
+// subtrees must already be merged.
+static void AVLTree_TidyMerge(AVLNode* node) {
 	assert(node);
 
-	AVLNode* const parent    = node->parent;
-	AVLNode* const right     = node->right;
-	AVLNode* const new_right = right->left;
+	AVLViewNode* view = AVLTree_View(node);
+	AVLNode* left = node->left;
+	AVLNode* right = node->right;
 
-	// shift right node to this node's position
-	node->parent = right;
-	right->left = node;
+	if(!left && !right) {
+		view->layout_height = 0;
+		view->extreme_left = node;
+		view->extreme_right = node;
+		view->extreme_left_offset = 0.0f;
+		view->extreme_right_offset = 0.0f;
+		return;
+	}
 
-	// attach right's left subtree to this node's right
-	node->right = new_right;
-	if(new_right) {
-		new_right->parent = node;
+	// a single child sits half a separation off to its side
+	if(!right || !left) {
+		AVLNode* child = left ? left : right;
+		AVLViewNode* child_view = AVLTree_View(child);
+		child_view->layout_offset = left ? (AVL_NODE_SEPARATION / -2.0f) : (AVL_NODE_SEPARATION / 2.0f);
+
+		view->layout_height = child_view->layout_height + 1;
+		view->extreme_left = child_view->extreme_left;
+		view->extreme_right = child_view->extreme_right;
+		view->extreme_left_offset = child_view->extreme_left_offset + child_view->layout_offset;
+		view->extreme_right_offset = child_view->extreme_right_offset + child_view->layout_offset;
+		return;
 	}
 
-	// attach parent to new node
-	right->parent = parent;
-	if(parent != NULL) {
-		if(parent->left == node) {
-			parent->left = right;
+	AVLViewNode* left_view = AVLTree_View(left);
+	AVLViewNode* right_view = AVLTree_View(right);
+	int left_height = left_view->layout_height;
+	int right_height = right_view->layout_height;
+	int shared_levels = ((left_height < right_height) ? left_height : right_height) + 1;
+
+	// l walks the right contour of the left subtree and r walks the 
+	// left contour of the right subtree. Offsets are relative to the
+	// root of their own subtree.
+	AVLNode* l = left;
+	AVLNode* r = right;
+	float l_offset = 0.0f;
+	float r_offset = 0.0f;
+	float separation = AVL_NODE_SEPARATION;
+	for(int i = 0; ; ++i) {
+		float needed = l_offset - r_offset + AVL_NODE_SEPARATION;
+		if(separation < needed) {
+			separation = needed;
 		}
-		else {
-			parent->right = right;
+		if(i + 1 == shared_levels) {
+			break;
 		}
+		l = AVLTree_NextRightContour(l, &l_offset);
+		r = AVLTree_NextLeftContour(r, &r_offset);
+	}
+
+	left_view->layout_offset = separation / -2.0f;
+	right_view->layout_offset = separation / 2.0f;
+	view->layout_height = ((left_height > right_height) ? left_height : right_height) + 1;
+
+	// deepest nodes on the outside of this subtree
+	AVLViewNode* extreme_left_owner = (left_height >= right_height) ? left_view : right_view;
+	AVLViewNode* extreme_right_owner = (right_height >= left_height) ? right_view : left_view;
+	view->extreme_left = extreme_left_owner->extreme_left;
+	view->extreme_left_offset = extreme_left_owner->extreme_left_offset + extreme_left_owner->layout_offset;
+	view->extreme_right = extreme_right_owner->extreme_right;
+	view->extreme_right_offset = extreme_right_owner->extreme_right_offset + extreme_right_owner->layout_offset;
+
+	// thread the shorter subtree's outer contour into the taller one
+	if(left_height < right_height) {
+		float target_offset = r_offset;
+		AVLNode* target = AVLTree_NextLeftContour(r, &target_offset);
+		AVLViewNode* bottom = AVLTree_View(left_view->extreme_left);
+		bottom->thread_left = target;
+		bottom->thread_left_offset = (right_view->layout_offset + target_offset) - 
+			                         (left_view->layout_offset + left_view->extreme_left_offset);
+	}
+	else if(right_height < left_height) {
+		float target_offset = l_offset;
+		AVLNode* target = AVLTree_NextRightContour(l, &target_offset);
+		AVLViewNode* bottom = AVLTree_View(right_view->extreme_right);
+		bottom->thread_right = target;
+		bottom->thread_right_offset = (left_view->layout_offset + target_offset) - 
+			                          (right_view->layout_offset + right_view->extreme_right_offset);
+	}
+}
+
+static void AVLTree_TidyMergeSubtree(AVLNode* node) {
+	if(node == NULL) {
+		return;
 	}
 
-	// NOTE: must be in this order
-	//       because height of right
-	//       relies on new height of node
-	AVLTree_UpdateHeight(node);
-	AVLTree_UpdateHeight(right);
+	AVLTree_TidyMergeSubtree(node->left);
+	AVLTree_TidyMergeSubtree(node->right);
+	AVLTree_TidyMerge(node);
+}
+
+// Only descends into dirty nodes. Clean subtrees keep their offsets.
+static void AVLTree_TidyMergeDirty(AVLNode* node) {
+	if((node == NULL) || !AVLTree_View(node)->layout_dirty) {
+		return;
+	}
 
-	// return right node which is taking the place of the node
-	// passed in
-	return right;
+	AVLTree_TidyMergeDirty(node->left);
+	AVLTree_TidyMergeDirty(node->right);
+	AVLTree_TidyMerge(node);
 }
 
-void AVLTree_Insert(AVLTree *const tree, const int val) {
-	assert(tree);
-	assert(-1 < val);
+// Sums offsets top down into destinations. Nodes that get a new
+// destination are queued up for AVLTREE_ROTATING to wait on.
+static void AVLTree_TidyPlaceSubtree(AVLTree* avl_tree, AVLNode* node, float x, bool force) {
+	if(node == NULL) {
+		return;
+	}
 
-	// normal BST insert
-	AVLNode* parent_node = NULL;
-	AVLNode* current_node = tree->root;
-	while(current_node != NULL) {
-		parent_node = current_node;
-		if(val < current_node->val) {
-			current_node = current_node->left;
-		}
-		else if(val > current_node->val) {
-			current_node = current_node->right;
-		}
-		else {
-			return;
-		}
+	AVLViewNode* view = AVLTree_View(node);
+	float y = -(float)node->depth * global_y_spacing;
+
+	// destination is based on top left front corner of cube
+	float x_dest = x - 0.5f;
+	float y_dest = y + 0.5f;
+	if(!force && !view->layout_dirty && (view->x_dest == x_dest) && (view->y_dest == y_dest)) {
+		return;
 	}
 
-	current_node = (AVLNode*)calloc(1, sizeof(AVLNode));
-	current_node->parent = parent_node;
-	current_node->val = val;
-	tree->size++;
-	if(parent_node == NULL) {
-		tree->root = current_node;
+	// children of a dirty node may have been re-parented
+	if(view->layout_dirty) {
+		AVLTree_MarkEdgesAroundDirty(avl_tree, node);
 	}
-	else {
-		// NOTE: for generic keys, key comparison might
-		//       be slow so we can avoid that here if necessary
-		if(val < parent_node->val) {
-			parent_node->left = current_node;
-		}
-		else {
-			parent_node->right = current_node;
-		}
+	view->layout_dirty = false;
+	if((view->x_dest != x_dest) || (view->y_dest != y_dest) || force) {
+		view->x_dest = x_dest;
+		view->y_dest = y_dest;
+		AVLTree_SetVelocity(view);
+		AVLNodeList_Push(&avl_tree->animating_nodes, node);
 	}
 
-	// go back up tree
-	// adjust heights
-	// check for imbalance
-	// rotate if necessary
-	current_node = current_node->parent;
-	while(current_node != NULL) {
-		AVLTree_UpdateHeight(current_node);
-		int balance = AVLTree_GetBalance(current_node);
+	if(node->left) {
+		AVLTree_TidyPlaceSubtree(avl_tree, node->left, x + AVLTree_View(node->left)->layout_offset, force);
+	}
+	if(node->right) {
+		AVLTree_TidyPlaceSubtree(avl_tree, node->right, x + AVLTree_View(node->right)->layout_offset, force);
+	}
+}
 
-		if((balance > 1) && (val < current_node->left->val)) {
-			current_node = AVLTree_RightRotate(current_node);
-		}
-		else if((balance < -1) && (val > current_node->right->val)) {
-			current_node = AVLTree_LeftRotate(current_node);
-		}
-		else if((balance > 1) && (val > current_node->left->val)) {
-			AVLTree_LeftRotate(current_node->left);
-			current_node = AVLTree_RightRotate(current_node);
-		}
-		else if((balance < -1) && (val < current_node->right->val)) {
-			AVLTree_RightRotate(current_node->right);
-			current_node = AVLTree_LeftRotate(current_node);
+static void AVLTree_SetEntireTreeDest(AVLTree* avl_tree) {
+	assert(avl_tree);
+	assert(avl_tree->core.root);
+
+	avl_tree->animating_nodes.count = 0;
+	AVLTree_TidyMergeSubtree(avl_tree->core.root);
+	AVLTree_TidyPlaceSubtree(avl_tree, avl_tree->core.root, 0.0f, true);
+}
+
+// Flags a node whose children changed. Its ancestors are flagged 
+// too since their subtrees changed with it.
+static void AVLTree_MarkLayoutDirty(AVLNode* node) {
+	while(node) {
+		AVLTree_View(node)->layout_dirty = true;
+		node = node->parent;
+	}
+}
+
+// Incremental version of AVLTree_SetEntireTreeDest. Only dirty
+// nodes are merged again and only nodes whose destination moved
+// end up animating.
+static void AVLTree_UpdateLayout(AVLTree* avl_tree) {
+	assert(avl_tree);
+	assert(avl_tree->core.root);
+
+	avl_tree->animating_nodes.count = 0;
+	AVLTree_TidyMergeDirty(avl_tree->core.root);
+	AVLTree_TidyPlaceSubtree(avl_tree, avl_tree->core.root, 0.0f, false);
+}
+
+// Where the detached node should head next on its way down:
+// the child it is about to be compared with, or the spot a new
+// leaf would take if that child doesn't exist yet.
+static float AVLTree_GetInsertDestX(AVLNode* compare_node, bool go_left) {
+	assert(compare_node);
+
+	AVLNode* child = go_left ? compare_node->left : compare_node->right;
+	if(child) {
+		return AVLTree_View(child)->x_dest;
+	}
+
+	float x_offset = go_left ? (AVL_NODE_SEPARATION / -2.0f) : (AVL_NODE_SEPARATION / 2.0f);
+	return AVLTree_View(compare_node)->x_dest + x_offset;
+}
+
+// How far a laid out subtree reaches to either side of its root.
+// Walks the outer contour the same way AVLTree_TidyMerge does.
+static float AVLTree_TidyLeftExtent(AVLNode* node) {
+	float offset = 0.0f;
+	float extent = 0.0f;
+	int height = AVLTree_View(node)->layout_height;
+	for(int i = 0; i < height; ++i) {
+		node = AVLTree_NextLeftContour(node, &offset);
+		if(offset < extent) {
+			extent = offset;
 		}
+	}
+	return extent;
+}
 
-		if(current_node->parent == NULL) {
-			tree->root = current_node;
+static float AVLTree_TidyRightExtent(AVLNode* node) {
+	float offset = 0.0f;
+	float extent = 0.0f;
+	int height = AVLTree_View(node)->layout_height;
+	for(int i = 0; i < height; ++i) {
+		node = AVLTree_NextRightContour(node, &offset);
+		if(extent < offset) {
+			extent = offset;
 		}
+	}
+	return extent;
+}
+
+// AVLTree_SetEntireTreeDest for a split tree: the halves are laid
+// out side by side and the split key hovers between them.
+static void AVLTree_SetSplitTreeDest(AVLTree* avl_tree) {
+	assert(avl_tree);
+	assert(avl_tree->detached_node);
+
+	avl_tree->animating_nodes.count = 0;
 
-		current_node = current_node->parent;
+	AVLNode* left = avl_tree->core.root;
+	if(left) {
+		AVLTree_TidyMergeSubtree(left);
+		float x = -AVL_NODE_SEPARATION - AVLTree_TidyRightExtent(left);
+		AVLTree_TidyPlaceSubtree(avl_tree, left, x, true);
 	}
+
+	AVLNode* right = avl_tree->split_right;
+	if(right) {
+		AVLTree_TidyMergeSubtree(right);
+		float x = AVL_NODE_SEPARATION - AVLTree_TidyLeftExtent(right);
+		AVLTree_TidyPlaceSubtree(avl_tree, right, x, true);
+	}
+
+	AVLViewNode* key = avl_tree->detached_node;
+	key->x_dest = -0.5f;
+	key->y_dest = 0.5f + global_y_insert_node_start;
+	AVLTree_SetVelocity(key);
 }
 
-/* Streams nodes from a tree in BFS fashion, e.g.:
- 
-AVLTreeBFSNode bfs_node = AVLTree_BFS(avl_tree);
-while(bfs_node.node) {                          
-	AVLNode* node = bfs_node.node;                 
-	bfs_node = AVLTree_BFS(avl_tree);          
-}                                               
- *
- */
-typedef struct {
-	AVLNode* node;
-	int level;
-	uint64_t level_index;
-} AVLTreeBFSNode;
+// Split and join re-parent nodes all over the tree so every
+// edge and subtree size label gets redone
+static void AVLTree_RefreshAllEdgesAndLabels(AVLTree* avl_tree) {
+	// an emptied tree has no nodes left to refreeze it through
+	if((avl_tree->label == AVLTREE_LABEL_FROZEN_ORDER) && (avl_tree->core.root == NULL)) {
+		AVLTree_Freeze(&avl_tree->core, &avl_tree->frozen);
+	}
 
-// TODO: Restart if called w/ new tree.
-static AVLTreeBFSNode AVLTree_BFS(AVLTree* avl_tree) {
-	AVLTreeBFSNode result;
-	result.node = NULL;
-	result.level = -1;
-	result.level_index = 0;
+	AVLTreeBFSNode bfs_node = AVLTree_BFS(avl_tree);
+	while(bfs_node.node) {
+		AVLTree_MarkEdgeDirty(avl_tree, bfs_node.node);
+		AVLTree_RefreshLabels(avl_tree, bfs_node.node);
+		bfs_node = AVLTree_BFS(avl_tree);
+	}
+}
 
-	if(!avl_tree || !avl_tree->root) {
-		return result;
+// Splits the tree around a random key, see AVLTree_Split
+static void AVLTree_StartSplit(AVLTree* avl_tree) {
+	assert(avl_tree);
+	assert(avl_tree->core.root);
+
+	AVLTreeCore* core = &avl_tree->core;
+	AVLNode* pick = AVLTree_Select(core, rand() % core->size);
+	AVLNode* left = NULL;
+	AVLNode* right = NULL;
+	AVLNode* key = AVLTree_Split(core, core->root, pick->val, &left, &right);
+	assert(key == pick);
+	AVLTree_SetSubtreeSlots(left, 0, 0);
+	AVLTree_SetSubtreeSlots(right, 0, 0);
+
+	core->root = left;
+	core->size--;
+	avl_tree->split_right = right;
+	avl_tree->detached_node = AVLTree_View(key);
+	GameCube_SetColor(&avl_tree->detached_node->cube, 1.0f, 140.0f / 255.0f, 0.0f);
+	AVLTree_MarkEdgeDirty(avl_tree, key);
+	AVLTree_RefreshLabel(avl_tree, key);
+
+	AVLTree_SetSplitTreeDest(avl_tree);
+	AVLTree_RefreshAllEdgesAndLabels(avl_tree);
+}
+
+// Joins the halves back together around the hovering key, see AVLTree_Join
+static void AVLTree_FinishSplit(AVLTree* avl_tree) {
+	assert(avl_tree);
+	assert(avl_tree->detached_node);
+
+	AVLNode* key = &avl_tree->detached_node->node;
+	AVLNode* root = AVLTree_Join(avl_tree->core.root, key, avl_tree->split_right);
+	AVLTree_SetSubtreeSlots(root, 0, 0);
+
+	avl_tree->core.root = root;
+	avl_tree->core.size++;
+	avl_tree->split_right = NULL;
+	AVLTree_ResetColor(avl_tree, key);
+	avl_tree->detached_node = NULL;
+
+	AVLTree_SetEntireTreeDest(avl_tree);
+	AVLTree_RefreshAllEdgesAndLabels(avl_tree);
+
+	// joining reshapes the tree without an insert to replay
+	AVLPersistent_PushCopy(&avl_tree->history, root);
+}
+
+// A deleted key keeps its node for history, so inserting it again
+// moves the new node into the old one instead. That way a key only
+// ever has one node and one edge slot.
+static AVLNode* AVLTree_AdoptKeyNode(AVLTree* avl_tree, AVLViewNode* node) {
+	AVLNode* old = avl_tree->nodes_by_key[node->node.val];
+	if(old == NULL) {
+		avl_tree->nodes_by_key[node->node.val] = &node->node;
+		return &node->node;
 	}
 
-	static AVLTree* tree = NULL;
-	static AVLNode* node_queue[MAX_DIGITS];
-	static uint64_t level_indices[MAX_DIGITS];
-	static int push;
-	static int pop;
-	static int size;
-	static int level;
-	static int nodes_at_level;
-	static int i;
-	if(tree == NULL) {
-		push = 0;
-		pop = 0;
-		size = 0;
-		level = 0;
-		i = 0;
-		tree = avl_tree;
-		node_queue[push] = avl_tree->root;
-		level_indices[push] = 0;
-		++push;
-		++size;
-
-		// NOTE: This needs to come after ++size
-		nodes_at_level = size;
-	}
-
-	while(size > 0) {
-		while(i++ < nodes_at_level) {
-			AVLNode* node = node_queue[pop];
-			uint64_t level_index = level_indices[pop];
-			pop = (pop + 1) % MAX_DIGITS;
-			--size;
-
-			if(node->left) {
-				node_queue[push] = node->left;
-				level_indices[push] = 2 * level_index;
-				push = (push + 1) % MAX_DIGITS;
-				++size;
-			}
+	AVLViewNode* old_view = AVLTree_View(old);
+	int edge_slot = old_view->edge_slot;
+	bool edge_dirty = old_view->edge_dirty;
+	*old_view = *node;
+	old_view->edge_slot = edge_slot;
+	old_view->edge_dirty = edge_dirty;
+	AVLNodePool_Free(&avl_tree->core.pool, node);
 
-			if(node->right) {
-				node_queue[push] = node->right;
-				level_indices[push] = (2 * level_index) + 1;
-				push = (push + 1) % MAX_DIGITS;
-				++size;
-			}
+	return old;
+}
+
+// Takes a random key out of the tree, see AVLTree_Detach. A key
+// with copies left in a multiset just loses one.
+static void AVLTree_DeleteRandom(AVLTree* avl_tree) {
+	assert(avl_tree);
+	assert(avl_tree->core.root);
+
+	AVLTreeCore* core = &avl_tree->core;
+	AVLNode* node = AVLTree_Select(core, rand() % core->size);
+	if(AVLTree_DropCopy(core, node)) {
+		AVLTree_ResetColor(avl_tree, node);
+		AVLTree_RefreshLabel(avl_tree, node);
+		AVLPersistent_PushCopy(&avl_tree->history, core->root);
+		return;
+	}
+
+	if(avl_tree->weak) {
+		AVLWeak_Detach(core, node);
+	}
+	else {
+		AVLTree_Detach(core, node);
+	}
+	AVLTree_MarkEdgeDirty(avl_tree, node);
+	avl_tree->finger.node = NULL;
+
+	if(core->root) {
+		AVLTree_SetEntireTreeDest(avl_tree);
+	}
+	AVLTree_RefreshAllEdgesAndLabels(avl_tree);
+	AVLPersistent_PushCopy(&avl_tree->history, core->root);
+}
+
+// Heights from scratch. False if any node is out of AVL balance.
+static bool AVLTree_RecomputeHeights(AVLNode* node, bool* changed) {
+	if(node == NULL) {
+		return true;
+	}
+
+	bool balanced = AVLTree_RecomputeHeights(node->left, changed);
+	balanced = AVLTree_RecomputeHeights(node->right, changed) && balanced;
+	int rank = node->height;
+	AVLTree_UpdateNode(node);
+	*changed = *changed || (node->height != rank);
+
+	int balance = AVLTree_GetBalance(node);
+	return balanced && (-1 <= balance) && (balance <= 1);
+}
+
+// Links nodes[first..last], which are in key order, into a perfectly
+// balanced subtree, same as AVLTree_BuildSubtree but with live nodes
+static AVLNode* AVLTree_RelinkBalanced(AVLNode** nodes, int first, int last, AVLNode* parent) {
+	if(last < first) {
+		return NULL;
+	}
+
+	int mid = first + ((last - first) / 2);
+	AVLNode* node = nodes[mid];
+	node->parent = parent;
+	node->left = AVLTree_RelinkBalanced(nodes, first, mid - 1, node);
+	node->right = AVLTree_RelinkBalanced(nodes, mid + 1, last, node);
+	AVLTree_UpdateNode(node);
 
-			result.node = node;
-			result.level = level;
-			result.level_index = level_index;
-			return result;
+	return node;
+}
+
+/* Switches between AVL and rank balanced rebalancing. An AVL tree is
+ * already a valid rank balanced tree, but a rank balanced tree that
+ * has seen deletes doesn't have to be an AVL tree. Going back to AVL
+ * recomputes the heights and, if anything is out of balance, relinks
+ * the nodes into a perfectly balanced tree. Returns true if the tree
+ * has to animate to a new shape.
+ */
+static bool AVLTree_ToggleRebalancing(AVLTree* avl_tree) {
+	assert(avl_tree);
+
+	avl_tree->weak = !avl_tree->weak;
+	AVLTreeCore* core = &avl_tree->core;
+	if(avl_tree->weak || (core->root == NULL)) {
+		return false;
+	}
+
+	bool changed = false;
+	if(AVLTree_RecomputeHeights(core->root, &changed)) {
+		// history has to start from the real heights too
+		if(changed) {
+			AVLPersistent_PushCopy(&avl_tree->history, core->root);
 		}
+		return false;
+	}
 
-		i = 0;
-		nodes_at_level = size;
-		++level;
+	AVLNode* nodes[MAX_DIGITS];
+	int count = 0;
+	for(AVLNode* node = AVLTree_First(core); node; node = AVLTree_Next(node)) {
+		nodes[count++] = node;
 	}
+	core->root = AVLTree_RelinkBalanced(nodes, 0, count - 1, NULL);
+	AVLTree_SetSubtreeSlots(core->root, 0, 0);
 
-	tree = NULL;
-	return result;
+	AVLTree_SetEntireTreeDest(avl_tree);
+	AVLTree_RefreshAllEdgesAndLabels(avl_tree);
+	AVLPersistent_PushCopy(&avl_tree->history, core->root);
+	return true;
 }
 
-/*********************************************
- * State machine helper functions			 *
- *********************************************/
-static float AVLTree_GetNodeSplitWidth(const AVLNode* node, const int tree_height) {
-	assert(node);
-
-	// get node level in tree
-	int level = 0;
-	while(node->parent) {
-		++level;
-		node = node->parent;
+// Links up the live nodes holding the keys in version to match it and
+// returns the root. Height, subtree size and copies come along with it.
+static AVLNode* AVLTree_LinkVersion(AVLTree* avl_tree, AVLPersistentNodeT<int>* version) {
+	if(version == NULL) {
+		return NULL;
 	}
-	// get split of level below current
-	float split = exp2f((float)(level + 2));
-	const int   bottom_level_width = 1 << tree_height;
-	const float max_tree_width = (float)bottom_level_width * 
-		                         (global_node_width + global_node_margin) - 
-								 global_node_margin; // subtract one node_margin for the far right node
-	return max_tree_width / split;
-}
 
-static inline bool AVLTree_AnimationFinished(AVLNode* node) {
-	float x_dist = fabs(node->x_dest - node->cube.cube_vertices[0].x);
-	float y_dist = fabs(node->y_dest - node->cube.cube_vertices[0].y);
-	bool x_finished = x_dist <= AVL_THRESHOLD;
-	bool y_finished = y_dist <= AVL_THRESHOLD;
-	if(x_finished) {
-		node->x_vel = 0.0f;
+	AVLNode* node = avl_tree->nodes_by_key[version->val];
+	assert(node);
+	node->left = AVLTree_LinkVersion(avl_tree, version->left);
+	node->right = AVLTree_LinkVersion(avl_tree, version->right);
+	if(node->left) {
+		node->left->parent = node;
 	}
-	if(y_finished) {
-		node->y_vel = 0.0f;
+	if(node->right) {
+		node->right->parent = node;
 	}
+	node->height = version->height;
+	node->subtree_size = version->subtree_size;
+	node->duplicates = version->duplicates;
+	avl_tree->core.duplicates += node->duplicates;
+	AVLTree_ResetColor(avl_tree, node);
 
-	return (node->x_vel == 0.0f) && (node->y_vel == 0.0f);
+	return node;
 }
 
-// Automatically syncs x_vel and y_vel so they land at the same time.
-inline void AVLTree_SetVelocity(AVLNode* node) {
-	float x_dist = node->x_dest - node->cube.cube_vertices[0].x;
-	float y_dist = node->y_dest - node->cube.cube_vertices[0].y;
+// Puts a version from history on screen. Keys that aren't in
+// it yet are unlinked, which also hides them.
+static void AVLTree_ShowVersion(AVLTree* avl_tree, int version) {
+	assert(avl_tree);
 
-	float units_per_frame = global_avl_tree_units_per_second / global_avl_tree_frames_per_second;
-	float x_frames_to_reach_dest = fabs(x_dist / units_per_frame);
-	float y_frames_to_reach_dest = fabs(y_dist / units_per_frame);
-	int frames_to_reach_dest;
-	if(x_frames_to_reach_dest < y_frames_to_reach_dest) {
-		frames_to_reach_dest = (int)(y_frames_to_reach_dest + 1);
+	for(int i = 0; i < MAX_DIGITS; ++i) {
+		AVLNode* node = avl_tree->nodes_by_key[i];
+		if(node) {
+			node->parent = NULL;
+			node->left = NULL;
+			node->right = NULL;
+			AVLTree_MarkEdgeDirty(avl_tree, node);
+		}
+	}
+
+	avl_tree->finger.node = NULL;
+	avl_tree->core.duplicates = 0;
+	AVLNode* root = AVLTree_LinkVersion(avl_tree, AVLPersistent_Version(&avl_tree->history, version));
+	AVLTree_SetSubtreeSlots(root, 0, 0);
+	avl_tree->core.root = root;
+	avl_tree->core.size = AVLTree_GetSubtreeSize(root);
+	avl_tree->scrub_version = version;
+
+	if(root) {
+		AVLTree_SetEntireTreeDest(avl_tree);
 	}
 	else {
-		frames_to_reach_dest = (int)(x_frames_to_reach_dest + 1);
+		avl_tree->animating_nodes.count = 0;
 	}
-	node->x_vel = x_dist / (float)frames_to_reach_dest;
-	node->y_vel = y_dist / (float)frames_to_reach_dest;
+	AVLTree_RefreshAllEdgesAndLabels(avl_tree);
 }
 
-INTERNAL void AVLTree_DrawBackground(GameBackground gb, float window_width, float window_height) {
-	GLCall(glBindVertexArray(gb.vao));
-	GLCall(glBindBuffer(GL_ARRAY_BUFFER, gb.vbo));
-	GLCall(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gb.ibo));
-	glBindTexture(GL_TEXTURE_2D, gb.texture);
-	glUseProgram(gb.shader);
-
-	int projection_location = glGetUniformLocation(gb.shader, "projection");
-	glm::mat4 projection = glm::perspective(glm::radians(75.0f), window_width / window_height, 0.1f, 100.0f);
-	glUniformMatrix4fv(projection_location, 1, GL_FALSE, glm::value_ptr(projection));
-
-	glDisable(GL_DEPTH_TEST);
-	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, (void*)0);
+// Drops nodes that got where they were going from the animating
+// list. True once nothing is moving anymore.
+static bool AVLTree_SettleAnimations(AVLTree* avl_tree) {
+	AVLNodeList* animating = &avl_tree->animating_nodes;
+	int i = 0;
+	while(i < animating->count) {
+		if(AVLTree_AnimationFinished(AVLTree_View(animating->nodes[i]))) {
+			animating->nodes[i] = animating->nodes[--animating->count];
+		}
+		else {
+			++i;
+		}
+	}
 
-	GLCall(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0));
-	GLCall(glBindBuffer(GL_ARRAY_BUFFER, 0));
-	GLCall(glBindVertexArray(0));
+	return animating->count == 0;
 }
 
-static void AVLTree_UpdateGeometry(AVLTree* avl_tree) {
+// One shot version of AVLTree_SetEntireTreeDest. Every node
+// is moved straight to its destination with no animation.
+static void AVLTree_SnapEntireTreeToDest(AVLTree* avl_tree) {
 	assert(avl_tree);
 
-	if(avl_tree->current_state == AVLTREE_PAUSED) {
-		return;
-	}
+	AVLTree_SetEntireTreeDest(avl_tree);
 
 	AVLTreeBFSNode bfs_node = AVLTree_BFS(avl_tree);
 	while(bfs_node.node) {
-		AVLNode* node = bfs_node.node;
+		AVLViewNode* node = AVLTree_View(bfs_node.node);
 		GameCube* cube = &node->cube;
 
+		float x_offset = node->x_dest - cube->cube_vertices[0].x;
+		float y_offset = node->y_dest - cube->cube_vertices[0].y;
 		int cube_vertices = sizeof(cube->cube_vertices) / sizeof(Vertex);
 		for(int j = 0; j < cube_vertices; ++j) {
-			cube->cube_vertices[j].x += node->x_vel;
-			cube->cube_vertices[j].y += node->y_vel;
+			cube->cube_vertices[j].x += x_offset;
+			cube->cube_vertices[j].y += y_offset;
 		}
 		int digit_vertices = sizeof(cube->digit_vertices) / sizeof(Vertex);
 		for(int j = 0; j < digit_vertices; ++j) {
-			cube->digit_vertices[j].x += node->x_vel;
-			cube->digit_vertices[j].y += node->y_vel;
-		}
-	
-		// draw line to parent
-		// lines will go from center top of child
-		// to center bottom of parent
-		// TODO: Change this if I ever #define node width
-		// TODO: This probably shouldn't be here. This only needs to be
-		//       done during rotations and not during static drawing.
-		if(node->parent) {
-			AVLNode* parent = node->parent;
-			if(node == parent->left) {
-				node->cube.line_vertices[0] = node->cube.cube_vertices[1];
-				node->cube.line_vertices[1] = parent->cube.cube_vertices[5];
-
-				node->cube.line_vertices[0].x -= 0.5f;
-				node->cube.line_vertices[0].z -= 0.5f;
-				node->cube.line_vertices[0].r = 1.0f;
-				node->cube.line_vertices[0].g = 1.0f;
-				node->cube.line_vertices[0].b = 153.0f / 255.0f;
-
-				node->cube.line_vertices[1].x += 0.5f;
-				node->cube.line_vertices[1].z -= 0.5f;
-				node->cube.line_vertices[1].r = 1.0f;
-				node->cube.line_vertices[1].g = 1.0f;
-				node->cube.line_vertices[1].b = 153.0f / 255.0f;
-			}
-			else {
-				// line will go from top left of this cube
-				// to bottom right of parent
-				node->cube.line_vertices[0] = node->cube.cube_vertices[0];
-				node->cube.line_vertices[1] = parent->cube.cube_vertices[3];
-
-				node->cube.line_vertices[0].x += 0.5f;
-				node->cube.line_vertices[0].z -= 0.5f;
-				node->cube.line_vertices[0].r = 1.0f;
-				node->cube.line_vertices[0].g = 1.0f;
-				node->cube.line_vertices[0].b = 153.0f / 255.0f;
-
-				node->cube.line_vertices[1].x -= 0.5f;
-				node->cube.line_vertices[1].z -= 0.5f;
-				node->cube.line_vertices[1].r = 1.0f;
-				node->cube.line_vertices[1].g = 1.0f;
-				node->cube.line_vertices[1].b = 153.0f / 255.0f;
-			}
-		}
-		else {
-			// clear parent for root node
-			node->cube.line_vertices[0].x = 0.0f;
-			node->cube.line_vertices[0].y = 0.0f;
-			node->cube.line_vertices[0].z = 0.0f;
-			node->cube.line_vertices[1].x = 0.0f;
-			node->cube.line_vertices[1].y = 0.0f;
-			node->cube.line_vertices[1].z = 0.0f;
+			cube->digit_vertices[j].x += x_offset;
+			cube->digit_vertices[j].y += y_offset;
 		}
+		node->x_vel = 0.0f;
+		node->y_vel = 0.0f;
+		AVLTree_MarkEdgeDirty(avl_tree, &node->node);
 
 		bfs_node = AVLTree_BFS(avl_tree);
 	}
-	
-	if(avl_tree->detached_node) {
-		AVLNode* node = avl_tree->detached_node;
-		GameCube* cube = &node->cube;
-
-		int cube_vertices = sizeof(cube->cube_vertices) / sizeof(Vertex);
-		for(int j = 0; j < cube_vertices; ++j) {
-			cube->cube_vertices[j].x += node->x_vel;
-			cube->cube_vertices[j].y += node->y_vel;
-		}
-		int digit_vertices = sizeof(cube->digit_vertices) / sizeof(Vertex);
-		for(int j = 0; j < digit_vertices; ++j) {
-			cube->digit_vertices[j].x += node->x_vel;
-			cube->digit_vertices[j].y += node->y_vel;
-		}
-	}
+	avl_tree->animating_nodes.count = 0;
 }
 
-static void AVLTree_SetEntireTreeDest(AVLTree* avl_tree) {
-	assert(avl_tree);
-
-	const int   bottom_level_width = 1 << avl_tree->root->height;
-	const float max_tree_width = bottom_level_width * (global_node_width + global_node_margin) - global_node_margin; // subtract one node_margin for the far right node
-	const float x_start = (max_tree_width / 2.0f) * -1.0f;
-	const float y_start = 0.0f;
-
-	AVLTreeBFSNode bfs_node = AVLTree_BFS(avl_tree);
-	while(bfs_node.node) {
-		AVLNode* node = bfs_node.node;
-
-		float split = exp2f((float)(bfs_node.level + 1));
-		float x_width = (max_tree_width / split);
-		// map node indices to odd #'s
-		uint64_t split_index = (bfs_node.level_index * 2) + 1;
-		// x_pos, y_pos is the center of the node
-		float x_pos = x_start + ((float)split_index * x_width);
-		float y_pos = y_start - ((float)bfs_node.level * global_y_spacing);
-
-		// destination is based on top left front corner of cube
-		node->x_dest = x_pos - 0.5f;
-		node->y_dest = y_pos + 0.5f;
-		AVLTree_SetVelocity(node);
+// Loads a saved tree, see AVLTree_Load. False if there's no saved
+// tree or it has keys that don't fit on a node's two digits.
+static bool AVLTree_LoadKeys(AVLTree* avl_tree, const char* path) {
+	FILE* file = fopen(path, "rb");
+	if(!file) {
+		return false; // nothing saved yet
+	}
+	fclose(file);
 
-		bfs_node = AVLTree_BFS(avl_tree);
+	AVLTreeCore* core = &avl_tree->core;
+	if(!AVLTree_Load(core, path)) {
+		return false;
+	}
+	for(AVLNode* node = AVLTree_First(core); node; node = AVLTree_Next(node)) {
+		if((node->val < 0) || (MAX_DIGITS <= node->val)) {
+			fprintf(stderr, "Couldn't show %s: keys have to be 0 to %d\n", path, MAX_DIGITS - 1);
+			return false;
+		}
 	}
+
+	return true;
 }
 
 /*********************************************
@@ -556,7 +1230,7 @@ void AVLTree_Draw(AVLTree* avl_tree, float window_width, float window_height) {
 	unsigned int buffer_write_index = 0;
  	AVLTreeBFSNode bfs_node = AVLTree_BFS(avl_tree);
  	while(bfs_node.node) {
-		AVLNode* node = bfs_node.node;
+		AVLViewNode* node = AVLTree_View(bfs_node.node);
 
 		GLCall(glBufferSubData(GL_ARRAY_BUFFER, buffer_write_index, 
 					           sizeof(GameCube), &node->cube));
@@ -590,10 +1264,15 @@ void AVLTree_Draw(AVLTree* avl_tree, float window_width, float window_height) {
 	unsigned int vertices_per_cube = sizeof(GameCube) / sizeof(Vertex);
 	// NOTE: One for inserting node possibly
 	unsigned int num_cubes = avl_tree->detached_node ?
-		                     avl_tree->size + 1       :
-							 avl_tree->size;
+		                     avl_tree->core.size + 1       :
+							 avl_tree->core.size;
 	GLCall(glDrawArrays(GL_LINES, 0, num_cubes * VERTICES_PER_CUBE));
 
+	GLCall(glBindVertexArray(avl_tree->edge_vao));
+	GLCall(glBindBuffer(GL_ARRAY_BUFFER, avl_tree->edge_vbo));
+	AVLTree_UploadEdges(avl_tree);
+	GLCall(glDrawArrays(GL_LINES, 0, avl_tree->num_edges * 2));
+
 	GLCall(glBindBuffer(GL_ARRAY_BUFFER, 0));
 	GLCall(glBindVertexArray(0));
 }
@@ -602,14 +1281,6 @@ void AVLTree_Update(AVLTree* avl_tree, GameInput* input) {
 	assert(avl_tree);
 	assert(input);
 
-	if(avl_tree->size == global_avl_tree_init_size ||
-	   avl_tree->size == MAX_DIGITS)
-	{
-		avl_tree->initializing = false;
-		global_avl_tree_units_per_second = 7.0f;
-		global_avl_tree_timer_reset = global_timer_constant / (int)global_avl_tree_units_per_second;
-	}
-
 	if(input->p.is_down) {
 		if(avl_tree->current_state != AVLTREE_STATIC) {
 			AVLTreeState temp = avl_tree->current_state;
@@ -625,8 +1296,7 @@ void AVLTree_Update(AVLTree* avl_tree, GameInput* input) {
 
 			AVLTreeBFSNode bfs_node = AVLTree_BFS(avl_tree);
 			while(bfs_node.node) {                          
-				AVLNode* node = bfs_node.node;                 
-				GameCube* cube = &node->cube;
+				AVLViewNode* node = AVLTree_View(bfs_node.node);
 
 				if(AVLTree_AnimationFinished(node)) {
 					num_nodes_finished++;
@@ -635,68 +1305,350 @@ void AVLTree_Update(AVLTree* avl_tree, GameInput* input) {
 				bfs_node = AVLTree_BFS(avl_tree);          
 			}                                               
 
-			if(num_nodes_finished == avl_tree->size) {
+			if(num_nodes_finished == avl_tree->core.size) {
 				avl_tree->current_state = AVLTREE_STATIC;
 			}
 		} break;
 
 		case AVLTREE_STATIC: 
 		{
-			if(input->a.is_down || avl_tree->initializing) {
+			// only cycle once per press
+			static bool e_was_down = false;
+			if(input->e.is_down && !e_was_down) {
+				avl_tree->label = (AVLTreeLabel)((avl_tree->label + 1) % AVLTREE_NUM_LABELS);
+				if(avl_tree->label == AVLTREE_LABEL_FROZEN_ORDER) {
+					AVLTree_Freeze(&avl_tree->core, &avl_tree->frozen);
+				}
+				AVLTreeBFSNode bfs_node = AVLTree_BFS(avl_tree);
+				while(bfs_node.node) {
+					AVLTree_RefreshLabel(avl_tree, bfs_node.node);
+					bfs_node = AVLTree_BFS(avl_tree);
+				}
+			}
+			e_was_down = input->e.is_down;
+
+			static bool r_was_down = false;
+			bool toggle_rebalancing = input->r.is_down && !r_was_down;
+			r_was_down = input->r.is_down;
+
+			// keys already in the tree count up instead of
+			// being thrown away, see AVLTreeCoreT::multiset
+			static bool m_was_down = false;
+			if(input->m.is_down && !m_was_down) {
+				avl_tree->core.multiset = !avl_tree->core.multiset;
+			}
+			m_was_down = input->m.is_down;
+
+			static bool h_was_down = false;
+			if(input->h.is_down && !h_was_down) {
+				avl_tree->show_heat = !avl_tree->show_heat;
+				AVLTree_ResetColors(avl_tree);
+			}
+			h_was_down = input->h.is_down;
+
+			// catch up on visits that happened outside the animated
+			// walks (finger climbs, deletes) or raised the hottest node,
+			// which rescales everything
+			if(avl_tree->show_heat && (avl_tree->heat_colored_visits != avl_tree->heat.visits)) {
+				AVLTree_ResetColors(avl_tree);
+			}
+
+			// number keys select a percentile: 0 is the smallest
+			// key, 5 the median, 9 the 90th percentile
+			int percentile_key = -1;
+			int num_0_index = (int)(&input->num_0 - input->buttons);
+			for(int i = 0; i < 10; ++i) {
+				if(input->buttons[num_0_index + i].is_down) {
+					percentile_key = i;
+					break;
+				}
+			}
+
+			if(toggle_rebalancing) {
+				if(AVLTree_ToggleRebalancing(avl_tree)) {
+					avl_tree->compare_node = NULL;
+					avl_tree->current_state = AVLTREE_ROTATING;
+				}
+			}
+			else if(input->a.is_down) {
 				int val = rand() % MAX_DIGITS;
-				AVLNode* node = (AVLNode*)calloc(1, sizeof(AVLNode));
-				node->val = val;
-				if(!avl_tree->root) {
+				// a rank balanced insert goes into history once it's done
+				if(!avl_tree->weak) {
+					AVLPersistent_Insert(&avl_tree->history, val, true);
+				}
+				AVLViewNode* node = (AVLViewNode*)AVLNodePool_Alloc(&avl_tree->core.pool);
+				node->node.val = val;
+				node->node.subtree_size = 1;
+				if(!avl_tree->core.root) {
 					node->cube = GenCube(0.0f, 0.0f, 0.0f, val, 0.0f, 0.0f, 1.0f);
-					avl_tree->root = node;
-					avl_tree->size = 1;
+					avl_tree->core.root = AVLTree_AdoptKeyNode(avl_tree, node);
+					avl_tree->finger.node = avl_tree->core.root;
+					avl_tree->core.size = 1;
+					AVLTree_SnapEntireTreeToDest(avl_tree);
+					AVLTree_RefreshLabels(avl_tree, avl_tree->core.root);
+					if(avl_tree->weak) {
+						AVLPersistent_PushCopy(&avl_tree->history, avl_tree->core.root);
+					}
 				}
 				else {
-					node->cube = GenCube(0.0f, global_y_insert_node_start, 0.0f, val, 1.0f, 140.0f / 255.0f, 0.0f);
+					// starts out hovering over the first node to compare with
+					AVLHeat_Begin(&avl_tree->core);
+					AVLNode* start = AVLTree_FingerStart(&avl_tree->core, &avl_tree->finger, val);
+					AVLViewNode* start_view = AVLTree_View(start);
+					node->cube = GenCube(start_view->x_dest + 0.5f, start_view->y_dest - 0.5f + global_y_insert_node_start, 
+							             0.0f, val, 1.0f, 140.0f / 255.0f, 0.0f);
 					avl_tree->detached_node = node;
-					avl_tree->compare_node = avl_tree->root;
+					avl_tree->compare_node = start;
 					avl_tree->current_state = AVLTREE_INSERT_NODE_COMPARE;
 				}
 			}
+			else if(input->s.is_down && avl_tree->core.root) {
+				avl_tree->range_low = rand() % MAX_DIGITS;
+				avl_tree->range_high = avl_tree->range_low + (rand() % 30);
+				if(avl_tree->range_high >= MAX_DIGITS) {
+					avl_tree->range_high = MAX_DIGITS - 1;
+				}
+				avl_tree->range_node = avl_tree->core.root;
+				avl_tree->range_first = NULL;
+				AVLHeat_Begin(&avl_tree->core);
+				avl_tree->current_state = AVLTREE_RANGE_SEARCH;
+			}
+			else if((percentile_key >= 0) && avl_tree->core.root) {
+				avl_tree->select_k = (percentile_key * (avl_tree->core.size - 1)) / 10;
+				avl_tree->select_node = avl_tree->core.root;
+				avl_tree->current_state = AVLTREE_SELECT;
+				AVLHeat_Begin(&avl_tree->core);
+			}
+			else if(input->d.is_down && avl_tree->core.root) {
+				AVLTree_DeleteRandom(avl_tree);
+				avl_tree->compare_node = NULL;
+				avl_tree->current_state = AVLTREE_ROTATING;
+			}
+			// join and split go by heights, which ranks aren't
+			else if(input->j.is_down && avl_tree->core.root && !avl_tree->weak) {
+				AVLTree_StartSplit(avl_tree);
+				avl_tree->compare_node = NULL;
+				avl_tree->current_state = AVLTREE_ROTATING;
+			}
+			else if(input->k.is_down) {
+				AVLTree_Save(&avl_tree->core, global_avl_tree_file);
+				AVLTree_SaveHeat(&avl_tree->core, global_avl_tree_heat_file);
+			}
+			else if(input->b.is_down && (avl_tree->history.num_versions > 1)) {
+				AVLTree_ShowVersion(avl_tree, avl_tree->history.num_versions - 2);
+				avl_tree->current_state = AVLTREE_SCRUBBING;
+			}
+		} break;
+
+		// b/f step through history. Stepping forward onto the latest
+		// version leaves the tree as it was before scrubbing started.
+		case AVLTREE_SCRUBBING:
+		{
+			AVLTree_SettleAnimations(avl_tree);
+
+			int latest = avl_tree->history.num_versions - 1;
+			if(input->b.is_down && (avl_tree->scrub_version > 0)) {
+				AVLTree_ShowVersion(avl_tree, avl_tree->scrub_version - 1);
+			}
+			else if(input->f.is_down) {
+				AVLTree_ShowVersion(avl_tree, avl_tree->scrub_version + 1);
+				if(avl_tree->scrub_version == latest) {
+					avl_tree->compare_node = NULL;
+					avl_tree->current_state = AVLTREE_ROTATING;
+				}
+			}
+		} break;
+
+		// Halves stay apart until j is pressed again
+		case AVLTREE_SPLIT:
+		{
+			if(input->j.is_down) {
+				AVLTree_FinishSplit(avl_tree);
+				avl_tree->compare_node = NULL;
+				avl_tree->current_state = AVLTREE_ROTATING;
+			}
+		} break;
+
+		// Same walk as AVLTree_Select, one node per timer tick
+		case AVLTREE_SELECT:
+		{
+			AVLNode* node = avl_tree->select_node;
+			GameCube_SetColor(&AVLTree_View(node)->cube, 1.0f, 140.0f / 255.0f, 0.0f);
+
+			static int timer = global_avl_tree_timer_reset;
+			if(timer == 0) {
+				timer = global_avl_tree_timer_reset;
+
+				AVLHeat_Touch(&avl_tree->core, node);
+				int left_size = AVLTree_GetSubtreeSize(node->left);
+				if(avl_tree->select_k == left_size) {
+					GameCube_SetColor(&AVLTree_View(node)->cube, 0.0f, 1.0f, 0.0f);
+					avl_tree->current_state = AVLTREE_SELECT_FOUND;
+				}
+				else {
+					AVLTree_ResetColor(avl_tree, node);
+					if(avl_tree->select_k < left_size) {
+						avl_tree->select_node = node->left;
+					}
+					else {
+						avl_tree->select_k -= left_size + 1;
+						avl_tree->select_node = node->right;
+					}
+				}
+			}
+			else {
+				--timer;
+			}
+		} break;
+
+		// Same walk as AVLTree_LowerBound, one node per timer tick
+		case AVLTREE_RANGE_SEARCH:
+		{
+			AVLNode* node = avl_tree->range_node;
+			GameCube_SetColor(&AVLTree_View(node)->cube, 1.0f, 140.0f / 255.0f, 0.0f);
+
+			static int timer = global_avl_tree_timer_reset;
+			if(timer == 0) {
+				timer = global_avl_tree_timer_reset;
+
+				AVLHeat_Touch(&avl_tree->core, node);
+				AVLTree_ResetColor(avl_tree, node);
+				if(avl_tree->core.compare(avl_tree->range_low, node->val) <= 0) {
+					avl_tree->range_first = node;
+					avl_tree->range_node = node->left;
+				}
+				else {
+					avl_tree->range_node = node->right;
+				}
+
+				if(avl_tree->range_node == NULL) {
+					// range_first is the lower bound now
+					avl_tree->range_end = AVLTree_UpperBound(&avl_tree->core, avl_tree->range_high);
+					avl_tree->range_node = avl_tree->range_first;
+					avl_tree->current_state = (avl_tree->range_first == avl_tree->range_end) ? 
+						                      AVLTREE_RANGE_FOUND : AVLTREE_RANGE_SCAN;
+				}
+			}
+			else {
+				--timer;
+			}
+		} break;
+
+		// One successor per timer tick, see AVLTree_RangeNext
+		case AVLTREE_RANGE_SCAN:
+		{
+			AVLNode* node = avl_tree->range_node;
+			GameCube_SetColor(&AVLTree_View(node)->cube, 1.0f, 140.0f / 255.0f, 0.0f);
+
+			static int timer = global_avl_tree_timer_reset;
+			if(timer == 0) {
+				timer = global_avl_tree_timer_reset;
+
+				GameCube_SetColor(&AVLTree_View(node)->cube, 0.0f, 1.0f, 0.0f);
+				avl_tree->range_node = AVLTree_Next(node);
+				if(avl_tree->range_node == avl_tree->range_end) {
+					avl_tree->current_state = AVLTREE_RANGE_FOUND;
+				}
+			}
+			else {
+				--timer;
+			}
+		} break;
+
+		case AVLTREE_RANGE_FOUND:
+		{
+			static int timer = 2 * global_avl_tree_timer_reset;
+			if(timer == 0) {
+				timer = 2 * global_avl_tree_timer_reset;
+
+				AVLNode* node = avl_tree->range_first;
+				while(node != avl_tree->range_end) {
+					AVLTree_ResetColor(avl_tree, node);
+					node = AVLTree_Next(node);
+				}
+				avl_tree->range_node = NULL;
+				avl_tree->range_first = NULL;
+				avl_tree->range_end = NULL;
+				avl_tree->current_state = AVLTREE_STATIC;
+			}
+			else {
+				--timer;
+			}
+		} break;
+
+		case AVLTREE_SELECT_FOUND:
+		{
+			// leave the result up a bit longer than a step
+			static int timer = 2 * global_avl_tree_timer_reset;
+			if(timer == 0) {
+				timer = 2 * global_avl_tree_timer_reset;
+
+				AVLTree_ResetColor(avl_tree, avl_tree->select_node);
+				avl_tree->select_node = NULL;
+				avl_tree->current_state = AVLTREE_STATIC;
+			}
+			else {
+				--timer;
+			}
 		} break;
 
 		case AVLTREE_INSERT_NODE_COMPARE:
 		{
-			if(avl_tree->detached_node->val == 
-			   avl_tree->compare_node->val) 
-			{
-				AVLTreeBFSNode bfs_node = AVLTree_BFS(avl_tree);
-				while(bfs_node.node) {
-					GameCube_SetColor(&bfs_node.node->cube, 1.0f, 0.0f, 0.0f);
-					bfs_node = AVLTree_BFS(avl_tree);
+			int cmp = avl_tree->core.compare(avl_tree->detached_node->node.val, 
+					                         avl_tree->compare_node->val);
+			if(cmp == 0) {
+				AVLHeat_Touch(&avl_tree->core, avl_tree->compare_node);
+				if(avl_tree->core.multiset) {
+					// the key's node counts one more copy, and the
+					// new node goes away the same as for a set
+					AVLNode* node = avl_tree->compare_node;
+					avl_tree->finger.node = node;
+					node->duplicates++;
+					avl_tree->core.duplicates++;
+					AVLTree_RefreshLabel(avl_tree, node);
+					AVLPersistent_PushCopy(&avl_tree->history, avl_tree->core.root);
+					GameCube_SetColor(&AVLTree_View(node)->cube, 0.0f, 1.0f, 0.0f);
+					GameCube_SetColor(&avl_tree->detached_node->cube, 0.0f, 1.0f, 0.0f);
+				}
+				else {
+					AVLTreeBFSNode bfs_node = AVLTree_BFS(avl_tree);
+					while(bfs_node.node) {
+						GameCube_SetColor(&AVLTree_View(bfs_node.node)->cube, 1.0f, 0.0f, 0.0f);
+						bfs_node = AVLTree_BFS(avl_tree);
+					}
+					GameCube_SetColor(&avl_tree->detached_node->cube, 1.0f, 0.0f, 0.0f);
 				}
-				GameCube_SetColor(&avl_tree->detached_node->cube, 1.0f, 0.0f, 0.0f);
 				avl_tree->current_state = AVLTREE_INSERT_NODE_DELETE;
 			}
 			else {
-				GameCube_SetColor(&avl_tree->compare_node->cube, 1.0f, 140.0f / 255.0f, 0.0f);
+				GameCube_SetColor(&AVLTree_View(avl_tree->compare_node)->cube, 1.0f, 140.0f / 255.0f, 0.0f);
 
 				static int timer = global_avl_tree_timer_reset;
 				if(timer == 0) {
 					timer = global_avl_tree_timer_reset;
 
-					GameCube_SetColor(&avl_tree->compare_node->cube, 0.0f, 0.0f, 1.0f);
-
-					avl_tree->detached_node->y_dest = avl_tree->detached_node->cube.cube_vertices[0].y - global_y_spacing;
-					float x_spacing = AVLTree_GetNodeSplitWidth(avl_tree->compare_node, avl_tree->root->height);
-
-					if(avl_tree->detached_node->val < 
-					   avl_tree->compare_node->val) 
-					{
+					AVLHeat_Touch(&avl_tree->core, avl_tree->compare_node);
+					AVLTree_ResetColor(avl_tree, avl_tree->compare_node);
+
+					// one level below the compare node, still hovering
+					// above it unless this turns out to be the base case
+					int compare_depth;
+					uint64_t compare_level_index;
+					AVLTree_GetNodeSlot(&avl_tree->core, avl_tree->compare_node, &compare_depth, &compare_level_index);
+					avl_tree->detached_node->y_dest = -(float)(compare_depth + 1) * global_y_spacing + 
+						                              0.5f + global_y_insert_node_start;
+					bool go_left = cmp < 0;
+					avl_tree->insert_left = go_left;
+					avl_tree->detached_node->x_dest = AVLTree_GetInsertDestX(avl_tree->compare_node, go_left);
+
+					if(go_left) {
 						// BASE CASE: insert into tree
 						if(avl_tree->compare_node->left == NULL) {
 							avl_tree->detached_node->y_dest -= global_y_insert_node_start;
-							avl_tree->detached_node->x_dest = avl_tree->detached_node->cube.cube_vertices[0].x - x_spacing;
 							AVLTree_SetVelocity(avl_tree->detached_node);
 							avl_tree->current_state = AVLTREE_INSERT_NODE_ADD;
 						}
 						else {
-							avl_tree->detached_node->x_dest = avl_tree->detached_node->cube.cube_vertices[0].x - x_spacing;
 							AVLTree_SetVelocity(avl_tree->detached_node);
 
 							avl_tree->compare_node = avl_tree->compare_node->left;
@@ -704,18 +1656,14 @@ void AVLTree_Update(AVLTree* avl_tree, GameInput* input) {
 							avl_tree->current_state = AVLTREE_INSERT_NODE_MOVING_TO_NEXT_COMPARE;
 						}
 					}
-					else if(avl_tree->detached_node->val > 
-					        avl_tree->compare_node->val) 
-					{
+					else {
 						// BASE CASE: insert into tree
 						if(avl_tree->compare_node->right == NULL) {
 							avl_tree->detached_node->y_dest -= global_y_insert_node_start;
-							avl_tree->detached_node->x_dest = avl_tree->detached_node->cube.cube_vertices[0].x + x_spacing;
 							AVLTree_SetVelocity(avl_tree->detached_node);
 							avl_tree->current_state = AVLTREE_INSERT_NODE_ADD;
 						}
 						else {
-							avl_tree->detached_node->x_dest = avl_tree->detached_node->cube.cube_vertices[0].x + x_spacing;
 							AVLTree_SetVelocity(avl_tree->detached_node);
 
 							avl_tree->compare_node = avl_tree->compare_node->right;
@@ -743,12 +1691,12 @@ void AVLTree_Update(AVLTree* avl_tree, GameInput* input) {
 			if(timer == 0) {
 				timer = global_avl_tree_timer_reset;
 
-				free(avl_tree->detached_node);
+				AVLNodePool_Free(&avl_tree->core.pool, avl_tree->detached_node);
 				avl_tree->detached_node = NULL;
 				avl_tree->compare_node = NULL;
 				AVLTreeBFSNode bfs_node = AVLTree_BFS(avl_tree);
 				while(bfs_node.node) {
-					GameCube_SetColor(&bfs_node.node->cube, 0.0f, 0.0f, 1.0f);
+					AVLTree_ResetColor(avl_tree, bfs_node.node);
 					bfs_node = AVLTree_BFS(avl_tree);
 				}
 				avl_tree->current_state = AVLTREE_STATIC;
@@ -763,96 +1711,104 @@ void AVLTree_Update(AVLTree* avl_tree, GameInput* input) {
 			if(AVLTree_AnimationFinished(avl_tree->detached_node)) {
 				GameCube_SetColor(&avl_tree->detached_node->cube, 0.0f, 0.0f, 1.0f);
 
-				avl_tree->detached_node->parent = avl_tree->compare_node;
+				AVLNode* inserted_node = AVLTree_AdoptKeyNode(avl_tree, avl_tree->detached_node);
+				avl_tree->detached_node = NULL;
+				avl_tree->finger.node = inserted_node;
+
+				AVLTree_LinkChild(avl_tree->compare_node, inserted_node, avl_tree->insert_left);
 
-				// Check to see if it is left or right because
-				// I don't track where it came from.
-				if(avl_tree->detached_node->val < 
-				   avl_tree->compare_node->val) 
-				{
-					avl_tree->compare_node->left = avl_tree->detached_node;
+				avl_tree->core.size++;
+				AVLTree_MarkLayoutDirty(inserted_node);
+				AVLTree_MarkEdgeDirty(avl_tree, inserted_node);
+				AVLTree_RefreshLabels(avl_tree, inserted_node);
+
+				if(avl_tree->weak) {
+					// rebalances in one go, then the whole tree
+					// animates to its new shape
+					AVLWeak_RebalanceAfterInsert(&avl_tree->core, inserted_node);
+					AVLTree_SetEntireTreeDest(avl_tree);
+					AVLTree_RefreshAllEdgesAndLabels(avl_tree);
+					AVLPersistent_PushCopy(&avl_tree->history, avl_tree->core.root);
+					avl_tree->compare_node = NULL;
+					avl_tree->current_state = AVLTREE_ROTATING;
 				}
 				else {
-					avl_tree->compare_node->right = avl_tree->detached_node;
+					avl_tree->current_state = AVLTREE_UPDATE_HEIGHTS;
 				}
-
-				avl_tree->size++;
-				avl_tree->inserted_node = avl_tree->detached_node;
-				avl_tree->detached_node = NULL;
-
-				avl_tree->current_state = AVLTREE_UPDATE_HEIGHTS;
 			}
 		} break;
 
 		case AVLTREE_UPDATE_HEIGHTS:
 		{
 			if(avl_tree->compare_node) {
-				AVLTree_UpdateHeight(avl_tree->compare_node);
+				AVLTree_UpdateNode(avl_tree->compare_node);
+				AVLTree_RefreshLabels(avl_tree, avl_tree->compare_node);
 				int balance = AVLTree_GetBalance(avl_tree->compare_node);
 
+				// the heavy child leans the way the new node went down,
+				// see AVLTree_RebalanceAfterInsert
 				if(((balance > 1) && 
-				   (avl_tree->inserted_node->val < avl_tree->compare_node->left->val)) ||
+				   (AVLTree_GetBalance(avl_tree->compare_node->left) >= 0)) ||
 					avl_tree->right_rotate) 
 				{
 					avl_tree->right_rotate = false;
 					avl_tree->compare_node = AVLTree_RightRotate(avl_tree->compare_node);
+					AVLTree_MarkLayoutDirty(avl_tree->compare_node->right);
+					AVLTree_RefreshLabels(avl_tree, avl_tree->compare_node);
 				}
 				else if(((balance < -1) && 
-						(avl_tree->inserted_node->val > avl_tree->compare_node->right->val)) ||
+						(AVLTree_GetBalance(avl_tree->compare_node->right) <= 0)) ||
 						avl_tree->left_rotate)
 				{
 					avl_tree->left_rotate = false;
 					avl_tree->compare_node = AVLTree_LeftRotate(avl_tree->compare_node);
+					AVLTree_MarkLayoutDirty(avl_tree->compare_node->left);
+					AVLTree_RefreshLabels(avl_tree, avl_tree->compare_node);
 				}
-				else if((balance > 1) && 
-					    (avl_tree->inserted_node->val > avl_tree->compare_node->left->val)) 
+				else if(balance > 1) 
 				{
-					AVLTree_LeftRotate(avl_tree->compare_node->left);
-					AVLTree_SetEntireTreeDest(avl_tree);
+					AVLNode* rotated = AVLTree_LeftRotate(avl_tree->compare_node->left);
+					AVLTree_MarkLayoutDirty(rotated->left);
+					AVLTree_RefreshLabels(avl_tree, rotated);
+					AVLTree_UpdateLayout(avl_tree);
 					avl_tree->right_rotate = true;
 					avl_tree->current_state = AVLTREE_ROTATING;
 					break;
 				}
-				else if((balance < -1) && 
-					    (avl_tree->inserted_node->val < avl_tree->compare_node->right->val)) 
+				else if(balance < -1) 
 				{
-					AVLTree_RightRotate(avl_tree->compare_node->right);
-					AVLTree_SetEntireTreeDest(avl_tree);
+					AVLNode* rotated = AVLTree_RightRotate(avl_tree->compare_node->right);
+					AVLTree_MarkLayoutDirty(rotated->right);
+					AVLTree_RefreshLabels(avl_tree, rotated);
+					AVLTree_UpdateLayout(avl_tree);
 					avl_tree->left_rotate = true;
 					avl_tree->current_state = AVLTREE_ROTATING;
 					break;
 				}
 
 				if(avl_tree->compare_node->parent == NULL) {
-					avl_tree->root = avl_tree->compare_node;
+					avl_tree->core.root = avl_tree->compare_node;
 				}
 
-				AVLTree_SetEntireTreeDest(avl_tree);
+				AVLTree_UpdateLayout(avl_tree);
 				avl_tree->compare_node = avl_tree->compare_node->parent;
 				avl_tree->current_state = AVLTREE_ROTATING;
 			}
 			else {
-				avl_tree->current_state = AVLTREE_STATIC;
+				// only a split leaves a node hovering once everything lands
+				avl_tree->current_state = avl_tree->detached_node ? AVLTREE_SPLIT : AVLTREE_STATIC;
 			}
 		} break;
 
 		case AVLTREE_ROTATING:
 		{
-			int num_nodes_finished = 0;
-
-			AVLTreeBFSNode bfs_node = AVLTree_BFS(avl_tree);
-			while(bfs_node.node) {                          
-				AVLNode* node = bfs_node.node;                 
-				GameCube* cube = &node->cube;
-
-				if(AVLTree_AnimationFinished(node)) {
-					num_nodes_finished++;
-				}
-			
-				bfs_node = AVLTree_BFS(avl_tree);          
-			}                                               
+			// Only nodes the last layout moved can be animating
+			bool settled = AVLTree_SettleAnimations(avl_tree);
 
-			if(num_nodes_finished == avl_tree->size) {
+			// a split key has its own trip to make
+			bool detached_finished = !avl_tree->detached_node || 
+				                     AVLTree_AnimationFinished(avl_tree->detached_node);
+			if(settled && detached_finished) {
 				avl_tree->current_state = AVLTREE_UPDATE_HEIGHTS;
 			}
 		} break;
@@ -868,55 +1824,43 @@ AVLTree* AVLTree_Init() {
 		return NULL;
 	}
 
-	avl_tree->initializing = true;
-	global_avl_tree_units_per_second = 50.0f;
+	AVLNodePool_Init(&avl_tree->core.pool, sizeof(AVLViewNode));
+	avl_tree->core.heat = &avl_tree->heat;
+	avl_tree->core.keep_slots = true; // the layout reads depth straight off nodes
+	global_avl_tree_units_per_second = 7.0f;
 	global_avl_tree_timer_reset = global_timer_constant / (int)global_avl_tree_units_per_second;
 
-	//// Initialize entire tree since the tree will rotate
-	//// and positions will change.
-	//for(int i = 0; i < global_avl_tree_init_size; ++i) {
-	//	int val = rand() % MAX_DIGITS;
-	//	AVLTree_Insert(avl_tree, val);
-	//}
-
-	//if(avl_tree->root) {
-	//	// Set up spacing, width, ..., for 3d node positions
-	//	const int   bottom_level_width = 1 << avl_tree->root->height;
-	//	const float max_tree_width = bottom_level_width * (global_node_width + global_node_margin) - global_node_margin; // subtract one node_margin for the far right node
-	//	const float x_start = (max_tree_width / 2.0f) * -1.0f;
-	//	const float y_start = 0.0f;
-
-	//	// Generate node geometry
-	//	AVLTreeBFSNode bfs_node = AVLTree_BFS(avl_tree);
-	//	while(bfs_node.node) {
-	//		AVLNode* node = bfs_node.node;
-
-	//		float split = exp2f((float)(bfs_node.level + 1));
-	//		float x_width = (max_tree_width / split);
-	//		// map node indices to odd #'s
-	//		uint64_t split_index = (bfs_node.level_index * 2) + 1;
-	//		// x_pos, y_pos is the center of the node
-	//		float x_pos = x_start + ((float)split_index * x_width);
-	//		float y_pos = y_start - ((float)bfs_node.level * global_y_spacing);
-
-	//		// Generate all nodes at the origin and set their
-	//		// destinations to their proper positions in the tree.
-	//		// Destinations are based on top left corner (first cube index)
-	//		// of the GameCube.
-	//		float r = 0.0f; //(float)rand() / (float)RAND_MAX;
-	//		float g = 0.0f; //(float)rand() / (float)RAND_MAX;
-	//		float b = 1.0f; //(float)rand() / (float)RAND_MAX;
-	//		node->cube = GenCube(0.0f, 0.0f, 0.0f, node->val, r, g, b);
-	//		// TODO: This would be half node width if I add that as a parameter in engine.cpp
-	//		//       where the nodes are defined and generated.
-	//		node->x_dest = x_pos - 0.5f;
-	//		node->y_dest = y_pos + 0.5f;
-
-	//		AVLTree_SetVelocity(node);
-
-	//		bfs_node = AVLTree_BFS(avl_tree);
-	//	}
-	//}
+	// Start from the saved tree if there is one, otherwise bulk
+	// build a random one. Either way it's placed so it shows up
+	// right away instead of animating each insert.
+	if(!AVLTree_LoadKeys(avl_tree, global_avl_tree_file)) {
+		int init_size = (global_avl_tree_init_size < MAX_DIGITS) ? 
+			            global_avl_tree_init_size : MAX_DIGITS;
+		int keys[MAX_DIGITS];
+		bool key_used[MAX_DIGITS] = {0};
+		for(int i = 0; i < init_size; ++i) {
+			int val = rand() % MAX_DIGITS;
+			while(key_used[val]) {
+				val = (val + 1) % MAX_DIGITS;
+			}
+			key_used[val] = true;
+			keys[i] = val;
+		}
+		AVLTree_Build(&avl_tree->core, keys, init_size);
+	}
+
+	if(avl_tree->core.root) {
+		AVLTreeBFSNode bfs_node = AVLTree_BFS(avl_tree);
+		while(bfs_node.node) {
+			AVLViewNode* node = AVLTree_View(bfs_node.node);
+			node->cube = GenCube(0.0f, 0.0f, 0.0f, node->node.val, 0.0f, 0.0f, 1.0f);
+			AVLTree_ResetColor(avl_tree, &node->node);
+			avl_tree->nodes_by_key[node->node.val] = &node->node;
+			bfs_node = AVLTree_BFS(avl_tree);
+		}
+		AVLTree_SnapEntireTreeToDest(avl_tree);
+	}
+	AVLPersistent_PushCopy(&avl_tree->history, avl_tree->core.root);
 
 	avl_tree->current_state = AVLTREE_STATIC;
 	avl_tree->previous_state = AVLTREE_PAUSED;
@@ -936,6 +1880,15 @@ AVLTree* AVLTree_Init() {
 	GLCall(glEnableVertexAttribArray(0));
 	GLCall(glEnableVertexAttribArray(1));
 
+	GLCall(glGenVertexArrays(1, &avl_tree->edge_vao));
+	GLCall(glBindVertexArray(avl_tree->edge_vao));
+	GLCall(glGenBuffers(1, &avl_tree->edge_vbo));
+	GLCall(glBindBuffer(GL_ARRAY_BUFFER, avl_tree->edge_vbo));
+	GLCall(glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(offsetof(Vertex, pos))));
+	GLCall(glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(offsetof(Vertex, rgb))));
+	GLCall(glEnableVertexAttribArray(0));
+	GLCall(glEnableVertexAttribArray(1));
+
 	GLCall(glBindBuffer(GL_ARRAY_BUFFER, 0));
 	GLCall(glBindVertexArray(0));
 
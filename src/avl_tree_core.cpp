@@ -0,0 +1,3366 @@
+/*
+ * AVL tree data structure. Nothing in here knows about opengl or the
+ * platform layer so it can be built on its own, e.g. by avl_bench.cpp,
+ * as well as being included by the avl_tree.cpp visualization.
+ *
+ */
+
+#if !defined(AVL_TREE_CORE_CPP)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <algorithm>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "thread_pool.cpp"
+
+/* Keys are compared three way: negative if a < b, 0 if equal and
+ * positive if a > b. That way each step down the tree costs a single
+ * comparison no matter how expensive the key is to compare.
+ *
+ * The default works for anything with operator<, e.g. ints, floats,
+ * 64 bit IDs or composite keys that define one. Specialize it or pass
+ * a different Compare to the tree for anything else.
+ */
+template <typename Key>
+struct AVLCompare {
+	inline int operator()(const Key& a, const Key& b) const {
+		return (int)(b < a) - (int)(a < b);
+	}
+};
+
+// Short string key, zero padded so keys compare bytewise in one memcmp
+template <int N>
+struct AVLFixedString {
+	char data[N];
+};
+
+template <int N>
+struct AVLCompare<AVLFixedString<N> > {
+	inline int operator()(const AVLFixedString<N>& a, const AVLFixedString<N>& b) const {
+		return memcmp(a.data, b.data, N);
+	}
+};
+
+// Anything past N - 1 characters is cut off
+template <int N>
+static inline AVLFixedString<N> AVLFixedString_Make(const char* str) {
+	AVLFixedString<N> result;
+	memset(result.data, 0, N);
+	if(str) {
+		strncpy(result.data, str, N - 1);
+	}
+	return result;
+}
+
+template <typename Key>
+struct AVLNodeT {
+	// data
+	AVLNodeT* parent;
+	AVLNodeT* left;
+	AVLNodeT* right;
+	Key val;
+	int height;
+	int subtree_size; // nodes in this subtree including this one
+	int duplicates; // copies of val past the first, see AVLTreeCoreT::multiset
+	int visits; // lookups and inserts that walked through here, see AVLHeat
+
+	// layout slot: depth from the root and index within that
+	// level (i.e. the path from the root as bits, 1 = right)
+	int depth;
+	uint64_t level_index;
+};
+
+// the visualization only ever shows int keys
+typedef AVLNodeT<int> AVLNode;
+
+typedef struct AVLNodePoolBlock {
+	struct AVLNodePoolBlock* next;
+	size_t used;
+	size_t capacity;
+} AVLNodePoolBlock;
+
+/* Fixed size node allocator. Nodes are bump allocated out of large
+ * blocks and recycled through a free list. A bulk build reserves
+ * all of its nodes up front so they end up packed together in memory
+ * instead of scattered across one calloc per node.
+ */
+typedef struct {
+	size_t node_size;
+	AVLNodePoolBlock* blocks;
+	void* free_list;
+} AVLNodePool;
+
+#define AVL_HEAT_CACHE_LINE 64
+#define AVL_HEAT_MAX_LINES 128
+
+/* Access counts, kept while a tree's heat points at one. Every node
+ * AVLTree_Find, AVLTree_Insert and their finger versions walk through
+ * bumps its visits. Cache lines are estimated from the bytes a step
+ * down reads (the child pointers and the key): each distinct line
+ * counts once per operation.
+ */
+typedef struct {
+	uint64_t operations;
+	uint64_t visits; // summed over every node
+	uint64_t cache_lines; // summed over every operation
+	int max_visits; // the hottest node's, to scale colors by
+
+	// lines the current operation has touched so far
+	int num_op_lines;
+	uintptr_t op_lines[AVL_HEAT_MAX_LINES];
+} AVLHeat;
+
+template <typename Key, typename Compare = AVLCompare<Key> >
+struct AVLTreeCoreT {
+	typedef Key KeyType;
+	typedef AVLNodeT<Key> Node;
+
+	int size;
+	Node* root;
+	AVLNodePool pool;
+	Compare compare;
+
+	// rotations done by AVLTree_Insert, a double rotation counts as 2
+	uint64_t rotations;
+
+	// Multiset: inserting a key that's already there adds a copy to
+	// its node's count instead of being ignored and deleting takes
+	// one copy off before it takes the node out. size still counts
+	// nodes (as do rank/select), so the tree holds size + duplicates
+	// keys in all.
+	bool multiset;
+	int duplicates;
+
+	// Layout slots (AVLNodeT::depth and level_index) are only kept up
+	// to date while this is set, e.g. by the visualization. Otherwise
+	// a rotation is O(1) instead of renumbering the subtree it moved,
+	// and AVLTree_GetNodeSlot works a slot out from parent pointers.
+	bool keep_slots;
+
+	// NULL unless access counts are wanted, see AVLHeat
+	AVLHeat* heat;
+};
+
+typedef AVLTreeCoreT<int> AVLTreeCore;
+
+/*********************************************
+ * AVLNodePool functions                     *
+ *********************************************/
+#define AVL_POOL_MIN_BLOCK_NODES 64
+// keep node memory 16 byte aligned after the block header
+#define AVL_POOL_BLOCK_HEADER_SIZE ((sizeof(AVLNodePoolBlock) + 15) & ~(size_t)15)
+
+static void AVLNodePool_Init(AVLNodePool* pool, size_t node_size) {
+	assert(pool);
+	assert(sizeof(void*) <= node_size);
+
+	pool->node_size = (node_size + 7) & ~(size_t)7;
+	pool->blocks = NULL;
+	pool->free_list = NULL;
+}
+
+// Makes sure the next count allocations (that don't come
+// off the free list) are contiguous.
+static bool AVLNodePool_Reserve(AVLNodePool* pool, size_t count) {
+	assert(pool);
+	assert(pool->node_size);
+
+	AVLNodePoolBlock* block = pool->blocks;
+	if(block && (count <= (block->capacity - block->used))) {
+		return true;
+	}
+
+	size_t capacity = AVL_POOL_MIN_BLOCK_NODES;
+	if(block && (capacity < (block->capacity * 2))) {
+		capacity = block->capacity * 2;
+	}
+	if(capacity < count) {
+		capacity = count;
+	}
+
+	AVLNodePoolBlock* new_block = (AVLNodePoolBlock*)malloc(AVL_POOL_BLOCK_HEADER_SIZE + 
+			                                                (capacity * pool->node_size));
+	if(!new_block) {
+		fprintf(stderr, "Couldn't malloc for AVLNodePoolBlock\n");
+		return false;
+	}
+	new_block->next = block;
+	new_block->used = 0;
+	new_block->capacity = capacity;
+	pool->blocks = new_block;
+
+	return true;
+}
+
+// Returns zeroed memory for one node
+static void* AVLNodePool_Alloc(AVLNodePool* pool) {
+	assert(pool);
+
+	void* node = pool->free_list;
+	if(node) {
+		pool->free_list = *(void**)node;
+	}
+	else {
+		if(!AVLNodePool_Reserve(pool, 1)) {
+			return NULL;
+		}
+		AVLNodePoolBlock* block = pool->blocks;
+		node = (uint8_t*)block + AVL_POOL_BLOCK_HEADER_SIZE + (block->used * pool->node_size);
+		block->used++;
+	}
+
+	memset(node, 0, pool->node_size);
+	return node;
+}
+
+/* Hands out count contiguous zeroed nodes in one go. Nothing else
+ * touches the pool while they get filled in, so several threads can
+ * fill in different parts of the run at the same time.
+ */
+static void* AVLNodePool_AllocRun(AVLNodePool* pool, size_t count) {
+	assert(pool);
+	assert(count);
+
+	if(!AVLNodePool_Reserve(pool, count)) {
+		return NULL;
+	}
+	AVLNodePoolBlock* block = pool->blocks;
+	void* nodes = (uint8_t*)block + AVL_POOL_BLOCK_HEADER_SIZE + (block->used * pool->node_size);
+	block->used += count;
+
+	memset(nodes, 0, count * pool->node_size);
+	return nodes;
+}
+
+static void AVLNodePool_Free(AVLNodePool* pool, void* node) {
+	assert(pool);
+	assert(node);
+
+	*(void**)node = pool->free_list;
+	pool->free_list = node;
+}
+
+// Frees every block. All nodes from this pool are invalid after this.
+static void AVLNodePool_Release(AVLNodePool* pool) {
+	assert(pool);
+
+	AVLNodePoolBlock* block = pool->blocks;
+	while(block) {
+		AVLNodePoolBlock* next = block->next;
+		free(block);
+		block = next;
+	}
+	pool->blocks = NULL;
+	pool->free_list = NULL;
+}
+
+/* Moves every block and free node of src into dst so trees that were
+ * merged together can be released through a single pool. src is left
+ * empty. Both pools have to hold the same kind of node.
+ */
+static void AVLNodePool_Absorb(AVLNodePool* dst, AVLNodePool* src) {
+	assert(dst);
+	assert(src);
+
+	if(src->node_size == 0) {
+		return;
+	}
+	if(dst->node_size == 0) {
+		*dst = *src;
+		AVLNodePool_Init(src, src->node_size);
+		return;
+	}
+	assert(dst->node_size == src->node_size);
+
+	// NOTE: src blocks go after dst's so dst keeps bump
+	//       allocating out of the block it was already using
+	AVLNodePoolBlock** block = &dst->blocks;
+	while(*block) {
+		block = &(*block)->next;
+	}
+	*block = src->blocks;
+
+	if(src->free_list) {
+		void** free_node = (void**)src->free_list;
+		while(*free_node) {
+			free_node = (void**)*free_node;
+		}
+		*free_node = dst->free_list;
+		dst->free_list = src->free_list;
+	}
+
+	src->blocks = NULL;
+	src->free_list = NULL;
+}
+
+/*********************************************
+ * AVLTree data functions					 *
+ *********************************************/
+// NOTE: these only need height, subtree_size and the child
+//       pointers so they work for every node type in here
+template <typename Node>
+static inline int AVLTree_GetHeight(const Node* node) {
+	return (node == NULL) ? -1 : node->height;
+}
+
+template <typename Node>
+static inline void AVLTree_UpdateHeight(Node* node) {
+	assert(node);
+
+	int hl = AVLTree_GetHeight(node->left);
+	int hr = AVLTree_GetHeight(node->right);
+	node->height = (hl > hr) ? (hl + 1) : (hr + 1);
+}
+
+template <typename Node>
+static inline int AVLTree_GetSubtreeSize(const Node* node) {
+	return (node == NULL) ? 0 : node->subtree_size;
+}
+
+// Recomputes everything a node caches about its subtree. Both
+// children have to be up to date.
+template <typename Node>
+static inline void AVLTree_UpdateNode(Node* node) {
+	assert(node);
+
+	AVLTree_UpdateHeight(node);
+	node->subtree_size = AVLTree_GetSubtreeSize(node->left) + AVLTree_GetSubtreeSize(node->right) + 1;
+}
+
+template <typename Node>
+static inline int AVLTree_GetBalance(const Node* node) {
+	assert(node);
+	int hl = AVLTree_GetHeight(node->left);
+	int hr = AVLTree_GetHeight(node->right);
+	return hl - hr;
+}
+
+// O(1) when the tree keeps slots up to date, otherwise a walk up to
+// the root (or whatever root node's subtree hangs off)
+template <typename Tree>
+static inline void AVLTree_GetNodeSlot(const Tree* tree, const typename Tree::Node* node, 
+		                               int* depth, uint64_t* level_index) {
+	assert(tree);
+	assert(node);
+	assert(depth);
+	assert(level_index);
+
+	if(tree->keep_slots) {
+		*depth = node->depth;
+		*level_index = node->level_index;
+		return;
+	}
+
+	*depth = 0;
+	*level_index = 0;
+	for(const typename Tree::Node* child = node; child->parent; child = child->parent) {
+		if(child->parent->right == child) {
+			*level_index |= (uint64_t)1 << *depth;
+		}
+		++*depth;
+	}
+}
+
+// A rotation moves whole subtrees up or down a level, so every
+// node under the rotated position gets renumbered. Trees that don't
+// keep slots rotate with update_slots off, and so does bulk
+// restructuring like AVLTree_Join, which renumbers the result once
+// at the end instead.
+template <typename Key>
+static void AVLTree_SetSubtreeSlots(AVLNodeT<Key>* node, const int depth, const uint64_t level_index) {
+	if(node == NULL) {
+		return;
+	}
+
+	node->depth = depth;
+	node->level_index = level_index;
+	AVLTree_SetSubtreeSlots(node->left, depth + 1, 2 * level_index);
+	AVLTree_SetSubtreeSlots(node->right, depth + 1, (2 * level_index) + 1);
+}
+
+// AVLTree_SetSubtreeSlots, if tree keeps slots at all
+template <typename Tree>
+static inline void AVLTree_KeepSubtreeSlots(const Tree* tree, typename Tree::Node* node, 
+		                                    const int depth, const uint64_t level_index) {
+	if(tree->keep_slots) {
+		AVLTree_SetSubtreeSlots(node, depth, level_index);
+	}
+}
+
+template <typename Key>
+static inline void AVLTree_LinkChild(AVLNodeT<Key>* parent, AVLNodeT<Key>* child, const bool left) {
+	assert(parent);
+	assert(child);
+
+	if(left) {
+		parent->left = child;
+	}
+	else {
+		parent->right = child;
+	}
+	child->parent = parent;
+	child->depth = parent->depth + 1;
+	child->level_index = (2 * parent->level_index) + (left ? 0 : 1);
+}
+
+template <typename Key>
+static AVLNodeT<Key>* AVLTree_RightRotate(AVLNodeT<Key>* const node, const bool update_slots = true) {
+	assert(node);
+
+	AVLNodeT<Key>* const parent   = node->parent;
+	AVLNodeT<Key>* const left     = node->left;
+	AVLNodeT<Key>* const new_left = left->right;
+	const int            depth       = node->depth;
+	const uint64_t       level_index = node->level_index;
+
+	// shift left node to this node's position
+	node->parent = left;
+	left->right = node;
+
+	// attach left's right subtree to this node's left
+	node->left = new_left;
+	if(new_left != NULL) {
+		new_left->parent = node;
+	}
+
+	// attach parent to new node
+	left->parent = parent;
+	if(parent != NULL) {
+		if(parent->left == node) {
+			parent->left = left;
+		}
+		else {
+			parent->right = left;
+		}
+	}
+
+	// NOTE: must be in this order
+	//       because height of left
+	//       relies on new height of node
+	AVLTree_UpdateNode(node);
+	AVLTree_UpdateNode(left);
+	if(update_slots) {
+		AVLTree_SetSubtreeSlots(left, depth, level_index);
+	}
+
+	// return left node which is taking the place of the node
+	// passed in
+	return left;
+}
+
+template <typename Key>
+static AVLNodeT<Key>* AVLTree_LeftRotate(AVLNodeT<Key>* const node, const bool update_slots = true) {
+	assert(node);
+
+	AVLNodeT<Key>* const parent    = node->parent;
+	AVLNodeT<Key>* const right     = node->right;
+	AVLNodeT<Key>* const new_right = right->left;
+	const int            depth       = node->depth;
+	const uint64_t       level_index = node->level_index;
+
+	// shift right node to this node's position
+	node->parent = right;
+	right->left = node;
+
+	// attach right's left subtree to this node's right
+	node->right = new_right;
+	if(new_right) {
+		new_right->parent = node;
+	}
+
+	// attach parent to new node
+	right->parent = parent;
+	if(parent != NULL) {
+		if(parent->left == node) {
+			parent->left = right;
+		}
+		else {
+			parent->right = right;
+		}
+	}
+
+	// NOTE: must be in this order
+	//       because height of right
+	//       relies on new height of node
+	AVLTree_UpdateNode(node);
+	AVLTree_UpdateNode(right);
+	if(update_slots) {
+		AVLTree_SetSubtreeSlots(right, depth, level_index);
+	}
+
+	// return right node which is taking the place of the node
+	// passed in
+	return right;
+}
+
+// Trees that were never set up by AVLTree_Init get plain data nodes
+template <typename Tree>
+static typename Tree::Node* AVLTree_AllocNode(Tree* tree) {
+	assert(tree);
+
+	if(tree->pool.node_size == 0) {
+		AVLNodePool_Init(&tree->pool, sizeof(typename Tree::Node));
+	}
+
+	return (typename Tree::Node*)AVLNodePool_Alloc(&tree->pool);
+}
+
+/* Fixes heights and sizes from node up to the root, rotating wherever
+ * the balance is off.
+ *
+ * Which rotation is needed is read off the balance of the heavy child
+ * instead of comparing keys: it only needs a double rotation when it
+ * leans the other way. Right after an insert the heavy child leans
+ * toward the side the key went down, after a delete it can also be
+ * even, which takes a single rotation.
+ *
+ * Once a subtree is back at the height it had, nothing above it can
+ * be out of balance anymore and the rest of the way up only the sizes
+ * change, by the same amount. That part is just a pointer chase, so a
+ * search that started low in the tree (see AVLTree_InsertNear) stays
+ * cheap.
+ */
+template <typename Tree>
+static void AVLTree_RebalanceFrom(Tree* tree, typename Tree::Node* node) {
+	typename Tree::Node* current_node = node;
+	while(current_node != NULL) {
+		int old_height = current_node->height;
+		int old_size = current_node->subtree_size;
+		AVLTree_UpdateNode(current_node);
+		int balance = AVLTree_GetBalance(current_node);
+
+		if(balance > 1) {
+			if(AVLTree_GetBalance(current_node->left) < 0) {
+				AVLTree_LeftRotate(current_node->left, tree->keep_slots);
+				tree->rotations++;
+			}
+			current_node = AVLTree_RightRotate(current_node, tree->keep_slots);
+			tree->rotations++;
+		}
+		else if(balance < -1) {
+			if(AVLTree_GetBalance(current_node->right) > 0) {
+				AVLTree_RightRotate(current_node->right, tree->keep_slots);
+				tree->rotations++;
+			}
+			current_node = AVLTree_LeftRotate(current_node, tree->keep_slots);
+			tree->rotations++;
+		}
+
+		if(current_node->parent == NULL) {
+			tree->root = current_node;
+		}
+
+		if(current_node->height == old_height) {
+			int size_change = current_node->subtree_size - old_size;
+			for(current_node = current_node->parent; current_node; current_node = current_node->parent) {
+				current_node->subtree_size += size_change;
+			}
+			return;
+		}
+
+		current_node = current_node->parent;
+	}
+}
+
+// Rebalances on the way back up from a newly linked node
+template <typename Tree>
+static inline void AVLTree_RebalanceAfterInsert(Tree* tree, typename Tree::Node* node) {
+	AVLTree_RebalanceFrom(tree, node->parent);
+}
+
+// Only AVLTreeCoreT keeps access counts, other trees (e.g. compact
+// ones going through AVLTree_Find) walk without them
+template <typename Tree>
+static inline void AVLHeat_Begin(const Tree* tree) {
+}
+
+template <typename Tree, typename Node>
+static inline void AVLHeat_Touch(const Tree* tree, Node* node) {
+}
+
+template <typename Key, typename Compare>
+static inline void AVLHeat_Begin(const AVLTreeCoreT<Key, Compare>* tree) {
+	if(tree->heat) {
+		tree->heat->operations++;
+		tree->heat->num_op_lines = 0;
+	}
+}
+
+// Lines past AVL_HEAT_MAX_LINES in one operation can count twice
+static inline void AVLHeat_TouchLine(AVLHeat* heat, uintptr_t line) {
+	for(int i = 0; i < heat->num_op_lines; ++i) {
+		if(heat->op_lines[i] == line) {
+			return;
+		}
+	}
+
+	heat->cache_lines++;
+	if(heat->num_op_lines < AVL_HEAT_MAX_LINES) {
+		heat->op_lines[heat->num_op_lines++] = line;
+	}
+}
+
+template <typename Key, typename Compare>
+static inline void AVLHeat_Touch(const AVLTreeCoreT<Key, Compare>* tree, AVLNodeT<Key>* node) {
+	AVLHeat* heat = tree->heat;
+	if(heat == NULL) {
+		return;
+	}
+
+	node->visits++;
+	heat->visits++;
+	if(node->visits > heat->max_visits) {
+		heat->max_visits = node->visits;
+	}
+
+	// a step down reads left, right and val, which can straddle two lines
+	uintptr_t first = (uintptr_t)&node->left / AVL_HEAT_CACHE_LINE;
+	uintptr_t last = ((uintptr_t)(&node->val + 1) - 1) / AVL_HEAT_CACHE_LINE;
+	for(uintptr_t line = first; line <= last; ++line) {
+		AVLHeat_TouchLine(heat, line);
+	}
+}
+
+// Each step down compares once and the last result picks the side
+// the new node is linked on. The walk down starts at start, which has
+// to be the root or a node whose subtree val belongs in. Returns the
+// new leaf, or NULL if val was already in the tree (which counts one
+// more copy of it in a multiset).
+template <typename Tree>
+static typename Tree::Node* AVLTree_LinkLeaf(Tree *const tree, typename Tree::Node* start, 
+		                                     const typename Tree::KeyType& val) {
+	assert(tree);
+
+	// normal BST insert
+	typename Tree::Node* parent_node = NULL;
+	typename Tree::Node* current_node = start;
+	int cmp = 0;
+	while(current_node != NULL) {
+		parent_node = current_node;
+		AVLHeat_Touch(tree, current_node);
+		cmp = tree->compare(val, current_node->val);
+		if(cmp < 0) {
+			current_node = current_node->left;
+		}
+		else if(cmp > 0) {
+			current_node = current_node->right;
+		}
+		else {
+			if(tree->multiset) {
+				current_node->duplicates++;
+				tree->duplicates++;
+			}
+			return NULL;
+		}
+	}
+
+	current_node = AVLTree_AllocNode(tree);
+	current_node->val = val;
+	current_node->subtree_size = 1;
+	tree->size++;
+	if(parent_node == NULL) {
+		tree->root = current_node;
+	}
+	else {
+		AVLTree_LinkChild(parent_node, current_node, cmp < 0);
+	}
+
+	return current_node;
+}
+
+// Keys already in the tree are ignored, unless it's a multiset
+template <typename Tree>
+void AVLTree_Insert(Tree *const tree, const typename Tree::KeyType& val) {
+	AVLHeat_Begin(tree);
+	typename Tree::Node* node = AVLTree_LinkLeaf(tree, tree->root, val);
+	if(node == NULL) {
+		return;
+	}
+
+	// go back up tree
+	// adjust heights
+	// check for imbalance
+	// rotate if necessary
+	AVLTree_RebalanceAfterInsert(tree, node);
+}
+
+// Returns the node holding val or NULL if it isn't in the tree
+template <typename Tree>
+typename Tree::Node* AVLTree_Find(const Tree* tree, const typename Tree::KeyType& val) {
+	assert(tree);
+
+	AVLHeat_Begin(tree);
+	typename Tree::Node* node = tree->root;
+	while(node != NULL) {
+		AVLHeat_Touch(tree, node);
+		int cmp = tree->compare(val, node->val);
+		if(cmp < 0) {
+			node = node->left;
+		}
+		else if(cmp > 0) {
+			node = node->right;
+		}
+		else {
+			break;
+		}
+	}
+
+	return node;
+}
+
+// How many copies of val the tree holds, at most 1 unless it's a multiset
+template <typename Tree>
+int AVLTree_Count(const Tree* tree, const typename Tree::KeyType& val) {
+	typename Tree::Node* node = AVLTree_Find(tree, val);
+	return node ? (node->duplicates + 1) : 0;
+}
+
+/* Number of keys in the tree that are less than val, i.e. the index
+ * val has (or would have) in sorted order. O(log n) since every node
+ * knows the size of its subtree.
+ */
+template <typename Tree>
+int AVLTree_Rank(const Tree* tree, const typename Tree::KeyType& val) {
+	assert(tree);
+
+	int rank = 0;
+	typename Tree::Node* node = tree->root;
+	while(node != NULL) {
+		int cmp = tree->compare(val, node->val);
+		if(cmp < 0) {
+			node = node->left;
+		}
+		else if(cmp > 0) {
+			rank += AVLTree_GetSubtreeSize(node->left) + 1;
+			node = node->right;
+		}
+		else {
+			rank += AVLTree_GetSubtreeSize(node->left);
+			break;
+		}
+	}
+
+	return rank;
+}
+
+/* Returns the node with the kth smallest key (0 based) or NULL if k is
+ * out of range. A percentile p is AVLTree_Select(tree, p * (size - 1)).
+ */
+template <typename Tree>
+typename Tree::Node* AVLTree_Select(const Tree* tree, int k) {
+	assert(tree);
+
+	if((k < 0) || (tree->size <= k)) {
+		return NULL;
+	}
+
+	typename Tree::Node* node = tree->root;
+	while(node != NULL) {
+		int left_size = AVLTree_GetSubtreeSize(node->left);
+		if(k < left_size) {
+			node = node->left;
+		}
+		else if(k > left_size) {
+			k -= left_size + 1;
+			node = node->right;
+		}
+		else {
+			break;
+		}
+	}
+
+	return node;
+}
+
+/*********************************************
+ * In order traversal                        *
+ *********************************************/
+template <typename Key>
+static inline AVLNodeT<Key>* AVLTree_Leftmost(AVLNodeT<Key>* node) {
+	if(node != NULL) {
+		while(node->left != NULL) {
+			node = node->left;
+		}
+	}
+	return node;
+}
+
+template <typename Key>
+static inline AVLNodeT<Key>* AVLTree_Rightmost(AVLNodeT<Key>* node) {
+	if(node != NULL) {
+		while(node->right != NULL) {
+			node = node->right;
+		}
+	}
+	return node;
+}
+
+template <typename Tree>
+inline typename Tree::Node* AVLTree_First(const Tree* tree) {
+	assert(tree);
+	return AVLTree_Leftmost(tree->root);
+}
+
+template <typename Tree>
+inline typename Tree::Node* AVLTree_Last(const Tree* tree) {
+	assert(tree);
+	return AVLTree_Rightmost(tree->root);
+}
+
+/* Next node in key order or NULL after the last one. Follows parent
+ * pointers so a full walk touches every edge twice, which makes each
+ * step O(1) amortized even though a single step can be O(log n).
+ */
+template <typename Key>
+AVLNodeT<Key>* AVLTree_Next(AVLNodeT<Key>* node) {
+	assert(node);
+
+	if(node->right != NULL) {
+		return AVLTree_Leftmost(node->right);
+	}
+
+	AVLNodeT<Key>* parent = node->parent;
+	while((parent != NULL) && (node == parent->right)) {
+		node = parent;
+		parent = parent->parent;
+	}
+	return parent;
+}
+
+template <typename Key>
+AVLNodeT<Key>* AVLTree_Prev(AVLNodeT<Key>* node) {
+	assert(node);
+
+	if(node->left != NULL) {
+		return AVLTree_Rightmost(node->left);
+	}
+
+	AVLNodeT<Key>* parent = node->parent;
+	while((parent != NULL) && (node == parent->left)) {
+		node = parent;
+		parent = parent->parent;
+	}
+	return parent;
+}
+
+// First node with a key >= val or NULL if there is none
+template <typename Tree>
+typename Tree::Node* AVLTree_LowerBound(const Tree* tree, const typename Tree::KeyType& val) {
+	assert(tree);
+
+	typename Tree::Node* result = NULL;
+	typename Tree::Node* node = tree->root;
+	while(node != NULL) {
+		if(tree->compare(val, node->val) <= 0) {
+			result = node;
+			node = node->left;
+		}
+		else {
+			node = node->right;
+		}
+	}
+
+	return result;
+}
+
+// First node with a key > val or NULL if there is none
+template <typename Tree>
+typename Tree::Node* AVLTree_UpperBound(const Tree* tree, const typename Tree::KeyType& val) {
+	assert(tree);
+
+	typename Tree::Node* result = NULL;
+	typename Tree::Node* node = tree->root;
+	while(node != NULL) {
+		if(tree->compare(val, node->val) < 0) {
+			result = node;
+			node = node->left;
+		}
+		else {
+			node = node->right;
+		}
+	}
+
+	return result;
+}
+
+/* Walks every key in [low, high] in order, e.g.:
+
+AVLRangeCursorT<AVLNode> cursor = AVLTree_Range(tree, low, high);
+while(AVLNode* node = AVLTree_RangeNext(&cursor)) {
+	...
+}
+ *
+ * Both ends are found up front so stepping never compares keys.
+ * The tree must not change while a cursor is in use.
+ */
+template <typename Node>
+struct AVLRangeCursorT {
+	Node* node;
+	Node* end; // one past the last node in range, NULL = end of tree
+};
+
+template <typename Tree>
+AVLRangeCursorT<typename Tree::Node> AVLTree_Range(const Tree* tree, const typename Tree::KeyType& low, 
+		                                           const typename Tree::KeyType& high) {
+	assert(tree);
+
+	AVLRangeCursorT<typename Tree::Node> cursor;
+	cursor.node = NULL;
+	cursor.end = NULL;
+	if(tree->compare(low, high) <= 0) {
+		cursor.node = AVLTree_LowerBound(tree, low);
+		cursor.end = AVLTree_UpperBound(tree, high);
+	}
+
+	return cursor;
+}
+
+// Returns the current node and moves past it, NULL once the range is done
+template <typename Node>
+inline Node* AVLTree_RangeNext(AVLRangeCursorT<Node>* cursor) {
+	assert(cursor);
+
+	Node* node = cursor->node;
+	if(node == cursor->end) {
+		return NULL;
+	}
+	cursor->node = AVLTree_Next(node);
+	return node;
+}
+
+/*********************************************
+ * Finger search                             *
+ *********************************************/
+/* A finger remembers the last node an insert or lookup ended at. The
+ * next one climbs from there through the parent links only until it
+ * reaches a subtree val belongs in, then walks down as usual. A key
+ * d positions away from the last one costs O(log d) instead of
+ * O(log n), so nearly sorted streams (timestamps, ids) mostly stay
+ * near the bottom of the tree.
+ *
+ * Start with node = NULL. Rotations keep every node in the tree so a
+ * finger stays good across inserts, but anything that removes or
+ * frees nodes (deletes, split, set operations, builds) needs it
+ * reset to NULL first.
+ */
+template <typename Node>
+struct AVLFingerT {
+	Node* node;
+};
+
+/* Where a search for val from finger has to start. Climbing over a
+ * parent on the same side as val skips a compare, since that parent
+ * can't bound val from the other side. The first parent on the
+ * other side does: if val is on its near side, the node just
+ * climbed from already covers val.
+ */
+template <typename Tree>
+typename Tree::Node* AVLTree_FingerStart(const Tree* tree, const AVLFingerT<typename Tree::Node>* finger, 
+		                                 const typename Tree::KeyType& val) {
+	assert(tree);
+	assert(finger);
+
+	typedef typename Tree::Node Node;
+	Node* node = finger->node;
+	if(node == NULL) {
+		return tree->root;
+	}
+
+	AVLHeat_Touch(tree, node);
+	int cmp = tree->compare(val, node->val);
+	while(cmp != 0) {
+		Node* child = node;
+		Node* parent = node->parent;
+		if(cmp > 0) {
+			while(parent && (parent->right == child)) {
+				AVLHeat_Touch(tree, parent);
+				child = parent;
+				parent = parent->parent;
+			}
+		}
+		else {
+			while(parent && (parent->left == child)) {
+				AVLHeat_Touch(tree, parent);
+				child = parent;
+				parent = parent->parent;
+			}
+		}
+
+		// nothing above bounds val, or the first parent that can does
+		if(parent == NULL) {
+			return node;
+		}
+		AVLHeat_Touch(tree, parent);
+		int parent_cmp = tree->compare(val, parent->val);
+		if((cmp > 0) ? (parent_cmp < 0) : (parent_cmp > 0)) {
+			return node;
+		}
+		node = parent;
+		cmp = parent_cmp;
+	}
+
+	return node;
+}
+
+// Same as AVLTree_Find. The finger moves to the node found, or the
+// last node visited if val isn't there.
+template <typename Tree>
+typename Tree::Node* AVLTree_FindNear(const Tree* tree, AVLFingerT<typename Tree::Node>* finger, 
+		                              const typename Tree::KeyType& val) {
+	AVLHeat_Begin(tree);
+	typename Tree::Node* node = AVLTree_FingerStart(tree, finger, val);
+	while(node != NULL) {
+		finger->node = node;
+		AVLHeat_Touch(tree, node);
+		int cmp = tree->compare(val, node->val);
+		if(cmp < 0) {
+			node = node->left;
+		}
+		else if(cmp > 0) {
+			node = node->right;
+		}
+		else {
+			break;
+		}
+	}
+
+	return node;
+}
+
+// Same as AVLTree_Insert. The finger moves to the new node.
+template <typename Tree>
+void AVLTree_InsertNear(Tree* tree, AVLFingerT<typename Tree::Node>* finger, const typename Tree::KeyType& val) {
+	AVLHeat_Begin(tree);
+	typename Tree::Node* node = AVLTree_LinkLeaf(tree, AVLTree_FingerStart(tree, finger, val), val);
+	if(node == NULL) {
+		return;
+	}
+
+	AVLTree_RebalanceAfterInsert(tree, node);
+	finger->node = node;
+}
+
+/*********************************************
+ * Heat map                                  *
+ *********************************************/
+/* Counting is switched on by pointing the tree at an AVLHeat, e.g.:
+
+AVLHeat heat = {0};
+tree.heat = &heat;
+...
+AVLTree_SaveHeat(&tree, "heat.csv");
+ *
+ * Rotations move nodes but their visits stay with them, so a count
+ * is for the key rather than the spot in the tree.
+ */
+
+// Zeroes every node's visits and the totals
+template <typename Tree>
+void AVLTree_ClearHeat(Tree* tree) {
+	assert(tree);
+
+	for(typename Tree::Node* node = AVLTree_First(tree); node; node = AVLTree_Next(node)) {
+		node->visits = 0;
+	}
+	if(tree->heat) {
+		memset(tree->heat, 0, sizeof(AVLHeat));
+	}
+}
+
+static inline double AVLHeat_VisitsPerOperation(const AVLHeat* heat) {
+	return heat->operations ? ((double)heat->visits / (double)heat->operations) : 0.0;
+}
+
+static inline double AVLHeat_LinesPerOperation(const AVLHeat* heat) {
+	return heat->operations ? ((double)heat->cache_lines / (double)heat->operations) : 0.0;
+}
+
+/* Writes one csv row per node in key order: its rank, depth, visits
+ * and the cache line it starts on, counted from the lowest line any
+ * node starts on. Hot nodes sharing a line show up as equal lines.
+ */
+template <typename Tree>
+bool AVLTree_SaveHeat(const Tree* tree, const char* path) {
+	assert(tree);
+	assert(path);
+
+	typedef typename Tree::Node Node;
+	uintptr_t first_line = UINTPTR_MAX;
+	for(Node* node = AVLTree_First(tree); node; node = AVLTree_Next(node)) {
+		first_line = std::min(first_line, (uintptr_t)node / AVL_HEAT_CACHE_LINE);
+	}
+
+	FILE* file = fopen(path, "w");
+	if(!file) {
+		fprintf(stderr, "Couldn't open %s for writing\n", path);
+		return false;
+	}
+
+	bool written = (fprintf(file, "rank,depth,visits,line\n") > 0);
+	int rank = 0;
+	for(Node* node = AVLTree_First(tree); node && written; node = AVLTree_Next(node)) {
+		int depth = 0;
+		for(Node* parent = node->parent; parent; parent = parent->parent) {
+			++depth;
+		}
+		uintptr_t line = ((uintptr_t)node / AVL_HEAT_CACHE_LINE) - first_line;
+		written = (fprintf(file, "%d,%d,%d,%llu\n", rank++, depth, node->visits, (unsigned long long)line) > 0);
+	}
+	written = (fclose(file) == 0) && written;
+	if(!written) {
+		fprintf(stderr, "Couldn't write %s\n", path);
+		remove(path);
+	}
+	return written;
+}
+
+/*********************************************
+ * Delete                                    *
+ *********************************************/
+/* Takes node out of the tree without rebalancing, along with every
+ * copy counted on it. A node with two
+ * children is replaced by its successor, which gets relinked instead
+ * of having its key copied over, so every other key stays in the
+ * node it was in. Returns the lowest node whose subtree lost a node,
+ * which is where rebalancing starts, or NULL if that's nothing.
+ */
+template <typename Tree>
+static typename Tree::Node* AVLTree_Unlink(Tree* tree, typename Tree::Node* node) {
+	assert(tree);
+	assert(node);
+
+	typedef typename Tree::Node Node;
+	Node* parent = node->parent;
+	Node* replacement = NULL;
+	Node* start = NULL;
+	if((node->left == NULL) || (node->right == NULL)) {
+		replacement = node->left ? node->left : node->right;
+		start = parent;
+		if(replacement) {
+			replacement->parent = parent;
+			AVLTree_KeepSubtreeSlots(tree, replacement, node->depth, node->level_index);
+		}
+	}
+	else {
+		Node* successor = AVLTree_Leftmost(node->right);
+		replacement = successor;
+		if(successor->parent == node) {
+			start = successor;
+		}
+		else {
+			// successor's right subtree takes its old place
+			start = successor->parent;
+			start->left = successor->right;
+			if(successor->right) {
+				successor->right->parent = start;
+				AVLTree_KeepSubtreeSlots(tree, successor->right, successor->depth, successor->level_index);
+			}
+			successor->right = node->right;
+			successor->right->parent = successor;
+		}
+
+		successor->left = node->left;
+		successor->left->parent = successor;
+		successor->parent = parent;
+		// what node had, so rebalancing can tell what changed
+		successor->height = node->height;
+		successor->subtree_size = node->subtree_size;
+		successor->depth = node->depth;
+		successor->level_index = node->level_index;
+		if(start == successor) {
+			AVLTree_KeepSubtreeSlots(tree, successor->right, successor->depth + 1, (2 * successor->level_index) + 1);
+		}
+	}
+
+	if(parent == NULL) {
+		tree->root = replacement;
+	}
+	else if(parent->left == node) {
+		parent->left = replacement;
+	}
+	else {
+		parent->right = replacement;
+	}
+	tree->size--;
+	tree->duplicates -= node->duplicates;
+
+	node->parent = NULL;
+	node->left = NULL;
+	node->right = NULL;
+	return start;
+}
+
+// Takes one copy of node's key off a multiset. False if node holds
+// the last one, i.e. the node itself has to go.
+template <typename Tree>
+static inline bool AVLTree_DropCopy(Tree* tree, typename Tree::Node* node) {
+	if(!tree->multiset || (node->duplicates == 0)) {
+		return false;
+	}
+
+	node->duplicates--;
+	tree->duplicates--;
+	return true;
+}
+
+// Takes node out of the tree but leaves freeing it to the caller
+template <typename Tree>
+void AVLTree_Detach(Tree* tree, typename Tree::Node* node) {
+	typename Tree::Node* start = AVLTree_Unlink(tree, node);
+	AVLTree_RebalanceFrom(tree, start);
+}
+
+// Returns false if val wasn't in the tree. A multiset only
+// loses one copy.
+template <typename Tree>
+bool AVLTree_Delete(Tree* tree, const typename Tree::KeyType& val) {
+	typename Tree::Node* node = AVLTree_Find(tree, val);
+	if(node == NULL) {
+		return false;
+	}
+	if(AVLTree_DropCopy(tree, node)) {
+		return true;
+	}
+
+	AVLTree_Detach(tree, node);
+	AVLNodePool_Free(&tree->pool, node);
+	return true;
+}
+
+/*********************************************
+ * Rank balanced (weak AVL) trees            *
+ *********************************************/
+/* Same nodes and trees as above, except height holds a rank that only
+ * has to stay close to the height: every node's rank is 1 or 2 more
+ * than each of its children's (a missing child has rank -1) and leaves
+ * have rank 0. With inserts only this makes exactly the same trees as
+ * AVLTree_Insert. The difference is in deletes: AVLTree_Delete can
+ * rotate at every level on the way up, while these do at most two
+ * rotations and only change an amortized O(1) ranks.
+ *
+ * Rotations are the same ones the AVL tree uses. They recompute the
+ * height field, so the ranks of the rotated nodes are set again after.
+ * Sizes are still redone all the way up so rank/select keep working.
+ *
+ * Once a tree has seen an AVLWeak_Delete its ranks aren't heights
+ * anymore, so it has to stay away from AVLTree_Insert, join, split
+ * and the set operations.
+ */
+template <typename Node>
+static inline int AVLWeak_RankDiff(const Node* parent, const Node* child) {
+	return parent->height - AVLTree_GetHeight(child);
+}
+
+template <typename Node>
+static void AVLWeak_UpdateSizesFrom(Node* node) {
+	for(; node != NULL; node = node->parent) {
+		node->subtree_size = 1 + AVLTree_GetSubtreeSize(node->left) + AVLTree_GetSubtreeSize(node->right);
+	}
+}
+
+/* A new leaf can have the same rank as its parent. While the parent's
+ * other child is one rank down, promoting the parent fixes it but can
+ * push the problem up a level. Otherwise one or two rotations end it.
+ */
+template <typename Tree>
+void AVLWeak_RebalanceAfterInsert(Tree* tree, typename Tree::Node* node) {
+	assert(tree);
+	assert(node);
+
+	typedef typename Tree::Node Node;
+	AVLWeak_UpdateSizesFrom(node->parent);
+
+	Node* child = node;
+	Node* parent = node->parent;
+	while((parent != NULL) && (parent->height == child->height)) {
+		const bool left = (parent->left == child);
+		Node* sibling = left ? parent->right : parent->left;
+		if(AVLWeak_RankDiff(parent, sibling) == 1) {
+			parent->height++;
+			child = parent;
+			parent = parent->parent;
+			continue;
+		}
+
+		const int rank = parent->height;
+		Node* inner = left ? child->right : child->left;
+		Node* top = NULL;
+		if(AVLWeak_RankDiff(child, inner) == 2) {
+			top = left ? AVLTree_RightRotate(parent, tree->keep_slots) : AVLTree_LeftRotate(parent, tree->keep_slots);
+			child->height = rank;
+			parent->height = rank - 1;
+			tree->rotations++;
+		}
+		else {
+			if(left) {
+				AVLTree_LeftRotate(child, tree->keep_slots);
+				top = AVLTree_RightRotate(parent, tree->keep_slots);
+			}
+			else {
+				AVLTree_RightRotate(child, tree->keep_slots);
+				top = AVLTree_LeftRotate(parent, tree->keep_slots);
+			}
+			inner->height = rank;
+			child->height = rank - 1;
+			parent->height = rank - 1;
+			tree->rotations += 2;
+		}
+
+		if(top->parent == NULL) {
+			tree->root = top;
+		}
+		break;
+	}
+}
+
+/* After a delete, a leaf can be left with rank 1 or a node can end up
+ * 3 ranks above one of its children. Demoting fixes either but can
+ * push the problem up a level. Otherwise one or two rotations end it.
+ */
+template <typename Tree>
+void AVLWeak_RebalanceAfterDelete(Tree* tree, typename Tree::Node* node) {
+	assert(tree);
+
+	typedef typename Tree::Node Node;
+	AVLWeak_UpdateSizesFrom(node);
+
+	Node* parent = node;
+	if((parent != NULL) && (parent->left == NULL) && (parent->right == NULL) && (parent->height == 1)) {
+		parent->height = 0;
+		parent = parent->parent;
+	}
+
+	while(parent != NULL) {
+		bool left;
+		if(AVLWeak_RankDiff(parent, parent->left) == 3) {
+			left = true;
+		}
+		else if(AVLWeak_RankDiff(parent, parent->right) == 3) {
+			left = false;
+		}
+		else {
+			break;
+		}
+
+		Node* sibling = left ? parent->right : parent->left;
+		if(AVLWeak_RankDiff(parent, sibling) == 2) {
+			parent->height--;
+			parent = parent->parent;
+			continue;
+		}
+		if((AVLWeak_RankDiff(sibling, sibling->left) == 2) && (AVLWeak_RankDiff(sibling, sibling->right) == 2)) {
+			parent->height--;
+			sibling->height--;
+			parent = parent->parent;
+			continue;
+		}
+
+		const int rank = parent->height;
+		const int sibling_rank = sibling->height;
+		Node* outer = left ? sibling->right : sibling->left;
+		Node* inner = left ? sibling->left : sibling->right;
+		Node* top = NULL;
+		if(AVLWeak_RankDiff(sibling, outer) == 1) {
+			top = left ? AVLTree_LeftRotate(parent, tree->keep_slots) : AVLTree_RightRotate(parent, tree->keep_slots);
+			sibling->height = rank;
+			parent->height = rank - 1;
+			if((parent->left == NULL) && (parent->right == NULL)) {
+				parent->height = 0;
+			}
+			tree->rotations++;
+		}
+		else {
+			const int inner_rank = inner->height;
+			if(left) {
+				AVLTree_RightRotate(sibling, tree->keep_slots);
+				top = AVLTree_LeftRotate(parent, tree->keep_slots);
+			}
+			else {
+				AVLTree_LeftRotate(sibling, tree->keep_slots);
+				top = AVLTree_RightRotate(parent, tree->keep_slots);
+			}
+			inner->height = inner_rank + 2;
+			sibling->height = sibling_rank - 1;
+			parent->height = rank - 2;
+			tree->rotations += 2;
+		}
+
+		if(top->parent == NULL) {
+			tree->root = top;
+		}
+		break;
+	}
+}
+
+// Keys already in the tree are ignored, unless it's a multiset
+template <typename Tree>
+void AVLWeak_Insert(Tree* tree, const typename Tree::KeyType& val) {
+	AVLHeat_Begin(tree);
+	typename Tree::Node* node = AVLTree_LinkLeaf(tree, tree->root, val);
+	if(node != NULL) {
+		AVLWeak_RebalanceAfterInsert(tree, node);
+	}
+}
+
+// Takes node out of the tree but leaves freeing it to the caller
+template <typename Tree>
+void AVLWeak_Detach(Tree* tree, typename Tree::Node* node) {
+	typename Tree::Node* start = AVLTree_Unlink(tree, node);
+	AVLWeak_RebalanceAfterDelete(tree, start);
+}
+
+// Returns false if val wasn't in the tree. A multiset only
+// loses one copy.
+template <typename Tree>
+bool AVLWeak_Delete(Tree* tree, const typename Tree::KeyType& val) {
+	typename Tree::Node* node = AVLTree_Find(tree, val);
+	if(node == NULL) {
+		return false;
+	}
+	if(AVLTree_DropCopy(tree, node)) {
+		return true;
+	}
+
+	AVLWeak_Detach(tree, node);
+	AVLNodePool_Free(&tree->pool, node);
+	return true;
+}
+
+/*********************************************
+ * Compact trees                             *
+ *********************************************/
+/* Nodes with just the two child links, the key and a balance factor
+ * (height of left minus height of right, so -1, 0 or 1). An int keyed
+ * node is 24 bytes instead of the 56 an AVLNodeT takes with its parent,
+ * height, size, copy and visit counts and layout slot, so more than
+ * twice as many fit in a cache line.
+ *
+ * With no parent pointers, AVLCompact_Insert rebalances top down. On
+ * the way down it remembers the deepest node that isn't evenly
+ * balanced. Every node below that one is even, so the insert tips each
+ * of them toward the new key, and it's the only place a rotation can
+ * be needed. Balances are fixed by walking down from it once the new
+ * node is linked, and nothing above it is touched.
+ *
+ * Lookups go through AVLTree_Find. Anything that needs parents, sizes
+ * or heights (traversal, rank/select, join/split) doesn't apply.
+ */
+template <typename Key>
+struct AVLCompactNodeT {
+	AVLCompactNodeT* left;
+	AVLCompactNodeT* right;
+	Key val;
+	int8_t balance;
+};
+
+template <typename Key, typename Compare = AVLCompare<Key> >
+struct AVLCompactTreeT {
+	typedef Key KeyType;
+	typedef AVLCompactNodeT<Key> Node;
+
+	int size;
+	Node* root;
+	AVLNodePool pool;
+	Compare compare;
+
+	// rotations done by AVLCompact_Insert, a double rotation counts as 2
+	uint64_t rotations;
+};
+
+typedef AVLCompactTreeT<int> AVLCompactTree;
+
+template <typename Node>
+static inline Node* AVLCompact_RightRotate(Node* node) {
+	Node* left = node->left;
+	node->left = left->right;
+	left->right = node;
+	return left;
+}
+
+template <typename Node>
+static inline Node* AVLCompact_LeftRotate(Node* node) {
+	Node* right = node->right;
+	node->right = right->left;
+	right->left = node;
+	return right;
+}
+
+/* node is 2 heavy on one side. Returns the new root of its subtree.
+ * Every balance involved is set outright since the only way to get
+ * here is an insert below an even child.
+ */
+template <typename Node>
+static Node* AVLCompact_Rebalance(Node* node, uint64_t* rotations) {
+	const int sign = (node->balance > 0) ? 1 : -1;
+	Node* child = (sign > 0) ? node->left : node->right;
+	if(child->balance == sign) {
+		// leans the same way: single rotation
+		node->balance = 0;
+		child->balance = 0;
+		*rotations += 1;
+		return (sign > 0) ? AVLCompact_RightRotate(node) : AVLCompact_LeftRotate(node);
+	}
+
+	// leans the other way: the grandchild ends up on top
+	Node* grandchild = (sign > 0) ? child->right : child->left;
+	node->balance = (grandchild->balance == sign) ? (int8_t)-sign : 0;
+	child->balance = (grandchild->balance == -sign) ? (int8_t)sign : 0;
+	grandchild->balance = 0;
+	*rotations += 2;
+	if(sign > 0) {
+		node->left = AVLCompact_LeftRotate(child);
+		return AVLCompact_RightRotate(node);
+	}
+	node->right = AVLCompact_RightRotate(child);
+	return AVLCompact_LeftRotate(node);
+}
+
+// Keys already in the tree are ignored
+template <typename Tree>
+void AVLCompact_Insert(Tree* tree, const typename Tree::KeyType& val) {
+	assert(tree);
+
+	typedef typename Tree::Node Node;
+
+	// the deepest uneven node is top, the link to it is top_link and
+	// the turns taken from it on are bits of path, 1 = right
+	Node** top_link = &tree->root;
+	Node** link = &tree->root;
+	uint64_t path = 0;
+	int depth = 0;
+	while(*link != NULL) {
+		Node* node = *link;
+		if(node->balance != 0) {
+			top_link = link;
+			path = 0;
+			depth = 0;
+		}
+
+		int cmp = tree->compare(val, node->val);
+		if(cmp == 0) {
+			return;
+		}
+		assert(depth < 64);
+		if(cmp > 0) {
+			path |= (uint64_t)1 << depth;
+			link = &node->right;
+		}
+		else {
+			link = &node->left;
+		}
+		depth++;
+	}
+
+	Node* new_node = AVLTree_AllocNode(tree);
+	new_node->val = val;
+	*link = new_node;
+	tree->size++;
+
+	Node* top = *top_link;
+	for(Node* node = top; node != new_node; path >>= 1) {
+		if(path & 1) {
+			node->balance--;
+			node = node->right;
+		}
+		else {
+			node->balance++;
+			node = node->left;
+		}
+	}
+
+	if((top->balance > 1) || (top->balance < -1)) {
+		*top_link = AVLCompact_Rebalance(top, &tree->rotations);
+	}
+}
+
+/* Builds a height balanced subtree out of keys[first..last].
+ *
+ * The middle key becomes the subtree root so the two halves never
+ * differ in size by more than one, which means no node can be out
+ * of balance and no rotations are needed. Heights are filled in on
+ * the way back up so the whole build is O(n).
+ */
+template <typename Tree>
+static typename Tree::Node* AVLTree_BuildSubtree(Tree* tree, const typename Tree::KeyType* keys, 
+		                                         int first, int last, typename Tree::Node* parent,
+									             int depth, uint64_t level_index) {
+	if(last < first) {
+		return NULL;
+	}
+
+	int mid = first + ((last - first) / 2);
+	typename Tree::Node* node = AVLTree_AllocNode(tree);
+	node->parent = parent;
+	node->val = keys[mid];
+	node->depth = depth;
+	node->level_index = level_index;
+	node->left = AVLTree_BuildSubtree(tree, keys, first, mid - 1, node, 
+			                          depth + 1, 2 * level_index);
+	node->right = AVLTree_BuildSubtree(tree, keys, mid + 1, last, node, 
+			                           depth + 1, (2 * level_index) + 1);
+	AVLTree_UpdateNode(node);
+
+	return node;
+}
+
+/* Replaces the contents of the tree with keys, which must be sorted in 
+ * strictly ascending order. Any nodes already in the tree are released.
+ */
+template <typename Tree>
+void AVLTree_BuildFromSorted(Tree* tree, const typename Tree::KeyType* keys, int count) {
+	assert(tree);
+	assert(keys || (count == 0));
+	assert(0 <= count);
+
+#if DEBUG
+	for(int i = 1; i < count; ++i) {
+		assert(tree->compare(keys[i - 1], keys[i]) < 0);
+	}
+#endif
+
+	size_t node_size = tree->pool.node_size ? tree->pool.node_size : sizeof(typename Tree::Node);
+	AVLNodePool_Release(&tree->pool);
+	AVLNodePool_Init(&tree->pool, node_size);
+	tree->root = NULL;
+	tree->size = 0;
+	tree->duplicates = 0;
+
+	if(count == 0) {
+		return;
+	}
+
+	// one block for the whole tree so nodes are contiguous
+	if(!AVLNodePool_Reserve(&tree->pool, (size_t)count)) {
+		return;
+	}
+
+	tree->root = AVLTree_BuildSubtree(tree, keys, 0, count - 1, (typename Tree::Node*)NULL, 0, 0);
+	tree->size = count;
+}
+
+/* LSD radix sort, 8 bits per pass. The sign bit is flipped so negative
+ * keys order before positive ones. Result ends up back in keys.
+ */
+static void AVLTree_RadixSort(int* keys, int* scratch, int count) {
+	int* src = keys;
+	int* dst = scratch;
+	for(int shift = 0; shift < 32; shift += 8) {
+		int offsets[256] = {0};
+		for(int i = 0; i < count; ++i) {
+			uint32_t bucket = (((uint32_t)src[i] ^ 0x80000000u) >> shift) & 0xFF;
+			offsets[bucket]++;
+		}
+
+		int total = 0;
+		for(int b = 0; b < 256; ++b) {
+			int bucket_count = offsets[b];
+			offsets[b] = total;
+			total += bucket_count;
+		}
+
+		for(int i = 0; i < count; ++i) {
+			uint32_t bucket = (((uint32_t)src[i] ^ 0x80000000u) >> shift) & 0xFF;
+			dst[offsets[bucket]++] = src[i];
+		}
+
+		int* temp = src;
+		src = dst;
+		dst = temp;
+	}
+
+	// NOTE: 4 passes means the sorted keys are already
+	//       back in the original array
+	assert(src == keys);
+}
+
+/* Replaces the contents of the tree with keys in any order. Duplicate 
+ * keys are dropped, same as AVLTree_Insert. Sorting is linear so the
+ * whole build is O(n). Only for int keys, other key types have to be
+ * sorted by the caller and go through AVLTree_BuildFromSorted.
+ */
+void AVLTree_Build(AVLTreeCore* tree, const int* keys, int count) {
+	assert(tree);
+	assert(keys || (count == 0));
+	assert(0 <= count);
+
+	// NOTE: malloc(0) may return NULL, which isn't a failure
+	if(count == 0) {
+		AVLTree_BuildFromSorted(tree, (const int*)NULL, 0);
+		return;
+	}
+
+	int* sorted = (int*)malloc(2 * (size_t)count * sizeof(int));
+	if(!sorted) {
+		fprintf(stderr, "Couldn't malloc for AVLTree_Build\n");
+		return;
+	}
+	int* scratch = sorted + count;
+	memcpy(sorted, keys, (size_t)count * sizeof(int));
+	AVLTree_RadixSort(sorted, scratch, count);
+
+	int unique_count = 0;
+	for(int i = 0; i < count; ++i) {
+		if((unique_count == 0) || (sorted[unique_count - 1] != sorted[i])) {
+			sorted[unique_count++] = sorted[i];
+		}
+	}
+
+	AVLTree_BuildFromSorted(tree, sorted, unique_count);
+	free(sorted);
+}
+
+/*********************************************
+ * Frozen layout                             *
+ *********************************************/
+/* Read only copy of a tree's keys in one array, laid out in BFS order
+ * of a complete binary tree (the Eytzinger layout). keys[1] is the
+ * root and the children of keys[k] are keys[2k] and keys[2k + 1], i.e.
+ * k is a node's level_index with a 1 << depth on top. The shape is the
+ * complete tree rather than the AVL tree's own so no slots are wasted
+ * on missing children.
+ *
+ * A lookup walks one path without branching on the comparisons, and
+ * the 16 descendants four levels below keys[k] sit together at
+ * keys[16k], so each step prefetches the cache line it will need four
+ * steps later.
+ *
+ * A frozen tree doesn't follow later changes to the tree, freeze it
+ * again instead.
+ */
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define AVL_PREFETCH(address) _mm_prefetch((const char*)(address), _MM_HINT_T0)
+#else
+#define AVL_PREFETCH(address) __builtin_prefetch(address)
+#endif
+
+#define AVL_CACHE_LINE_SIZE 64
+#define AVL_FROZEN_PREFETCH_LEVELS 4
+
+template <typename Key, typename Compare = AVLCompare<Key> >
+struct AVLFrozenTreeT {
+	typedef Key KeyType;
+
+	Key* keys; // keys[1..size], keys[0] is unused
+	int size;
+	int capacity;
+	void* memory; // keys starts on a cache line somewhere in here
+	Compare compare;
+};
+
+typedef AVLFrozenTreeT<int> AVLFrozenTree;
+
+static inline int AVLFrozen_CountTrailingOnes(uint32_t x) {
+	assert(~x != 0);
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, ~x);
+	return (int)index;
+#else
+	return __builtin_ctz(~x);
+#endif
+}
+
+// Fills keys[k] and everything under it with the next keys in order
+template <typename Frozen, typename Node>
+static void AVLFrozen_FillSubtree(Frozen* frozen, Node** next, int k) {
+	if(k > frozen->size) {
+		return;
+	}
+
+	AVLFrozen_FillSubtree(frozen, next, 2 * k);
+	frozen->keys[k] = (*next)->val;
+	*next = AVLTree_Next(*next);
+	AVLFrozen_FillSubtree(frozen, next, (2 * k) + 1);
+}
+
+/* Copies the keys of tree into frozen, reusing frozen's array if it's
+ * big enough. O(n) since walking the tree in order is O(1) amortized
+ * per key.
+ */
+template <typename Key, typename Compare>
+void AVLTree_Freeze(const AVLTreeCoreT<Key, Compare>* tree, AVLFrozenTreeT<Key, Compare>* frozen) {
+	assert(tree);
+	assert(frozen);
+
+	if(tree->size > frozen->capacity) {
+		size_t bytes = ((size_t)tree->size + 1) * sizeof(Key) + AVL_CACHE_LINE_SIZE;
+		void* memory = malloc(bytes);
+		if(!memory) {
+			fprintf(stderr, "Couldn't malloc for AVLTree_Freeze\n");
+			return;
+		}
+		free(frozen->memory);
+		frozen->memory = memory;
+		frozen->keys = (Key*)(((uintptr_t)memory + AVL_CACHE_LINE_SIZE - 1) & ~(uintptr_t)(AVL_CACHE_LINE_SIZE - 1));
+		frozen->capacity = tree->size;
+	}
+
+	frozen->size = tree->size;
+	frozen->compare = tree->compare;
+	AVLNodeT<Key>* next = AVLTree_First(tree);
+	AVLFrozen_FillSubtree(frozen, &next, 1);
+	assert(next == NULL);
+}
+
+template <typename Frozen>
+void AVLFrozen_Release(Frozen* frozen) {
+	assert(frozen);
+
+	free(frozen->memory);
+	frozen->memory = NULL;
+	frozen->keys = NULL;
+	frozen->size = 0;
+	frozen->capacity = 0;
+}
+
+/* Index of the first key >= val or 0 if there is none.
+ *
+ * Going down, k picks up one bit per level: 1 for right. The answer is
+ * the last node where the walk went left, which is k with its trailing
+ * 1s (the rights taken after that) and the 0 shifted off.
+ */
+template <typename Frozen>
+int AVLFrozen_LowerBound(const Frozen* frozen, const typename Frozen::KeyType& val) {
+	assert(frozen);
+
+	const typename Frozen::KeyType* keys = frozen->keys;
+	uint32_t k = 1;
+	while(k <= (uint32_t)frozen->size) {
+		AVL_PREFETCH(keys + (k << AVL_FROZEN_PREFETCH_LEVELS));
+		k = (2 * k) + (uint32_t)(frozen->compare(keys[k], val) < 0);
+	}
+	k >>= AVLFrozen_CountTrailingOnes(k) + 1;
+
+	return (int)k;
+}
+
+// Index of val in keys or 0 if it isn't in there
+template <typename Frozen>
+int AVLFrozen_Find(const Frozen* frozen, const typename Frozen::KeyType& val) {
+	int k = AVLFrozen_LowerBound(frozen, val);
+	if((k == 0) || (frozen->compare(frozen->keys[k], val) != 0)) {
+		return 0;
+	}
+	return k;
+}
+
+/*********************************************
+ * Join, split and set operations            *
+ *********************************************/
+/* Join-based algorithms from Blelloch, Ferizovic and Sun, "Just Join
+ * for Parallel Ordered Sets". Everything is built on AVLTree_Join,
+ * which only has to rebalance along one spine of the taller tree.
+ *
+ * These work on bare subtrees and never touch a pool, so the nodes
+ * stay owned by whatever pool they came from. Slots aren't kept up to
+ * date either, call AVLTree_SetSubtreeSlots(root, 0, 0) on the final
+ * tree if it keeps them.
+ */
+
+// subtrees smaller than this are never worth handing to another thread
+#define AVL_PARALLEL_CUTOFF 2048
+
+template <typename Key>
+static inline AVLNodeT<Key>* AVLTree_MakeNode(AVLNodeT<Key>* left, AVLNodeT<Key>* mid, AVLNodeT<Key>* right) {
+	assert(mid);
+
+	mid->parent = NULL;
+	mid->left = left;
+	mid->right = right;
+	if(left) {
+		left->parent = mid;
+	}
+	if(right) {
+		right->parent = mid;
+	}
+	AVLTree_UpdateNode(mid);
+
+	return mid;
+}
+
+// left is more than one taller than right, walk down its right spine
+template <typename Key>
+static AVLNodeT<Key>* AVLTree_JoinRight(AVLNodeT<Key>* left, AVLNodeT<Key>* mid, AVLNodeT<Key>* right) {
+	AVLNodeT<Key>* l = left->left;
+	AVLNodeT<Key>* c = left->right;
+
+	if(AVLTree_GetHeight(c) <= (AVLTree_GetHeight(right) + 1)) {
+		AVLNodeT<Key>* t = AVLTree_MakeNode(c, mid, right);
+		if(AVLTree_GetHeight(t) <= (AVLTree_GetHeight(l) + 1)) {
+			return AVLTree_MakeNode(l, left, t);
+		}
+		t = AVLTree_RightRotate(t, false);
+		return AVLTree_LeftRotate(AVLTree_MakeNode(l, left, t), false);
+	}
+
+	AVLNodeT<Key>* t = AVLTree_JoinRight(c, mid, right);
+	AVLNodeT<Key>* root = AVLTree_MakeNode(l, left, t);
+	if(AVLTree_GetHeight(t) <= (AVLTree_GetHeight(l) + 1)) {
+		return root;
+	}
+	return AVLTree_LeftRotate(root, false);
+}
+
+// mirror of AVLTree_JoinRight
+template <typename Key>
+static AVLNodeT<Key>* AVLTree_JoinLeft(AVLNodeT<Key>* left, AVLNodeT<Key>* mid, AVLNodeT<Key>* right) {
+	AVLNodeT<Key>* r = right->right;
+	AVLNodeT<Key>* c = right->left;
+
+	if(AVLTree_GetHeight(c) <= (AVLTree_GetHeight(left) + 1)) {
+		AVLNodeT<Key>* t = AVLTree_MakeNode(left, mid, c);
+		if(AVLTree_GetHeight(t) <= (AVLTree_GetHeight(r) + 1)) {
+			return AVLTree_MakeNode(t, right, r);
+		}
+		t = AVLTree_LeftRotate(t, false);
+		return AVLTree_RightRotate(AVLTree_MakeNode(t, right, r), false);
+	}
+
+	AVLNodeT<Key>* t = AVLTree_JoinLeft(left, mid, c);
+	AVLNodeT<Key>* root = AVLTree_MakeNode(t, right, r);
+	if(AVLTree_GetHeight(t) <= (AVLTree_GetHeight(r) + 1)) {
+		return root;
+	}
+	return AVLTree_RightRotate(root, false);
+}
+
+/* Returns a balanced tree holding left, mid and right where every key
+ * in left is less than mid's and every key in right is greater. Either
+ * subtree can be NULL. O(|height(left) - height(right)|).
+ */
+template <typename Key>
+AVLNodeT<Key>* AVLTree_Join(AVLNodeT<Key>* left, AVLNodeT<Key>* mid, AVLNodeT<Key>* right) {
+	assert(mid);
+
+	AVLNodeT<Key>* root = NULL;
+	if(AVLTree_GetHeight(left) > (AVLTree_GetHeight(right) + 1)) {
+		root = AVLTree_JoinRight(left, mid, right);
+	}
+	else if(AVLTree_GetHeight(right) > (AVLTree_GetHeight(left) + 1)) {
+		root = AVLTree_JoinLeft(left, mid, right);
+	}
+	else {
+		root = AVLTree_MakeNode(left, mid, right);
+	}
+	root->parent = NULL;
+
+	return root;
+}
+
+// Cuts the largest node out of root, which must not be NULL
+template <typename Key>
+static AVLNodeT<Key>* AVLTree_SplitLast(AVLNodeT<Key>* root, AVLNodeT<Key>** last) {
+	AVLNodeT<Key>* left = root->left;
+	AVLNodeT<Key>* right = root->right;
+	if(left) {
+		left->parent = NULL;
+	}
+
+	if(right == NULL) {
+		*last = root;
+		root->left = NULL;
+		root->parent = NULL;
+		AVLTree_UpdateNode(root);
+		return left;
+	}
+
+	right->parent = NULL;
+	return AVLTree_Join(left, root, AVLTree_SplitLast(right, last));
+}
+
+// Like AVLTree_Join without a middle node
+template <typename Key>
+static AVLNodeT<Key>* AVLTree_Join2(AVLNodeT<Key>* left, AVLNodeT<Key>* right) {
+	if(left == NULL) {
+		return right;
+	}
+
+	AVLNodeT<Key>* last = NULL;
+	AVLNodeT<Key>* rest = AVLTree_SplitLast(left, &last);
+	return AVLTree_Join(rest, last, right);
+}
+
+/* Splits the subtree at root into the keys less than val and the keys
+ * greater than val. Returns the node holding val, now detached from
+ * both halves, or NULL if val wasn't there. O(log n).
+ */
+template <typename Tree>
+typename Tree::Node* AVLTree_Split(const Tree* tree, typename Tree::Node* root, const typename Tree::KeyType& val,
+		                           typename Tree::Node** left, typename Tree::Node** right) {
+	assert(tree);
+	assert(left);
+	assert(right);
+
+	if(root == NULL) {
+		*left = NULL;
+		*right = NULL;
+		return NULL;
+	}
+
+	typename Tree::Node* l = root->left;
+	typename Tree::Node* r = root->right;
+	if(l) {
+		l->parent = NULL;
+	}
+	if(r) {
+		r->parent = NULL;
+	}
+
+	int cmp = tree->compare(val, root->val);
+	if(cmp < 0) {
+		typename Tree::Node* split_right = NULL;
+		typename Tree::Node* found = AVLTree_Split(tree, l, val, left, &split_right);
+		*right = AVLTree_Join(split_right, root, r);
+		return found;
+	}
+	else if(cmp > 0) {
+		typename Tree::Node* split_left = NULL;
+		typename Tree::Node* found = AVLTree_Split(tree, r, val, &split_left, right);
+		*left = AVLTree_Join(l, root, split_left);
+		return found;
+	}
+
+	*left = l;
+	*right = r;
+	AVLTree_MakeNode((typename Tree::Node*)NULL, root, (typename Tree::Node*)NULL);
+	return root;
+}
+
+/* Nodes a set operation threw out, chained through their parent 
+ * pointers. Each entry is the root of a whole dropped subtree. Pools
+ * aren't thread safe, so parallel tasks collect their own lists and
+ * everything is freed at the end on the calling thread.
+ */
+template <typename Key>
+struct AVLDropListT {
+	AVLNodeT<Key>* head;
+	AVLNodeT<Key>* tail;
+};
+
+template <typename Key>
+static inline void AVLDropList_Push(AVLDropListT<Key>* list, AVLNodeT<Key>* node) {
+	if(node == NULL) {
+		return;
+	}
+
+	node->parent = NULL;
+	if(list->tail) {
+		list->tail->parent = node;
+	}
+	else {
+		list->head = node;
+	}
+	list->tail = node;
+}
+
+template <typename Key>
+static inline void AVLDropList_Append(AVLDropListT<Key>* list, AVLDropListT<Key>* other) {
+	if(other->head == NULL) {
+		return;
+	}
+
+	if(list->tail) {
+		list->tail->parent = other->head;
+	}
+	else {
+		list->head = other->head;
+	}
+	list->tail = other->tail;
+}
+
+// Returns the multiset copies that were counted on the freed nodes
+template <typename Key>
+static int AVLTree_FreeSubtree(AVLNodePool* pool, AVLNodeT<Key>* node) {
+	if(node == NULL) {
+		return 0;
+	}
+
+	AVLNodeT<Key>* left = node->left;
+	AVLNodeT<Key>* right = node->right;
+	int duplicates = node->duplicates;
+	AVLNodePool_Free(pool, node);
+	duplicates += AVLTree_FreeSubtree(pool, left);
+	duplicates += AVLTree_FreeSubtree(pool, right);
+	return duplicates;
+}
+
+// Returns the multiset copies that were counted on the freed nodes
+template <typename Key>
+static int AVLDropList_Free(AVLDropListT<Key>* list, AVLNodePool* pool) {
+	int duplicates = 0;
+	AVLNodeT<Key>* node = list->head;
+	while(node) {
+		// NOTE: freeing overwrites the parent link
+		AVLNodeT<Key>* next = node->parent;
+		duplicates += AVLTree_FreeSubtree(pool, node);
+		node = next;
+	}
+	list->head = NULL;
+	list->tail = NULL;
+	return duplicates;
+}
+
+// Detaches both children of node, which is about to be rejoined or dropped
+template <typename Key>
+static inline void AVLTree_Expose(AVLNodeT<Key>* node, AVLNodeT<Key>** left, AVLNodeT<Key>** right) {
+	*left = node->left;
+	*right = node->right;
+	if(*left) {
+		(*left)->parent = NULL;
+	}
+	if(*right) {
+		(*right)->parent = NULL;
+	}
+	node->left = NULL;
+	node->right = NULL;
+}
+
+// Only forks when there's enough work on both sides to pay for it
+template <typename Key>
+static inline ThreadPool* AVLTree_ForkThreads(ThreadPool* threads, AVLNodeT<Key>* a, AVLNodeT<Key>* b) {
+	int work = AVLTree_GetSubtreeSize(a) + AVLTree_GetSubtreeSize(b);
+	return (work < AVL_PARALLEL_CUTOFF) ? NULL : threads;
+}
+
+template <typename Tree>
+static typename Tree::Node* AVLTree_UnionNodes(const Tree* tree, ThreadPool* threads, typename Tree::Node* a,
+		                                        typename Tree::Node* b, AVLDropListT<typename Tree::KeyType>* dropped) {
+	typedef typename Tree::Node Node;
+
+	if(a == NULL) {
+		return b;
+	}
+	if(b == NULL) {
+		return a;
+	}
+
+	ThreadPool* fork_threads = AVLTree_ForkThreads(threads, a, b);
+	Node* l2 = NULL;
+	Node* r2 = NULL;
+	AVLTree_Expose(b, &l2, &r2);
+	Node* l1 = NULL;
+	Node* r1 = NULL;
+	Node* found = AVLTree_Split(tree, a, b->val, &l1, &r1);
+
+	Node* left = NULL;
+	Node* right = NULL;
+	AVLDropListT<typename Tree::KeyType> right_dropped = {NULL, NULL};
+	ThreadPool_Parallel(fork_threads,
+			[&]() { left = AVLTree_UnionNodes(tree, threads, l1, l2, dropped); },
+			[&]() { right = AVLTree_UnionNodes(tree, threads, r1, r2, &right_dropped); });
+	AVLDropList_Append(dropped, &right_dropped);
+
+	if(found) {
+		// a multiset keeps every copy from both trees
+		if(tree->multiset) {
+			found->duplicates += b->duplicates + 1;
+		}
+		AVLDropList_Push(dropped, b);
+		return AVLTree_Join(left, found, right);
+	}
+	return AVLTree_Join(left, b, right);
+}
+
+template <typename Tree>
+static typename Tree::Node* AVLTree_IntersectionNodes(const Tree* tree, ThreadPool* threads, typename Tree::Node* a,
+		                                               typename Tree::Node* b, AVLDropListT<typename Tree::KeyType>* dropped) {
+	typedef typename Tree::Node Node;
+
+	if((a == NULL) || (b == NULL)) {
+		AVLDropList_Push(dropped, a);
+		AVLDropList_Push(dropped, b);
+		return NULL;
+	}
+
+	ThreadPool* fork_threads = AVLTree_ForkThreads(threads, a, b);
+	Node* l2 = NULL;
+	Node* r2 = NULL;
+	AVLTree_Expose(b, &l2, &r2);
+	Node* l1 = NULL;
+	Node* r1 = NULL;
+	Node* found = AVLTree_Split(tree, a, b->val, &l1, &r1);
+
+	Node* left = NULL;
+	Node* right = NULL;
+	AVLDropListT<typename Tree::KeyType> right_dropped = {NULL, NULL};
+	ThreadPool_Parallel(fork_threads,
+			[&]() { left = AVLTree_IntersectionNodes(tree, threads, l1, l2, dropped); },
+			[&]() { right = AVLTree_IntersectionNodes(tree, threads, r1, r2, &right_dropped); });
+	AVLDropList_Append(dropped, &right_dropped);
+
+	AVLDropList_Push(dropped, b);
+	if(found) {
+		return AVLTree_Join(left, found, right);
+	}
+	return AVLTree_Join2(left, right);
+}
+
+template <typename Tree>
+static typename Tree::Node* AVLTree_DifferenceNodes(const Tree* tree, ThreadPool* threads, typename Tree::Node* a,
+		                                             typename Tree::Node* b, AVLDropListT<typename Tree::KeyType>* dropped) {
+	typedef typename Tree::Node Node;
+
+	if((a == NULL) || (b == NULL)) {
+		AVLDropList_Push(dropped, b);
+		return a;
+	}
+
+	ThreadPool* fork_threads = AVLTree_ForkThreads(threads, a, b);
+	Node* l2 = NULL;
+	Node* r2 = NULL;
+	AVLTree_Expose(b, &l2, &r2);
+	Node* l1 = NULL;
+	Node* r1 = NULL;
+	AVLDropList_Push(dropped, AVLTree_Split(tree, a, b->val, &l1, &r1));
+	AVLDropList_Push(dropped, b);
+
+	Node* left = NULL;
+	Node* right = NULL;
+	AVLDropListT<typename Tree::KeyType> right_dropped = {NULL, NULL};
+	ThreadPool_Parallel(fork_threads,
+			[&]() { left = AVLTree_DifferenceNodes(tree, threads, l1, l2, dropped); },
+			[&]() { right = AVLTree_DifferenceNodes(tree, threads, r1, r2, &right_dropped); });
+	AVLDropList_Append(dropped, &right_dropped);
+
+	return AVLTree_Join2(left, right);
+}
+
+template <typename Key>
+static void AVLTree_SetSubtreeSlotsParallel(ThreadPool* threads, AVLNodeT<Key>* node, 
+		                                    const int depth, const uint64_t level_index) {
+	if((threads == NULL) || (AVLTree_GetSubtreeSize(node) < AVL_PARALLEL_CUTOFF)) {
+		AVLTree_SetSubtreeSlots(node, depth, level_index);
+		return;
+	}
+
+	node->depth = depth;
+	node->level_index = level_index;
+	ThreadPool_Parallel(threads,
+			[&]() { AVLTree_SetSubtreeSlotsParallel(threads, node->left, depth + 1, 2 * level_index); },
+			[&]() { AVLTree_SetSubtreeSlotsParallel(threads, node->right, depth + 1, (2 * level_index) + 1); });
+}
+
+enum AVLSetOperation {
+	AVL_SET_UNION,
+	AVL_SET_INTERSECTION,
+	AVL_SET_DIFFERENCE
+};
+
+/* tree becomes the result of combining it with other, which is left 
+ * empty. Nodes move between the trees instead of being copied, so
+ * other's pool is handed over to tree as well. A key in both trees
+ * keeps tree's node. A multiset union adds other's copies of it onto
+ * that node. Intersection and difference go by keys only, so a key
+ * that stays keeps tree's count. Pass a thread pool to split the
+ * work across threads, NULL runs everything here.
+ *
+ * O(m log(n/m + 1)) work for trees of size m <= n, plus freeing the
+ * nodes that get dropped. A tree that keeps slots also gets all of
+ * them renumbered at the end, which is O(n + m).
+ */
+template <typename Tree>
+static void AVLTree_SetOperation(Tree* tree, Tree* other, ThreadPool* threads, AVLSetOperation operation) {
+	assert(tree);
+	assert(other);
+	assert(tree != other);
+
+	AVLNodePool_Absorb(&tree->pool, &other->pool);
+
+	int old_size = tree->size + other->size;
+	AVLDropListT<typename Tree::KeyType> dropped = {NULL, NULL};
+	typename Tree::Node* root = NULL;
+	switch(operation) {
+		case AVL_SET_UNION: {
+			root = AVLTree_UnionNodes(tree, threads, tree->root, other->root, &dropped);
+		} break;
+		case AVL_SET_INTERSECTION: {
+			root = AVLTree_IntersectionNodes(tree, threads, tree->root, other->root, &dropped);
+		} break;
+		case AVL_SET_DIFFERENCE: {
+			root = AVLTree_DifferenceNodes(tree, threads, tree->root, other->root, &dropped);
+		} break;
+	}
+	int dropped_duplicates = AVLDropList_Free(&dropped, &tree->pool);
+
+	if(root) {
+		root->parent = NULL;
+		if(tree->keep_slots) {
+			AVLTree_SetSubtreeSlotsParallel(threads, root, 0, 0);
+		}
+	}
+	tree->root = root;
+	tree->size = AVLTree_GetSubtreeSize(root);
+	if(tree->multiset && (operation == AVL_SET_UNION)) {
+		// every node a union drops was a key in both trees, which
+		// the node it kept now counts as one more copy
+		tree->duplicates += other->duplicates + (old_size - tree->size);
+	}
+	else {
+		tree->duplicates += other->duplicates - dropped_duplicates;
+	}
+	other->root = NULL;
+	other->size = 0;
+	other->duplicates = 0;
+}
+
+// tree = tree | other
+template <typename Tree>
+void AVLTree_Union(Tree* tree, Tree* other, ThreadPool* threads = NULL) {
+	AVLTree_SetOperation(tree, other, threads, AVL_SET_UNION);
+}
+
+// tree = tree & other
+template <typename Tree>
+void AVLTree_Intersection(Tree* tree, Tree* other, ThreadPool* threads = NULL) {
+	AVLTree_SetOperation(tree, other, threads, AVL_SET_INTERSECTION);
+}
+
+// tree = tree - other
+template <typename Tree>
+void AVLTree_Difference(Tree* tree, Tree* other, ThreadPool* threads = NULL) {
+	AVLTree_SetOperation(tree, other, threads, AVL_SET_DIFFERENCE);
+}
+
+/*********************************************
+ * Batch insert                              *
+ *********************************************/
+// below this many keys a sort or merge just runs on one thread
+#define AVL_PARALLEL_SORT_CUTOFF 8192
+
+template <typename Tree>
+struct AVLKeyLess {
+	const Tree* tree;
+	inline bool operator()(const typename Tree::KeyType& a, const typename Tree::KeyType& b) const {
+		return tree->compare(a, b) < 0;
+	}
+};
+
+// Merges a and b into out by splitting the longer run at its middle
+// key and the shorter one at that key's lower bound
+template <typename Tree>
+static void AVLTree_ParallelMerge(const Tree* tree, ThreadPool* threads, 
+		                          const typename Tree::KeyType* a, int a_count,
+		                          const typename Tree::KeyType* b, int b_count, 
+		                          typename Tree::KeyType* out) {
+	AVLKeyLess<Tree> less = {tree};
+	if((threads == NULL) || ((a_count + b_count) < AVL_PARALLEL_SORT_CUTOFF)) {
+		std::merge(a, a + a_count, b, b + b_count, out, less);
+		return;
+	}
+	if(a_count < b_count) {
+		AVLTree_ParallelMerge(tree, threads, b, b_count, a, a_count, out);
+		return;
+	}
+
+	int a_mid = a_count / 2;
+	int b_mid = (int)(std::lower_bound(b, b + b_count, a[a_mid], less) - b);
+	out[a_mid + b_mid] = a[a_mid];
+	ThreadPool_Parallel(threads,
+			[&]() { AVLTree_ParallelMerge(tree, threads, a, a_mid, b, b_mid, out); },
+			[&]() { AVLTree_ParallelMerge(tree, threads, a + a_mid + 1, a_count - a_mid - 1, 
+					                      b + b_mid, b_count - b_mid, out + a_mid + b_mid + 1); });
+}
+
+/* Merge sort that sorts keys in place when into_scratch is false or
+ * leaves the result in scratch when it's true. The halves are sorted
+ * into whichever buffer the merge isn't writing to, so nothing is
+ * ever copied back.
+ */
+template <typename Tree>
+static void AVLTree_ParallelSort(const Tree* tree, ThreadPool* threads, typename Tree::KeyType* keys,
+		                         typename Tree::KeyType* scratch, int count, bool into_scratch) {
+	AVLKeyLess<Tree> less = {tree};
+	if((threads == NULL) || (count < AVL_PARALLEL_SORT_CUTOFF)) {
+		std::sort(keys, keys + count, less);
+		if(into_scratch) {
+			std::copy(keys, keys + count, scratch);
+		}
+		return;
+	}
+
+	int half = count / 2;
+	ThreadPool_Parallel(threads,
+			[&]() { AVLTree_ParallelSort(tree, threads, keys, scratch, half, !into_scratch); },
+			[&]() { AVLTree_ParallelSort(tree, threads, keys + half, scratch + half, count - half, !into_scratch); });
+
+	typename Tree::KeyType* src = into_scratch ? keys : scratch;
+	typename Tree::KeyType* dst = into_scratch ? scratch : keys;
+	AVLTree_ParallelMerge(tree, threads, src, half, src + half, count - half, dst);
+}
+
+// AVLTree_BuildSubtree where node i holds keys[i], so no allocation 
+// happens and both halves can be built at the same time
+template <typename Key>
+static AVLNodeT<Key>* AVLTree_BuildRun(ThreadPool* threads, const Key* keys, uint8_t* nodes, size_t node_size,
+		                               int first, int last, int depth, uint64_t level_index) {
+	if(last < first) {
+		return NULL;
+	}
+
+	int mid = first + ((last - first) / 2);
+	AVLNodeT<Key>* node = (AVLNodeT<Key>*)(nodes + ((size_t)mid * node_size));
+	node->val = keys[mid];
+	node->depth = depth;
+	node->level_index = level_index;
+
+	ThreadPool* fork_threads = ((last - first) < AVL_PARALLEL_CUTOFF) ? NULL : threads;
+	ThreadPool_Parallel(fork_threads,
+			[&]() { node->left = AVLTree_BuildRun(threads, keys, nodes, node_size, first, mid - 1, 
+					                              depth + 1, 2 * level_index); },
+			[&]() { node->right = AVLTree_BuildRun(threads, keys, nodes, node_size, mid + 1, last, 
+					                               depth + 1, (2 * level_index) + 1); });
+	if(node->left) {
+		node->left->parent = node;
+	}
+	if(node->right) {
+		node->right->parent = node;
+	}
+	AVLTree_UpdateNode(node);
+
+	return node;
+}
+
+/* Inserts a batch of keys in any order. Duplicates, within the batch 
+ * or against the tree, are ignored same as AVLTree_Insert on a set.
+ * A multiset counts every one of them, same as inserting the keys one
+ * at a time would.
+ *
+ * Instead of count inserts the batch is sorted, built into a balanced
+ * tree of its own and merged in with AVLTree_Union, which splits the
+ * tree at the batch's medians. Every step runs on threads when given.
+ * The batch's nodes come out of one contiguous run of the pool.
+ *
+ * A batch too small to fork and smaller than the tree just goes in
+ * one AVLTree_Insert at a time, which is as fast or faster there
+ * (see the batch table in avl_bench.cpp).
+ */
+template <typename Tree>
+void AVLTree_InsertBatch(Tree* tree, const typename Tree::KeyType* keys, int count, ThreadPool* threads = NULL) {
+	typedef typename Tree::KeyType Key;
+
+	assert(tree);
+	assert(keys || (count == 0));
+	assert(0 <= count);
+
+	if(count == 0) {
+		return;
+	}
+	if((count < AVL_PARALLEL_CUTOFF) && (count < tree->size)) {
+		for(int i = 0; i < count; ++i) {
+			AVLTree_Insert(tree, keys[i]);
+		}
+		return;
+	}
+
+	Key* sorted = (Key*)malloc(2 * (size_t)count * sizeof(Key));
+	if(!sorted) {
+		fprintf(stderr, "Couldn't malloc for AVLTree_InsertBatch\n");
+		return;
+	}
+	Key* scratch = sorted + count;
+	std::copy(keys, keys + count, scratch);
+	AVLTree_ParallelSort(tree, threads, scratch, sorted, count, true);
+
+	// a multiset remembers how long each run of equal keys was
+	int* copies = NULL;
+	if(tree->multiset) {
+		copies = (int*)malloc((size_t)count * sizeof(int));
+		if(!copies) {
+			fprintf(stderr, "Couldn't malloc for AVLTree_InsertBatch\n");
+			free(sorted);
+			return;
+		}
+		copies[0] = 0;
+	}
+
+	int unique_count = 1;
+	for(int i = 1; i < count; ++i) {
+		if(tree->compare(sorted[unique_count - 1], sorted[i]) != 0) {
+			if(copies) {
+				copies[unique_count] = 0;
+			}
+			sorted[unique_count++] = sorted[i];
+		}
+		else if(copies) {
+			copies[unique_count - 1]++;
+		}
+	}
+
+	Tree batch = *tree;
+	batch.root = NULL;
+	batch.size = 0;
+	batch.duplicates = 0;
+	AVLNodePool_Init(&batch.pool, tree->pool.node_size ? tree->pool.node_size : sizeof(typename Tree::Node));
+	uint8_t* nodes = (uint8_t*)AVLNodePool_AllocRun(&batch.pool, (size_t)unique_count);
+	if(nodes) {
+		batch.root = AVLTree_BuildRun(threads, sorted, nodes, batch.pool.node_size, 0, unique_count - 1, 0, 0);
+		batch.size = unique_count;
+		if(copies) {
+			// node i holds sorted[i]
+			for(int i = 0; i < unique_count; ++i) {
+				((typename Tree::Node*)(nodes + ((size_t)i * batch.pool.node_size)))->duplicates = copies[i];
+				batch.duplicates += copies[i];
+			}
+		}
+		AVLTree_Union(tree, &batch, threads);
+	}
+
+	free(copies);
+	free(sorted);
+}
+
+/*********************************************
+ * Persistent versions                       *
+ *********************************************/
+/* Path copying persistent AVL tree. Nothing is ever changed in place:
+ * an insert copies the nodes on its path (plus the ones a rotation
+ * moves) and every other subtree is shared with the previous version.
+ * That's O(log n) new nodes per version and any old version can be
+ * looked at again in O(1) through its root.
+ *
+ * Nodes can't have parent pointers or layout slots since one node
+ * can sit in many versions at different places.
+ */
+template <typename Key>
+struct AVLPersistentNodeT {
+	AVLPersistentNodeT* left;
+	AVLPersistentNodeT* right;
+	Key val;
+	int height;
+	int subtree_size;
+	int duplicates;
+	int version; // the version that created this node, only it may change it
+};
+
+template <typename Key, typename Compare = AVLCompare<Key> >
+struct AVLPersistentTreeT {
+	typedef Key KeyType;
+	typedef AVLPersistentNodeT<Key> Node;
+
+	Node** versions; // root of each version, NULL is an empty tree
+	int num_versions;
+	int versions_capacity;
+	AVLNodePool pool;
+	Compare compare;
+};
+
+typedef AVLPersistentTreeT<int> AVLPersistentTree;
+
+// more than enough for any tree with an int size
+#define AVL_MAX_HEIGHT 64
+
+template <typename Tree>
+inline typename Tree::Node* AVLPersistent_Version(const Tree* tree, int version) {
+	assert(tree);
+	assert((0 <= version) && (version < tree->num_versions));
+
+	return tree->versions[version];
+}
+
+template <typename Tree>
+inline typename Tree::Node* AVLPersistent_Latest(const Tree* tree) {
+	assert(tree);
+
+	return tree->num_versions ? tree->versions[tree->num_versions - 1] : NULL;
+}
+
+template <typename Tree>
+static bool AVLPersistent_PushVersion(Tree* tree, typename Tree::Node* root) {
+	if(tree->num_versions == tree->versions_capacity) {
+		int new_capacity = tree->versions_capacity ? (2 * tree->versions_capacity) : 64;
+		typename Tree::Node** new_versions = (typename Tree::Node**)realloc(tree->versions, 
+				                                                          (size_t)new_capacity * sizeof(root));
+		if(!new_versions) {
+			fprintf(stderr, "Couldn't realloc for AVLPersistentTree versions\n");
+			return false;
+		}
+		tree->versions = new_versions;
+		tree->versions_capacity = new_capacity;
+	}
+
+	tree->versions[tree->num_versions++] = root;
+	return true;
+}
+
+// History keeps every version so nothing is ever retired. See the
+// AVLSnapshotTreeT overload.
+template <typename Tree>
+static inline void AVLPersistent_Retire(Tree* tree, typename Tree::Node* node) {
+}
+
+/* A copy of node that the version being built is allowed to change,
+ * NULL if there was no memory for one. node itself belongs to a
+ * published version and must never be changed.
+ */
+template <typename Tree>
+static typename Tree::Node* AVLPersistent_Own(Tree* tree, typename Tree::Node* node) {
+	assert(node);
+
+	if(node->version == tree->num_versions) {
+		return node;
+	}
+
+	if(tree->pool.node_size == 0) {
+		AVLNodePool_Init(&tree->pool, sizeof(typename Tree::Node));
+	}
+	typename Tree::Node* copy = (typename Tree::Node*)AVLNodePool_Alloc(&tree->pool);
+	if(!copy) {
+		return NULL;
+	}
+	*copy = *node;
+	copy->version = tree->num_versions;
+	AVLPersistent_Retire(tree, node);
+	return copy;
+}
+
+template <typename Tree>
+static typename Tree::Node* AVLPersistent_RightRotate(Tree* tree, typename Tree::Node* node) {
+	node = AVLPersistent_Own(tree, node);
+	if(!node) {
+		return NULL;
+	}
+	typename Tree::Node* left = AVLPersistent_Own(tree, node->left);
+	if(!left) {
+		return NULL;
+	}
+
+	node->left = left->right;
+	left->right = node;
+	AVLTree_UpdateNode(node);
+	AVLTree_UpdateNode(left);
+
+	return left;
+}
+
+template <typename Tree>
+static typename Tree::Node* AVLPersistent_LeftRotate(Tree* tree, typename Tree::Node* node) {
+	node = AVLPersistent_Own(tree, node);
+	if(!node) {
+		return NULL;
+	}
+	typename Tree::Node* right = AVLPersistent_Own(tree, node->right);
+	if(!right) {
+		return NULL;
+	}
+
+	node->right = right->left;
+	right->left = node;
+	AVLTree_UpdateNode(node);
+	AVLTree_UpdateNode(right);
+
+	return right;
+}
+
+// Root of the tree that has subtree hanging where path[depth] was
+template <typename Tree>
+static typename Tree::Node* AVLPersistent_CopyPath(Tree* tree, typename Tree::Node** path, const int* cmps,
+		                                           int depth, typename Tree::Node* subtree) {
+	for(int i = depth - 1; i >= 0; --i) {
+		typename Tree::Node* copy = AVLPersistent_Own(tree, path[i]);
+		if(!copy) {
+			return NULL;
+		}
+		if(cmps[i] < 0) {
+			copy->left = subtree;
+		}
+		else {
+			copy->right = subtree;
+		}
+		AVLTree_UpdateNode(copy);
+		subtree = copy;
+	}
+	return subtree;
+}
+
+/* Adds a version with val inserted into the latest one. Returns how
+ * many versions were added, 0 if val was already there.
+ *
+ * With record_steps every step of the rebalance gets its own version
+ * too: the tree right after the new leaf is linked in and after the
+ * first half of a double rotation. Each of those costs another path.
+ */
+template <typename Tree>
+int AVLPersistent_Insert(Tree* tree, const typename Tree::KeyType& val, bool record_steps = false) {
+	typedef typename Tree::Node Node;
+
+	assert(tree);
+
+	Node* path[AVL_MAX_HEIGHT];
+	int cmps[AVL_MAX_HEIGHT];
+	int depth = 0;
+	Node* node = AVLPersistent_Latest(tree);
+	while(node != NULL) {
+		int cmp = tree->compare(val, node->val);
+		if(cmp == 0) {
+			return 0;
+		}
+		assert(depth < AVL_MAX_HEIGHT);
+		path[depth] = node;
+		cmps[depth] = cmp;
+		depth++;
+		node = (cmp < 0) ? node->left : node->right;
+	}
+
+	int first_version = tree->num_versions;
+	if(tree->pool.node_size == 0) {
+		AVLNodePool_Init(&tree->pool, sizeof(Node));
+	}
+	// NOTE: every node the new version needs is reserved up front.
+	//       _Own retires the node it copies, so running out halfway
+	//       would leave published versions pointing at retired nodes.
+	//       The leaf and the path, two more for a double rotation and
+	//       with record_steps two more paths for the extra versions.
+	size_t max_copies = (size_t)depth + 3;
+	if(record_steps) {
+		max_copies += 2 * ((size_t)depth + 1);
+	}
+	if(!AVLNodePool_Reserve(&tree->pool, max_copies)) {
+		return 0;
+	}
+	Node* subtree = (Node*)AVLNodePool_Alloc(&tree->pool);
+	assert(subtree);
+	subtree->val = val;
+	subtree->subtree_size = 1;
+	subtree->version = tree->num_versions;
+
+	// same rebalance as AVLTree_RebalanceAfterInsert, bottom up
+	for(int i = depth - 1; i >= 0; --i) {
+		Node* copy = AVLPersistent_Own(tree, path[i]);
+		assert(copy);
+		if(cmps[i] < 0) {
+			copy->left = subtree;
+		}
+		else {
+			copy->right = subtree;
+		}
+		AVLTree_UpdateNode(copy);
+
+		int balance = AVLTree_GetBalance(copy);
+		if((balance > 1) || (balance < -1)) {
+			if(record_steps) {
+				AVLPersistent_PushVersion(tree, AVLPersistent_CopyPath(tree, path, cmps, i, copy));
+				copy = AVLPersistent_Own(tree, copy);
+			}
+
+			if(balance > 1) {
+				if(AVLTree_GetBalance(copy->left) < 0) {
+					copy->left = AVLPersistent_LeftRotate(tree, copy->left);
+					AVLTree_UpdateNode(copy);
+					if(record_steps) {
+						AVLPersistent_PushVersion(tree, AVLPersistent_CopyPath(tree, path, cmps, i, copy));
+						copy = AVLPersistent_Own(tree, copy);
+					}
+				}
+				copy = AVLPersistent_RightRotate(tree, copy);
+				assert(copy);
+			}
+			else {
+				if(AVLTree_GetBalance(copy->right) > 0) {
+					copy->right = AVLPersistent_RightRotate(tree, copy->right);
+					AVLTree_UpdateNode(copy);
+					if(record_steps) {
+						AVLPersistent_PushVersion(tree, AVLPersistent_CopyPath(tree, path, cmps, i, copy));
+						copy = AVLPersistent_Own(tree, copy);
+					}
+				}
+				copy = AVLPersistent_LeftRotate(tree, copy);
+				assert(copy);
+			}
+		}
+		subtree = copy;
+	}
+
+	AVLPersistent_PushVersion(tree, subtree);
+	return tree->num_versions - first_version;
+}
+
+template <typename Tree, typename Key>
+static typename Tree::Node* AVLPersistent_CopySubtree(Tree* tree, const AVLNodeT<Key>* node) {
+	if(node == NULL) {
+		return NULL;
+	}
+
+	typename Tree::Node* copy = (typename Tree::Node*)AVLNodePool_Alloc(&tree->pool);
+	if(!copy) {
+		return NULL;
+	}
+	copy->val = node->val;
+	copy->version = tree->num_versions;
+	copy->left = AVLPersistent_CopySubtree(tree, node->left);
+	copy->right = AVLPersistent_CopySubtree(tree, node->right);
+	// copied rather than recomputed so ranks survive, see AVLWeak_Insert
+	copy->height = node->height;
+	copy->subtree_size = node->subtree_size;
+	copy->duplicates = node->duplicates;
+
+	return copy;
+}
+
+/* Adds a version that is a copy of a regular tree, e.g. the starting
+ * tree or one that was restructured some other way than by inserts.
+ * Unlike an insert this is O(n) nodes.
+ */
+template <typename Tree, typename Key>
+void AVLPersistent_PushCopy(Tree* tree, const AVLNodeT<Key>* root) {
+	assert(tree);
+
+	if(tree->pool.node_size == 0) {
+		AVLNodePool_Init(&tree->pool, sizeof(typename Tree::Node));
+	}
+	AVLPersistent_PushVersion(tree, AVLPersistent_CopySubtree(tree, root));
+}
+
+// Frees every version
+template <typename Tree>
+void AVLPersistent_Release(Tree* tree) {
+	assert(tree);
+
+	AVLNodePool_Release(&tree->pool);
+	free(tree->versions);
+	tree->versions = NULL;
+	tree->num_versions = 0;
+	tree->versions_capacity = 0;
+}
+
+/*********************************************
+ * Published snapshots                       *
+ *********************************************/
+/* One writer keeps inserting while any number of readers (up to
+ * AVL_SNAPSHOT_MAX_READERS) walk the last published version, without
+ * locks on either side. Inserts are path copying like
+ * AVLPersistentTreeT, except only the newest version is kept. Each
+ * new root is published atomically and the nodes it replaced are
+ * retired.
+ *
+ * Retired nodes are freed with epoch based reclamation. A reader
+ * announces the global epoch before it loads the root. The writer only
+ * moves the epoch on once every active reader has caught up with it.
+ * Nodes retired during epoch e can't be reached by anyone once the
+ * epoch gets to e + 2, so three retire lists are enough.
+ *
+ * AVLPersistent_Insert works on this tree as is. The overloads of
+ * AVLPersistent_Latest, _PushVersion and _Retire below swap out the
+ * version list for publishing and retiring.
+ */
+#define AVL_SNAPSHOT_MAX_READERS 16
+
+// NOTE: retired nodes can't be chained through their own
+//       links since readers may still be following them
+typedef struct {
+	void** nodes;
+	int count;
+	int capacity;
+} AVLRetireList;
+
+typedef struct {
+	std::atomic<uint64_t> epoch; // 0 = not reading
+	char padding[64 - sizeof(std::atomic<uint64_t>)]; // one cache line per reader
+} AVLSnapshotReader;
+
+template <typename Key, typename Compare = AVLCompare<Key> >
+struct AVLSnapshotTreeT {
+	typedef Key KeyType;
+	typedef AVLPersistentNodeT<Key> Node;
+
+	// writer only
+	Node* root;
+	int num_versions;
+	AVLNodePool pool;
+	Compare compare;
+	AVLRetireList retired[3]; // indexed by epoch % 3
+
+	// shared with readers
+	std::atomic<Node*> published;
+	std::atomic<uint64_t> epoch;
+	AVLSnapshotReader readers[AVL_SNAPSHOT_MAX_READERS];
+};
+
+typedef AVLSnapshotTreeT<int> AVLSnapshotTree;
+
+template <typename Key, typename Compare>
+void AVLSnapshot_Init(AVLSnapshotTreeT<Key, Compare>* tree) {
+	assert(tree);
+
+	tree->root = NULL;
+	tree->num_versions = 0;
+	AVLNodePool_Init(&tree->pool, sizeof(AVLPersistentNodeT<Key>));
+	memset(tree->retired, 0, sizeof(tree->retired));
+	tree->published.store(NULL, std::memory_order_relaxed);
+	tree->epoch.store(1, std::memory_order_relaxed);
+	for(int i = 0; i < AVL_SNAPSHOT_MAX_READERS; ++i) {
+		tree->readers[i].epoch.store(0, std::memory_order_relaxed);
+	}
+}
+
+// No readers may be active
+template <typename Key, typename Compare>
+void AVLSnapshot_Release(AVLSnapshotTreeT<Key, Compare>* tree) {
+	assert(tree);
+
+	AVLNodePool_Release(&tree->pool);
+	tree->root = NULL;
+	for(int i = 0; i < 3; ++i) {
+		free(tree->retired[i].nodes);
+	}
+	memset(tree->retired, 0, sizeof(tree->retired));
+	tree->published.store(NULL, std::memory_order_relaxed);
+}
+
+template <typename Key, typename Compare>
+inline AVLPersistentNodeT<Key>* AVLPersistent_Latest(const AVLSnapshotTreeT<Key, Compare>* tree) {
+	return tree->root;
+}
+
+template <typename Key, typename Compare>
+static bool AVLPersistent_PushVersion(AVLSnapshotTreeT<Key, Compare>* tree, AVLPersistentNodeT<Key>* root) {
+	tree->root = root;
+	tree->num_versions++;
+	tree->published.store(root, std::memory_order_release);
+	return true;
+}
+
+template <typename Key, typename Compare>
+static inline void AVLPersistent_Retire(AVLSnapshotTreeT<Key, Compare>* tree, AVLPersistentNodeT<Key>* node) {
+	AVLRetireList* list = &tree->retired[tree->epoch.load(std::memory_order_relaxed) % 3];
+	if(list->count == list->capacity) {
+		int new_capacity = list->capacity ? (2 * list->capacity) : 256;
+		void** new_nodes = (void**)realloc(list->nodes, (size_t)new_capacity * sizeof(void*));
+		if(!new_nodes) {
+			// NOTE: leaks the node rather than freeing it too early
+			fprintf(stderr, "Couldn't realloc for AVLRetireList\n");
+			return;
+		}
+		list->nodes = new_nodes;
+		list->capacity = new_capacity;
+	}
+	list->nodes[list->count++] = node;
+}
+
+/* Moves the epoch on if every active reader is in the current one and
+ * frees what was retired two epochs ago. The writer calls this after
+ * each insert. It's cheap to call when nothing can be freed yet.
+ */
+template <typename Key, typename Compare>
+void AVLSnapshot_Reclaim(AVLSnapshotTreeT<Key, Compare>* tree) {
+	assert(tree);
+
+	uint64_t epoch = tree->epoch.load(std::memory_order_relaxed);
+	for(int i = 0; i < AVL_SNAPSHOT_MAX_READERS; ++i) {
+		uint64_t reader_epoch = tree->readers[i].epoch.load(std::memory_order_seq_cst);
+		if((reader_epoch != 0) && (reader_epoch != epoch)) {
+			return;
+		}
+	}
+	tree->epoch.store(epoch + 1, std::memory_order_seq_cst);
+
+	// NOTE: (epoch + 2) % 3 is the bucket for epoch - 1
+	AVLRetireList* list = &tree->retired[(epoch + 2) % 3];
+	for(int i = 0; i < list->count; ++i) {
+		AVLNodePool_Free(&tree->pool, list->nodes[i]);
+	}
+	list->count = 0;
+}
+
+// Writer side. Publishes a version with val in it, if it wasn't already.
+template <typename Key, typename Compare>
+void AVLSnapshot_Insert(AVLSnapshotTreeT<Key, Compare>* tree, const Key& val) {
+	assert(tree);
+
+	AVLPersistent_Insert(tree, val);
+	AVLSnapshot_Reclaim(tree);
+}
+
+/* Reader side. Returns the root of the latest published version, which
+ * stays valid and unchanged until AVLSnapshot_EndRead. Each reader
+ * thread uses its own index below AVL_SNAPSHOT_MAX_READERS.
+ */
+template <typename Key, typename Compare>
+AVLPersistentNodeT<Key>* AVLSnapshot_BeginRead(AVLSnapshotTreeT<Key, Compare>* tree, int reader) {
+	assert(tree);
+	assert((0 <= reader) && (reader < AVL_SNAPSHOT_MAX_READERS));
+
+	// NOTE: the root has to be loaded after the announcement is
+	//       visible or the writer could free it out from under us
+	uint64_t epoch = tree->epoch.load(std::memory_order_seq_cst);
+	tree->readers[reader].epoch.store(epoch, std::memory_order_seq_cst);
+	return tree->published.load(std::memory_order_seq_cst);
+}
+
+template <typename Key, typename Compare>
+void AVLSnapshot_EndRead(AVLSnapshotTreeT<Key, Compare>* tree, int reader) {
+	assert(tree);
+	assert((0 <= reader) && (reader < AVL_SNAPSHOT_MAX_READERS));
+
+	tree->readers[reader].epoch.store(0, std::memory_order_release);
+}
+
+/*********************************************
+ * Saving and loading                        *
+ *********************************************/
+/* File layout, in the byte order of the machine that wrote it:
+ *
+ *   AVLFileHeader
+ *   Key keys[count]                  pre-order, each node before its subtrees
+ *   int32_t duplicates[count]        only with AVL_FILE_MULTISET
+ *   uint8_t shape[(count + 3) / 4]   2 bits per node in the same order,
+ *                                    bit 0 = has a left child, bit 1 = right
+ *
+ * Pre-order plus the shape gives back exactly the tree that was saved,
+ * not just the same keys, and every node can be linked in as soon as
+ * it's read. Heights, sizes and layout slots aren't stored since they
+ * follow from the shape. Keys are written as raw bytes, so this only
+ * works for plain keys like ints, IDs or AVLFixedString.
+ *
+ * AVLTree_Load maps the file instead of reading it into a buffer and
+ * builds the nodes straight out of the mapping in one pass.
+ */
+#define AVL_FILE_MAGIC 0x544C5641 // "AVLT"
+#define AVL_FILE_VERSION 1
+#define AVL_FILE_MULTISET 0x1
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t key_size; // a file only loads into a tree with the same size of key
+	uint32_t flags;
+	uint64_t count;
+	uint64_t checksum; // AVLFile_Checksum of everything after the header
+} AVLFileHeader;
+
+// FNV-1a, 64 bit
+static uint64_t AVLFile_Checksum(const uint8_t* data, size_t size) {
+	uint64_t hash = 14695981039346656037ull;
+	for(size_t i = 0; i < size; ++i) {
+		hash ^= data[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+static inline size_t AVLFile_PayloadSize(uint64_t count, size_t key_size, uint32_t flags) {
+	size_t size = (size_t)count * key_size;
+	if(flags & AVL_FILE_MULTISET) {
+		size += (size_t)count * sizeof(int32_t);
+	}
+	return size + (size_t)((count + 3) / 4);
+}
+
+typedef struct {
+	uint8_t* keys;
+	uint8_t* duplicates; // NULL unless AVL_FILE_MULTISET
+	uint8_t* shape;
+	uint64_t count;
+	uint64_t next; // pre-order index of the next node
+	bool valid;
+} AVLFileCursor;
+
+template <typename Key>
+static void AVLFile_WriteSubtree(const AVLNodeT<Key>* node, AVLFileCursor* cursor) {
+	if(node == NULL) {
+		return;
+	}
+
+	uint64_t i = cursor->next++;
+	memcpy(cursor->keys + (i * sizeof(Key)), &node->val, sizeof(Key));
+	if(cursor->duplicates) {
+		int32_t duplicates = node->duplicates;
+		memcpy(cursor->duplicates + (i * sizeof(int32_t)), &duplicates, sizeof(int32_t));
+	}
+	int shape = (node->left ? 1 : 0) | (node->right ? 2 : 0);
+	cursor->shape[i / 4] |= (uint8_t)(shape << ((i % 4) * 2));
+
+	AVLFile_WriteSubtree(node->left, cursor);
+	AVLFile_WriteSubtree(node->right, cursor);
+}
+
+// Returns false and leaves no file behind if anything went wrong
+template <typename Tree>
+bool AVLTree_Save(const Tree* tree, const char* path) {
+	typedef typename Tree::KeyType Key;
+
+	assert(tree);
+	assert(path);
+
+	AVLFileHeader header;
+	header.magic = AVL_FILE_MAGIC;
+	header.version = AVL_FILE_VERSION;
+	header.key_size = sizeof(Key);
+	header.flags = tree->multiset ? AVL_FILE_MULTISET : 0;
+	header.count = (uint64_t)tree->size;
+
+	size_t payload_size = AVLFile_PayloadSize(header.count, sizeof(Key), header.flags);
+	uint8_t* payload = (uint8_t*)calloc(payload_size + 1, 1);
+	if(!payload) {
+		fprintf(stderr, "Couldn't malloc for AVLTree_Save\n");
+		return false;
+	}
+
+	AVLFileCursor cursor;
+	cursor.keys = payload;
+	cursor.duplicates = (header.flags & AVL_FILE_MULTISET) ? (payload + (header.count * sizeof(Key))) : NULL;
+	cursor.shape = payload + (payload_size - (size_t)((header.count + 3) / 4));
+	cursor.count = header.count;
+	cursor.next = 0;
+	cursor.valid = true;
+	AVLFile_WriteSubtree(tree->root, &cursor);
+	assert(cursor.next == header.count);
+	header.checksum = AVLFile_Checksum(payload, payload_size);
+
+	FILE* file = fopen(path, "wb");
+	if(!file) {
+		fprintf(stderr, "Couldn't open %s for writing\n", path);
+		free(payload);
+		return false;
+	}
+	bool written = (fwrite(&header, sizeof(header), 1, file) == 1) &&
+	               ((payload_size == 0) || (fwrite(payload, payload_size, 1, file) == 1));
+	written = (fclose(file) == 0) && written;
+	free(payload);
+	if(!written) {
+		fprintf(stderr, "Couldn't write %s\n", path);
+		remove(path);
+	}
+	return written;
+}
+
+/* Links up the next node in pre-order and its subtrees. low and high
+ * are the keys the subtree has to stay between (NULL = no bound).
+ * Anything that doesn't add up to an AVL tree clears cursor->valid.
+ */
+template <typename Tree>
+static typename Tree::Node* AVLFile_ReadSubtree(Tree* tree, AVLFileCursor* cursor, typename Tree::Node* parent,
+		                                        int depth, uint64_t level_index,
+												const typename Tree::KeyType* low, const typename Tree::KeyType* high) {
+	typedef typename Tree::KeyType Key;
+	typedef typename Tree::Node Node;
+
+	if((cursor->next >= cursor->count) || (depth >= AVL_MAX_HEIGHT)) {
+		cursor->valid = false;
+		return NULL;
+	}
+
+	uint64_t i = cursor->next++;
+	Node* node = AVLTree_AllocNode(tree);
+	memcpy(&node->val, cursor->keys + (i * sizeof(Key)), sizeof(Key));
+	if((low && (tree->compare(node->val, *low) <= 0)) || (high && (tree->compare(node->val, *high) >= 0))) {
+		cursor->valid = false;
+		return node;
+	}
+	if(cursor->duplicates) {
+		int32_t duplicates;
+		memcpy(&duplicates, cursor->duplicates + (i * sizeof(int32_t)), sizeof(int32_t));
+		if(duplicates < 0) {
+			cursor->valid = false;
+			return node;
+		}
+		node->duplicates = duplicates;
+		tree->duplicates += duplicates;
+	}
+	node->parent = parent;
+	node->depth = depth;
+	node->level_index = level_index;
+
+	int shape = (cursor->shape[i / 4] >> ((i % 4) * 2)) & 3;
+	if(shape & 1) {
+		node->left = AVLFile_ReadSubtree(tree, cursor, node, depth + 1, 2 * level_index, low, &node->val);
+	}
+	if(cursor->valid && (shape & 2)) {
+		node->right = AVLFile_ReadSubtree(tree, cursor, node, depth + 1, (2 * level_index) + 1, &node->val, high);
+	}
+	AVLTree_UpdateNode(node);
+
+	int balance = AVLTree_GetBalance(node);
+	if((balance < -1) || (1 < balance)) {
+		cursor->valid = false;
+	}
+	return node;
+}
+
+/* Replaces the contents of the tree with a saved one held in memory.
+ * All the nodes come out of one block of the pool, in pre-order. On
+ * failure the tree is left empty.
+ */
+template <typename Tree>
+bool AVLTree_LoadFromMemory(Tree* tree, const void* data, size_t size) {
+	typedef typename Tree::KeyType Key;
+
+	assert(tree);
+	assert(data || (size == 0));
+
+	size_t node_size = tree->pool.node_size ? tree->pool.node_size : sizeof(typename Tree::Node);
+	AVLNodePool_Release(&tree->pool);
+	AVLNodePool_Init(&tree->pool, node_size);
+	tree->root = NULL;
+	tree->size = 0;
+	tree->duplicates = 0;
+
+	AVLFileHeader header;
+	if(size < sizeof(header)) {
+		fprintf(stderr, "Couldn't load tree: file is too small\n");
+		return false;
+	}
+	memcpy(&header, data, sizeof(header));
+	if((header.magic != AVL_FILE_MAGIC) || (header.version != AVL_FILE_VERSION)) {
+		fprintf(stderr, "Couldn't load tree: not a version %d tree file\n", AVL_FILE_VERSION);
+		return false;
+	}
+	if((header.key_size != sizeof(Key)) || (header.flags & ~(uint32_t)AVL_FILE_MULTISET) || (header.count > 0x7FFFFFFF)) {
+		fprintf(stderr, "Couldn't load tree: file holds a different kind of tree\n");
+		return false;
+	}
+	const uint8_t* payload = (const uint8_t*)data + sizeof(header);
+	size_t payload_size = AVLFile_PayloadSize(header.count, sizeof(Key), header.flags);
+	if((size - sizeof(header) != payload_size) || (AVLFile_Checksum(payload, payload_size) != header.checksum)) {
+		fprintf(stderr, "Couldn't load tree: file is damaged\n");
+		return false;
+	}
+
+	// NOTE: tree->multiset is only set once the load can't fail any more
+	bool multiset = (header.flags & AVL_FILE_MULTISET) != 0;
+	if(header.count == 0) {
+		tree->multiset = multiset;
+		return true;
+	}
+	if(!AVLNodePool_Reserve(&tree->pool, (size_t)header.count)) {
+		return false;
+	}
+
+	// NOTE: only read through, the cursor is shared with AVLTree_Save
+	AVLFileCursor cursor;
+	cursor.keys = (uint8_t*)payload;
+	cursor.duplicates = multiset ? (uint8_t*)(payload + (header.count * sizeof(Key))) : NULL;
+	cursor.shape = (uint8_t*)(payload + (payload_size - (size_t)((header.count + 3) / 4)));
+	cursor.count = header.count;
+	cursor.next = 0;
+	cursor.valid = true;
+	typename Tree::Node* root = AVLFile_ReadSubtree(tree, &cursor, (typename Tree::Node*)NULL, 0, 0,
+			                                        (const Key*)NULL, (const Key*)NULL);
+	if(!cursor.valid || (cursor.next != header.count)) {
+		fprintf(stderr, "Couldn't load tree: file doesn't hold a valid AVL tree\n");
+		AVLNodePool_Release(&tree->pool);
+		AVLNodePool_Init(&tree->pool, node_size);
+		tree->duplicates = 0;
+		return false;
+	}
+
+	tree->root = root;
+	tree->size = (int)header.count;
+	tree->multiset = multiset;
+	return true;
+}
+
+// Read only view of a whole file, see AVLFile_Map
+typedef struct {
+	const uint8_t* data;
+	size_t size;
+#if defined(_WIN32)
+	HANDLE file;
+	HANDLE mapping;
+#endif
+} AVLFileMapping;
+
+static bool AVLFile_Map(const char* path, AVLFileMapping* mapping) {
+	assert(path);
+	assert(mapping);
+
+	mapping->data = NULL;
+	mapping->size = 0;
+#if defined(_WIN32)
+	mapping->mapping = NULL;
+	mapping->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 
+			                    FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if(mapping->file == INVALID_HANDLE_VALUE) {
+		fprintf(stderr, "Couldn't open %s\n", path);
+		return false;
+	}
+
+	LARGE_INTEGER file_size;
+	if(!GetFileSizeEx(mapping->file, &file_size) || (file_size.QuadPart == 0)) {
+		fprintf(stderr, "Couldn't get the size of %s\n", path);
+		CloseHandle(mapping->file);
+		return false;
+	}
+	mapping->mapping = CreateFileMappingA(mapping->file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if(mapping->mapping) {
+		mapping->data = (const uint8_t*)MapViewOfFile(mapping->mapping, FILE_MAP_READ, 0, 0, 0);
+	}
+	if(!mapping->data) {
+		fprintf(stderr, "Couldn't map %s\n", path);
+		if(mapping->mapping) {
+			CloseHandle(mapping->mapping);
+		}
+		CloseHandle(mapping->file);
+		return false;
+	}
+	mapping->size = (size_t)file_size.QuadPart;
+#else
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		fprintf(stderr, "Couldn't open %s\n", path);
+		return false;
+	}
+
+	struct stat file_stat;
+	if((fstat(fd, &file_stat) != 0) || (file_stat.st_size == 0)) {
+		fprintf(stderr, "Couldn't get the size of %s\n", path);
+		close(fd);
+		return false;
+	}
+	void* data = mmap(NULL, (size_t)file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED) {
+		fprintf(stderr, "Couldn't map %s\n", path);
+		return false;
+	}
+	madvise(data, (size_t)file_stat.st_size, MADV_SEQUENTIAL);
+	mapping->data = (const uint8_t*)data;
+	mapping->size = (size_t)file_stat.st_size;
+#endif
+
+	return true;
+}
+
+static void AVLFile_Unmap(AVLFileMapping* mapping) {
+	assert(mapping);
+
+#if defined(_WIN32)
+	UnmapViewOfFile(mapping->data);
+	CloseHandle(mapping->mapping);
+	CloseHandle(mapping->file);
+#else
+	munmap((void*)mapping->data, mapping->size);
+#endif
+	mapping->data = NULL;
+	mapping->size = 0;
+}
+
+// Replaces the contents of the tree with the one saved at path
+template <typename Tree>
+bool AVLTree_Load(Tree* tree, const char* path) {
+	assert(tree);
+	assert(path);
+
+	AVLFileMapping mapping;
+	if(!AVLFile_Map(path, &mapping)) {
+		return false;
+	}
+	bool loaded = AVLTree_LoadFromMemory(tree, mapping.data, mapping.size);
+	AVLFile_Unmap(&mapping);
+	return loaded;
+}
+
+#define AVL_TREE_CORE_CPP
+#endif
@@ -0,0 +1,12 @@
+@echo off
+
+rem Headless AVL tree benchmark, see avl_bench.cpp
+rem usage: bench.bat [max_power_of_10]
+set CompilerFlags=-nologo -MT -Gm- -GR- -EHsc -O2 -Oi -W4 -wd4127 -wd4201 -wd4100 -wd4189 -wd4505 -DDEBUG=0 -FC -Z7
+
+mkdir ..\build 2> NUL
+pushd ..\build
+
+cl %CompilerFlags% ..\src\avl_bench.cpp /link -opt:ref -incremental:no
+avl_bench.exe %1
+popd
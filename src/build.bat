@@ -1,7 +1,7 @@
 @echo off
 
 rem -FAs assembly output
-set CompilerFlags=/I "..\include" -nologo -MT -Gm- -GR- -EHa- -Od -Oi -WX -W4 -wd4127 -wd4201 -wd4281 -wd4100 -wd4189 -wd4505 -wd4706 -DDEBUG=1 -FC -Z7
+set CompilerFlags=/I "..\include" -nologo -MT -Gm- -GR- -EHa- -Od -Oi -WX -W4 -wd4127 -wd4201 -wd4281 -wd4100 -wd4189 -wd4505 -wd4706 -DDEBUG=1 -D_HAS_EXCEPTIONS=0 -FC -Z7
 set LinkerFlags=/LIBPATH:"..\lib" -incremental:no opengl32.lib glew32s.lib 
 
 mkdir ..\build
@@ -71,7 +71,7 @@ INTERNAL void GameUpdateAndRender(GameMemory* memory, GameInput* input) {
 		{
 			ISort* isort = (ISort*)game_state->data_structures[INSERTION_SORT];
 			if(!isort) {
-				game_state->data_structures[INSERTION_SORT] = ISort_Init();
+				game_state->data_structures[INSERTION_SORT] = ISort_Init((float)game_state->window_width, (float)game_state->window_height);
 				isort = (ISort*)game_state->data_structures[INSERTION_SORT];
 			}
 			UpdateCamera(&isort->camera, input);
@@ -147,6 +147,28 @@ INTERNAL GameBackground GenBackgroundBuffer() {
 	return gb;
 }
 
+INTERNAL void MemoryArena_Init(MemoryArena* arena, void* base, size_t size) {
+	assert(arena);
+
+	arena->base = (uint8_t*)base;
+	arena->size = size;
+	arena->used = 0;
+}
+
+// Returns NULL once the arena is full. Everything is 16 byte aligned.
+INTERNAL void* MemoryArena_Push(MemoryArena* arena, size_t size) {
+	assert(arena);
+
+	size_t start = (arena->used + 15) & ~(size_t)15;
+	if((start > arena->size) || (size > (arena->size - start))) {
+		fprintf(stderr, "Couldn't push %zu bytes onto MemoryArena\n", size);
+		return NULL;
+	}
+
+	arena->used = start + size;
+	return arena->base + start;
+}
+
 void GameCube_SetColor(GameCube* cube, float r, float g, float b) {
 	assert(cube);
 
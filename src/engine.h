@@ -42,7 +42,7 @@ typedef struct {
 //       this struct.
 typedef struct GameInput {
 	union {
-		GameButtonState buttons[22];
+		GameButtonState buttons[30];
 		struct {
 			GameButtonState comma;
 			GameButtonState a;
@@ -52,6 +52,14 @@ typedef struct GameInput {
 			GameButtonState p;
 			GameButtonState w;
 			GameButtonState v;
+			GameButtonState j;
+			GameButtonState b;
+			GameButtonState f;
+			GameButtonState d;
+			GameButtonState r;
+			GameButtonState m;
+			GameButtonState k;
+			GameButtonState h;
 			GameButtonState num_0;
 			GameButtonState num_1;
 			GameButtonState num_2;
@@ -116,6 +124,16 @@ typedef struct {
 	Vertex line_vertices[2];
 } GameCube;
 
+// Hands out pieces of one fixed block front to back. Nothing is
+// freed on its own, the whole block goes at once.
+typedef struct {
+	uint8_t* base;
+	size_t size;
+	size_t used;
+} MemoryArena;
+
+#define MemoryArena_PushArray(arena, count, type) ((type*)MemoryArena_Push((arena), (size_t)(count) * sizeof(type)))
+
 typedef struct {
 	View current_view;
 	void** data_structures;
@@ -128,5 +146,7 @@ INTERNAL void           GenDigit(const float x, const float y, const float z, co
 INTERNAL GameCube       GenCube(const float x, const float y, const float z, const int val, float r, float g, float b);
          void           GameCube_SetColor(GameCube* cube, float r, float g, float b);
 INTERNAL GameBackground GenBackgroundBuffer();
+INTERNAL void           MemoryArena_Init(MemoryArena* arena, void* base, size_t size);
+INTERNAL void*          MemoryArena_Push(MemoryArena* arena, size_t size);
 #define ENGINE_H
 #endif
@@ -1,49 +1,89 @@
 #include <stdbool.h>
 #include "engine.h"
-
-#define INSERTION_SORT_SIZE 16
+#include "sort_trace.cpp"
+
+// how many values get sorted comes from isort_config_file
+#define ISORT_DEFAULT_SIZE 16
+#define ISORT_MIN_SIZE 16
+#define ISORT_MAX_SIZE 100000
+#define ISORT_MIN_COLUMNS 16
+#define ISORT_MAX_TEMPLATE_SEGMENTS 64 // two 32 bit masks per value
 #define THRESHOLD 0.001f
 
 // units is a unit cube 1.0f
 static float isort_units_per_second = 1.0f;
+static int isort_events_per_frame = 1; // more than one skips the animation
 static float const isort_frames_per_second = 60.0f;
 static float const isort_y_lift_val = 1.3f;
+static float const isort_node_width = 1.0f;
+static float const isort_x_padding = 0.68f;
+static float const isort_row_spacing = 3.0f; // leaves room to lift a value over the row
+static float const isort_fov = 75.0f; // vertical, in degrees
+static char const* isort_config_file = "insertion_sort.cfg"; // e.g. "size 1000"
 
 typedef enum {
 	ISORT_INITIALIZING,
 	ISORT_STATIC,
-	ISORT_LIFTING_SELECTED_VALUE,
-	ISORT_COMPARING,
-	ISORT_SHIFTING_RIGHT,
-	ISORT_SHIFTING_LEFT,
-	ISORT_SHIFTING_DOWN,
+	ISORT_PLAYING,
 	ISORT_PAUSED
 } ISortState;
 
+// Nodes are drawn instanced straight out of this array, see
+// ISort_BuildTemplate, so it only holds where the cube is and
+// what it looks like rather than a whole GameCube.
 typedef struct {
-	GameCube cube;
+	float x; // top left front corner of the cube
+	float y;
+	float r;
+	float g;
+	float b;
 	int val;
 	float x_dest;
 	float x_vel;
 	float y_dest;
 	float y_vel;
-	int start_index;
 } ISortNode;
 
+// One vertex of the model every node is drawn from
+typedef struct {
+	Vertex vertex;
+	int segment; // bit in value_segments for digit lines, -1 for the cube
+} ISortTemplateVertex;
+
 typedef struct {
 	// state machine stuff
 	ISortState current_state;
 	ISortState previous_state;
 
 	// data
-	int selected_val_index;
-	int compare_val_index;
-	ISortNode nodes[INSERTION_SORT_SIZE];
+	int size;
+	ISortNode* nodes; // size of them, out of arena, node i starts in slot i
+	MemoryArena arena;
+
+	// playback: the sort runs on its own thread and its trace is
+	// played back here, see sort_trace.cpp
+	SortAlgorithm algorithm;
+	SortTrace* trace;
+	int* values; // what the sort sorts, size of them out of arena
+	int* slots; // node in each slot, -1 while it's empty
+	int held; // node lifted out of the array, -1 for none
+	SortEvent event; // the one being animated
+	int event_step; // 0 when there's none, a drop goes over and then down
+	int compare_timer;
+	bool sorted;
+
+	// layout: values go left to right in rows of columns, every
+	// other row running back right to left
+	int columns;
+	float left; // x of the first slot
 
 	// opengl stuff
 	GameCamera camera;
 	unsigned int vao;
-	unsigned int vbo;
+	unsigned int template_vbo;
+	unsigned int instance_vbo;
+	int num_template_vertices;
+	uint32_t value_segments[MAX_DIGITS][2];
 	unsigned int shader;
 	GameBackground background;
 } ISort;
@@ -69,46 +109,224 @@ inline float ISort_SetVelocity(float const location, float const destination) {
 	return dist / (float)new_frames_to_reach_dest;
 }
 
-ISort* ISort_Init() {
-	ISort* isort = (ISort*)malloc(sizeof(ISort));
-	if(!isort) {
+// Slots snake back and forth so the next one over is always right
+// beside the last one, or right below it at the end of a row
+INTERNAL float ISort_SlotX(const ISort* isort, int index) {
+	int row = index / isort->columns;
+	int column = index % isort->columns;
+	if(row & 1) {
+		column = isort->columns - 1 - column;
+	}
+	return isort->left + (float)column * (isort_node_width + isort_x_padding);
+}
+
+INTERNAL float ISort_SlotY(const ISort* isort, int index) {
+	return 0.5f - (float)(index / isort->columns) * isort_row_spacing;
+}
+
+// Heads node for (x_dest, y_dest) from wherever it is now
+INTERNAL void ISort_MoveNode(ISortNode* node, float x_dest, float y_dest) {
+	node->x_dest = x_dest;
+	node->y_dest = y_dest;
+	node->x_vel = ISort_SetVelocity(node->x, x_dest);
+	node->y_vel = ISort_SetVelocity(node->y, y_dest);
+}
+
+// Stops each axis of node once it gets where it was going. Returns
+// true when it's stopped on both.
+INTERNAL bool ISort_MoveFinished(ISortNode* node) {
+	if(ISort_AnimationFinished(node->x, node->x_dest)) {
+		node->x = node->x_dest;
+		node->x_vel = 0.0f;
+	}
+	if(ISort_AnimationFinished(node->y, node->y_dest)) {
+		node->y = node->y_dest;
+		node->y_vel = 0.0f;
+	}
+
+	return (node->x_vel == 0.0f) && (node->y_vel == 0.0f);
+}
+
+INTERNAL inline void ISort_SetColor(ISortNode* node, float r, float g, float b) {
+	node->r = r;
+	node->g = g;
+	node->b = b;
+}
+
+// Reads "size <n>" from path. A missing file means the default and
+// anything out of range gets clamped.
+INTERNAL int ISort_LoadSize(const char* path) {
+	FILE* file = fopen(path, "r");
+	if(!file) {
+		return ISORT_DEFAULT_SIZE;
+	}
+
+	int size = ISORT_DEFAULT_SIZE;
+	if(fscanf(file, " size %d", &size) != 1) {
+		fprintf(stderr, "Couldn't read size from %s\n", path);
+		size = ISORT_DEFAULT_SIZE;
+	}
+	fclose(file);
+
+	if(size < ISORT_MIN_SIZE) {
+		size = ISORT_MIN_SIZE;
+	}
+	if(ISORT_MAX_SIZE < size) {
+		size = ISORT_MAX_SIZE;
+	}
+	return size;
+}
+
+/* Every node is drawn from one template: the edges of a cube with its
+ * top left front corner at the origin, plus every line GenDigit draws
+ * for any value. value_segments has a bit set for each of those lines
+ * a value uses and the vertex shader drops the others, so per node
+ * only its corner, color and value go to the GPU.
+ */
+INTERNAL int ISort_BuildTemplate(ISort* isort, ISortTemplateVertex* vertices) {
+	GameCube cube = GenCube(0.5f, -0.5f, 0.0f, 0, 0.0f, 0.0f, 1.0f);
+	int num_vertices = 0;
+	int cube_vertices = sizeof(cube.cube_vertices) / sizeof(Vertex);
+	for(int j = 0; j < cube_vertices; ++j) {
+		vertices[num_vertices].vertex = cube.cube_vertices[j];
+		vertices[num_vertices++].segment = -1;
+	}
+
+	int num_segments = 0;
+	memset(isort->value_segments, 0, sizeof(isort->value_segments));
+	for(int val = 0; val < MAX_DIGITS; ++val) {
+		cube = GenCube(0.5f, -0.5f, 0.0f, val, 0.0f, 0.0f, 1.0f);
+		int digit_vertices = sizeof(cube.digit_vertices) / sizeof(Vertex);
+		for(int j = 0; j < digit_vertices; j += 2) {
+			Vertex* line = &cube.digit_vertices[j];
+			if((line[0].x == line[1].x) && (line[0].y == line[1].y)) {
+				continue; // unused
+			}
+
+			int segment = 0;
+			while((segment < num_segments) && 
+			      ((vertices[cube_vertices + (2 * segment)].vertex.x != line[0].x) || 
+			       (vertices[cube_vertices + (2 * segment)].vertex.y != line[0].y) ||
+			       (vertices[cube_vertices + (2 * segment) + 1].vertex.x != line[1].x) || 
+			       (vertices[cube_vertices + (2 * segment) + 1].vertex.y != line[1].y))) {
+				++segment;
+			}
+			if(segment == num_segments) {
+				assert(num_segments < ISORT_MAX_TEMPLATE_SEGMENTS);
+				vertices[num_vertices].vertex = line[0];
+				vertices[num_vertices++].segment = segment;
+				vertices[num_vertices].vertex = line[1];
+				vertices[num_vertices++].segment = segment;
+				++num_segments;
+			}
+			isort->value_segments[val][segment / 32] |= (uint32_t)1 << (segment % 32);
+		}
+	}
+
+	return num_vertices;
+}
+
+// Fits the rows and the space to lift a value above them on screen
+INTERNAL void ISort_FitCamera(ISort* isort, float window_width, float window_height) {
+	int rows = (isort->size + isort->columns - 1) / isort->columns;
+	float width = ((isort_node_width + isort_x_padding) * (float)isort->columns) - isort_x_padding;
+	float top = 0.5f + isort_y_lift_val;
+	float bottom = ISort_SlotY(isort, (rows - 1) * isort->columns) - isort_node_width;
+
+	float tan_half_fov = tanf(glm::radians(isort_fov) / 2.0f);
+	float aspect = window_width / window_height;
+	float distance = (top - bottom) / (2.0f * tan_half_fov);
+	if(distance < width / (2.0f * tan_half_fov * aspect)) {
+		distance = width / (2.0f * tan_half_fov * aspect);
+	}
+
+	// the cubes' front faces are half a unit out
+	distance += 0.5f;
+
+	isort->camera.x = 0.0f;
+	isort->camera.y = -(top + bottom) / 2.0f;
+	isort->camera.z = (distance < 12.0f) ? -12.0f : -distance;
+}
+
+ISort* ISort_Init(float window_width, float window_height) {
+	// the ISort and all of its nodes come out of one block
+	int size = ISort_LoadSize(isort_config_file);
+	size_t arena_size = sizeof(ISort) + ((size_t)size * (sizeof(ISortNode) + (2 * sizeof(int)))) + 64;
+	void* memory = calloc(1, arena_size);
+	if(!memory) {
 		fprintf(stderr, "Couldn't malloc for ISort\n");
 		return NULL;
 	}
+	MemoryArena arena;
+	MemoryArena_Init(&arena, memory, arena_size);
+	ISort* isort = MemoryArena_PushArray(&arena, 1, ISort);
+	isort->nodes = MemoryArena_PushArray(&arena, size, ISortNode);
+	isort->values = MemoryArena_PushArray(&arena, size, int);
+	isort->slots = MemoryArena_PushArray(&arena, size, int);
+	isort->arena = arena;
+	isort->size = size;
+
+	isort->trace = SortTrace_Create();
+	if(!isort->trace) {
+		free(memory);
+		return NULL;
+	}
+	isort->algorithm = SORT_INSERTION;
+	isort->held = -1;
+
+	// about as many rows as columns fit on screen
+	int columns = (int)ceilf(sqrtf((float)size * isort_row_spacing / (isort_node_width + isort_x_padding)));
+	isort->columns = (columns < ISORT_MIN_COLUMNS) ? ISORT_MIN_COLUMNS : columns;
+	if(size < isort->columns) {
+		isort->columns = size;
+	}
+	const float total_width = ((isort_node_width + isort_x_padding) * (float)isort->columns) - isort_x_padding;
+	isort->left = total_width / -2.0f;
 
-	const float x_padding = 0.68f;
-	const float node_width = 1.0f;
-	const float total_width = ((node_width + x_padding) * (float)INSERTION_SORT_SIZE) - x_padding;
-	float x = total_width / -2.0f;
-	const float y = 0.0f;
-	const float z = 0.0f;
-	for(int i = 0; i < INSERTION_SORT_SIZE; ++i) {
-		int val = rand() % MAX_DIGITS;
-		isort->nodes[i].val = val;
-		isort->nodes[i].cube = GenCube(0.0f, 0.0f, 0.0f, val, 0.0f, 0.0f, 1.0f);
-		isort->nodes[i].x_dest = x;
-		isort->nodes[i].y_dest = y;
-		isort->nodes[i].x_vel  = ISort_SetVelocity(isort->nodes[i].cube.cube_vertices[0].x, x);
-		isort->nodes[i].y_vel  = 0.0f;
-		isort->nodes[i].start_index = i;
-		x += (1.0f + x_padding);
+	for(int i = 0; i < size; ++i) {
+		ISortNode* node = &isort->nodes[i];
+		node->val = rand() % MAX_DIGITS;
+		node->x = -0.5f;
+		node->y = 0.5f;
+		ISort_SetColor(node, 0.0f, 0.0f, 1.0f);
+		ISort_MoveNode(node, ISort_SlotX(isort, i), ISort_SlotY(isort, i));
+		isort->slots[i] = i;
 	}
 
 	isort->current_state = ISORT_INITIALIZING;
 	isort->previous_state = ISORT_PAUSED;
-	isort->camera.x = 0.0f;
-	isort->camera.z = -12.0f;
+	ISort_FitCamera(isort, window_width, window_height);
 
-	isort->shader = LoadShaderProgram("..\\zshaders\\game_cube.vert", "..\\zshaders\\game_cube.frag");
+	isort->shader = LoadShaderProgram("..\\zshaders\\game_cube_instanced.vert", "..\\zshaders\\game_cube.frag");
+
+	ISortTemplateVertex template_vertices[VERTICES_PER_CUBE + (2 * ISORT_MAX_TEMPLATE_SEGMENTS)];
+	isort->num_template_vertices = ISort_BuildTemplate(isort, template_vertices);
 
 	GLCall(glGenVertexArrays(1, &isort->vao));
 	GLCall(glBindVertexArray(isort->vao));
-	GLCall(glGenBuffers(1, &isort->vbo));
-	GLCall(glBindBuffer(GL_ARRAY_BUFFER, isort->vbo));
-	GLCall(glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(offsetof(Vertex, pos))));
-	GLCall(glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(offsetof(Vertex, rgb))));
+	GLCall(glGenBuffers(1, &isort->template_vbo));
+	GLCall(glBindBuffer(GL_ARRAY_BUFFER, isort->template_vbo));
+	GLCall(glBufferData(GL_ARRAY_BUFFER, isort->num_template_vertices * sizeof(ISortTemplateVertex), 
+				        template_vertices, GL_STATIC_DRAW));
+	GLCall(glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(ISortTemplateVertex), 
+				                 (void*)(offsetof(ISortTemplateVertex, vertex) + offsetof(Vertex, pos))));
+	GLCall(glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(ISortTemplateVertex), 
+				                 (void*)(offsetof(ISortTemplateVertex, vertex) + offsetof(Vertex, rgb))));
+	GLCall(glVertexAttribIPointer(2, 1, GL_INT, sizeof(ISortTemplateVertex), (void*)(offsetof(ISortTemplateVertex, segment))));
 	GLCall(glEnableVertexAttribArray(0));
 	GLCall(glEnableVertexAttribArray(1));
+	GLCall(glEnableVertexAttribArray(2));
+
+	// one of these per cube instead of per vertex
+	GLCall(glGenBuffers(1, &isort->instance_vbo));
+	GLCall(glBindBuffer(GL_ARRAY_BUFFER, isort->instance_vbo));
+	GLCall(glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(ISortNode), (void*)(offsetof(ISortNode, x))));
+	GLCall(glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(ISortNode), (void*)(offsetof(ISortNode, r))));
+	GLCall(glVertexAttribIPointer(5, 1, GL_INT, sizeof(ISortNode), (void*)(offsetof(ISortNode, val))));
+	for(int attribute = 3; attribute <= 5; ++attribute) {
+		GLCall(glEnableVertexAttribArray(attribute));
+		GLCall(glVertexAttribDivisor(attribute, 1));
+	}
 
 	GLCall(glBindBuffer(GL_ARRAY_BUFFER, 0));
 	GLCall(glBindVertexArray(0));
@@ -127,83 +345,215 @@ INTERNAL void ISort_UpdateGeometry(ISort* isort) {
 		return;
 	}
 
-	for(int i = 0; i < INSERTION_SORT_SIZE; ++i) {
+	for(int i = 0; i < isort->size; ++i) {
 		ISortNode* node = &isort->nodes[i];
-		GameCube* cube = &node->cube;
-
-		int cube_vertices = sizeof(cube->cube_vertices) / sizeof(Vertex);
-		for(int j = 0; j < cube_vertices; ++j) {
-			cube->cube_vertices[j].x += node->x_vel;
-			cube->cube_vertices[j].y += node->y_vel;
-		}
-		int digit_vertices = sizeof(cube->digit_vertices) / sizeof(Vertex);
-		for(int j = 0; j < digit_vertices; ++j) {
-			cube->digit_vertices[j].x += node->x_vel;
-			cube->digit_vertices[j].y += node->y_vel;
-		}
+		node->x += node->x_vel;
+		node->y += node->y_vel;
 	}
 }
 
-INTERNAL void ISort_UpdateVelocitySetting(ISortNode* nodes, GameInput* input) {
-	assert(nodes);
+INTERNAL void ISort_UpdateVelocitySetting(ISort* isort, GameInput* input) {
+	assert(isort);
 	assert(input);
 
 	if(input->num_0.is_down) {
 		isort_units_per_second = 1.0f;
+		isort_events_per_frame = 1;
 	}
 	if(input->num_1.is_down) {
 		isort_units_per_second = 3.0f;
+		isort_events_per_frame = 1;
 	}
 	if(input->num_2.is_down) {
 		isort_units_per_second = 7.0f;
+		isort_events_per_frame = 1;
 	}
 	if(input->num_3.is_down) {
 		isort_units_per_second = 10.0f;
+		isort_events_per_frame = 1;
 	}
 	if(input->num_4.is_down) {
 		isort_units_per_second = 15.0f;
+		isort_events_per_frame = 1;
 	}
 	if(input->num_5.is_down) {
 		isort_units_per_second = 20.0f;
+		isort_events_per_frame = 1;
 	}
 	if(input->num_6.is_down) {
 		isort_units_per_second = 32.0f;
+		isort_events_per_frame = 1;
 	}
 	if(input->num_7.is_down) {
 		isort_units_per_second = 50.0f;
+		isort_events_per_frame = 1;
 	}
+	// past one event a frame they're just applied as they come in,
+	// which is what big arrays need to get anywhere
 	if(input->num_8.is_down) {
 		isort_units_per_second = 75.0f;
+		isort_events_per_frame = 100;
 	}
 	if(input->num_9.is_down) {
 		isort_units_per_second = 100.0f;
+		isort_events_per_frame = 10000;
 	}
 
-	for(int i = 0; i < INSERTION_SORT_SIZE; ++i) {
-		ISortNode* node = &nodes[i];
+	for(int i = 0; i < isort->size; ++i) {
+		ISortNode* node = &isort->nodes[i];
 		if(node->x_vel != 0.0f) {
-			node->x_vel = ISort_SetVelocity(node->cube.cube_vertices[0].x, node->x_dest);
+			node->x_vel = ISort_SetVelocity(node->x, node->x_dest);
 		}
 		if(node->y_vel != 0.0f) {
-			node->y_vel = ISort_SetVelocity(node->cube.cube_vertices[0].y, node->y_dest);
+			node->y_vel = ISort_SetVelocity(node->y, node->y_dest);
 		}
 	}
 }
 
-/*  This is the state machine. It handles input, setting destinations
- * and velocities, and zeroing out velocities for each node that reaches
- * its destination
+INTERNAL ISortNode* ISort_SlotNode(ISort* isort, int slot) {
+	int node = (slot == SORT_HELD) ? isort->held : isort->slots[slot];
+	assert(0 <= node);
+	return &isort->nodes[node];
+}
+
+// Sends node to (x, y), or puts it straight there when snapping
+INTERNAL void ISort_PlaceNode(ISortNode* node, float x, float y, bool snap) {
+	if(snap) {
+		node->x = x;
+		node->y = y;
+		node->x_dest = x;
+		node->y_dest = y;
+		node->x_vel = 0.0f;
+		node->y_vel = 0.0f;
+	}
+	else {
+		ISort_MoveNode(node, x, y);
+	}
+}
+
+/* Applies event to the slots right away and starts animating the
+ * nodes it moves, see ISort_EventFinished. Snapping puts them where
+ * they end up with no animation at all.
+ */
+INTERNAL void ISort_StartEvent(ISort* isort, SortEvent event, bool snap) {
+	int a = (int)event.a;
+	int b = (int)event.b;
+	isort->event = event;
+	isort->event_step = snap ? 0 : 1;
+
+	switch(event.type) {
+		case SORT_EVENT_COMPARE:
+		{
+			if(!snap) {
+				ISort_SetColor(ISort_SlotNode(isort, a), 1.0f, 0.0f, 0.0f);
+				ISort_SetColor(ISort_SlotNode(isort, b), 1.0f, 0.0f, 0.0f);
+				isort->compare_timer = 30 / (int)isort_units_per_second;
+			}
+		} break;
+
+		case SORT_EVENT_LIFT:
+		{
+			isort->held = isort->slots[a];
+			isort->slots[a] = -1;
+			ISort_PlaceNode(&isort->nodes[isort->held], ISort_SlotX(isort, a), 
+					        ISort_SlotY(isort, a) + isort_y_lift_val, snap);
+		} break;
+
+		case SORT_EVENT_MOVE:
+		{
+			assert(isort->slots[b] < 0);
+			isort->slots[b] = isort->slots[a];
+			isort->slots[a] = -1;
+			ISort_PlaceNode(ISort_SlotNode(isort, b), ISort_SlotX(isort, b), ISort_SlotY(isort, b), snap);
+		} break;
+
+		case SORT_EVENT_DROP:
+		{
+			// over the slot first, then down into it
+			assert(isort->slots[a] < 0);
+			isort->slots[a] = isort->held;
+			isort->held = -1;
+			float y = snap ? ISort_SlotY(isort, a) : (ISort_SlotY(isort, a) + isort_y_lift_val);
+			ISort_PlaceNode(ISort_SlotNode(isort, a), ISort_SlotX(isort, a), y, snap);
+		} break;
+
+		case SORT_EVENT_SWAP:
+		{
+			int temp = isort->slots[a];
+			isort->slots[a] = isort->slots[b];
+			isort->slots[b] = temp;
+			ISort_PlaceNode(ISort_SlotNode(isort, a), ISort_SlotX(isort, a), ISort_SlotY(isort, a), snap);
+			ISort_PlaceNode(ISort_SlotNode(isort, b), ISort_SlotX(isort, b), ISort_SlotY(isort, b), snap);
+		} break;
+	}
+}
+
+// Keeps the animation of the current event going. Returns true once
+// it's over.
+INTERNAL bool ISort_EventFinished(ISort* isort) {
+	int a = (int)isort->event.a;
+	int b = (int)isort->event.b;
+
+	switch(isort->event.type) {
+		case SORT_EVENT_COMPARE:
+		{
+			if(0 < isort->compare_timer) {
+				--isort->compare_timer;
+				return false;
+			}
+			ISort_SetColor(ISort_SlotNode(isort, a), 0.0f, 0.0f, 1.0f);
+			ISort_SetColor(ISort_SlotNode(isort, b), 0.0f, 0.0f, 1.0f);
+			return true;
+		}
+
+		case SORT_EVENT_LIFT:
+		{
+			return ISort_MoveFinished(ISort_SlotNode(isort, SORT_HELD));
+		}
+
+		case SORT_EVENT_MOVE:
+		{
+			return ISort_MoveFinished(ISort_SlotNode(isort, b));
+		}
+
+		case SORT_EVENT_DROP:
+		{
+			ISortNode* node = ISort_SlotNode(isort, a);
+			if(!ISort_MoveFinished(node)) {
+				return false;
+			}
+			if(isort->event_step == 1) {
+				isort->event_step = 2;
+				ISort_MoveNode(node, node->x, ISort_SlotY(isort, a));
+				return false;
+			}
+			return true;
+		}
+
+		case SORT_EVENT_SWAP:
+		{
+			bool a_finished = ISort_MoveFinished(ISort_SlotNode(isort, a));
+			bool b_finished = ISort_MoveFinished(ISort_SlotNode(isort, b));
+			return a_finished && b_finished;
+		}
+	}
+
+	return true;
+}
+
+/*  This is the state machine. It handles input, starting the sort
+ * and playing back its trace
  *
- * Roughly speaking each state case checks to see if current animation
- * is finished, stops the animation by setting vel = 0.0f, and sets up 
- * the conditions for the next animation before changing state
+ * The sort itself doesn't know about any of this. It runs on its own
+ * thread and ISORT_PLAYING animates each event it records in turn,
+ * or applies a whole batch of them each frame at the top speeds.
  *
  */
 INTERNAL void ISort_Update(ISort* isort, GameInput* input) {
 	assert(isort);
 	assert(input);
 
-	ISort_UpdateVelocitySetting(isort->nodes, input);
+	ISort_UpdateVelocitySetting(isort, input);
 
 	if(input->p.is_down) {
 		// Pause on everything except ISORT_STATIC state. 
@@ -220,241 +570,96 @@ INTERNAL void ISort_Update(ISort* isort, GameInput* input) {
 		case ISORT_INITIALIZING:
 		{
 			int num_nodes_finished = 0;
-			for(int i = 0; i < INSERTION_SORT_SIZE; ++i) {
-				ISortNode* node = &isort->nodes[i];
-				GameCube* cube = &node->cube;
-			
-				if(ISort_AnimationFinished(node->x_dest, cube->cube_vertices[0].x)) {
-					node->x_vel = 0.0f;
+			for(int i = 0; i < isort->size; ++i) {
+				if(ISort_MoveFinished(&isort->nodes[i])) {
 					num_nodes_finished++;
 				}
 			}
 			
 			// Once all nodes are done moving to initial positions
-			// we move to static. Also set up state to begin sorting
-			// by setting selected_val_index to 1. Any time ISORT_INITIALIZING
-			// occurs, it is going to unsorted state so we can reliably set
-			// up for sorting every time.
-			if(num_nodes_finished == INSERTION_SORT_SIZE) {
-				isort->selected_val_index = 1;
+			// we move to static
+			if(num_nodes_finished == isort->size) {
 				isort->current_state = ISORT_STATIC;
 			}
 		} break;
 
 		case ISORT_STATIC:
 		{
-			if(1 < INSERTION_SORT_SIZE) {
-				if(input->s.is_down) {
-					// array is sorted, go back to original positions
-					if(isort->selected_val_index == INSERTION_SORT_SIZE) {
-						// un-highlight nodes
-						for(int i = 0; i < INSERTION_SORT_SIZE; ++i) {
-							ISortNode* node = &isort->nodes[i];
-							int num_cube_vertices = STRUCT_MEMBER_SIZE(GameCube, cube_vertices) / sizeof(Vertex);
-							for(int j = 0; j < num_cube_vertices; ++j) {
-								node->cube.cube_vertices[j].r = 0.0f;
-								node->cube.cube_vertices[j].g = 0.0f;
-								node->cube.cube_vertices[j].b = 1.0f;
-							}
-						}
-
-						// UPDATE ARRAY VALUES HERE
-						// sort array by start_index
-						// use insertion sort obviously
-						int s = 1;
-						int c = 0;
-						ISortNode temp = isort->nodes[s];
-						while(s < INSERTION_SORT_SIZE) {
-							if((0 <= c) && (temp.start_index < isort->nodes[c].start_index)) {
-								isort->nodes[c + 1] = isort->nodes[c];
-								--c;
-							}
-							else {
-								isort->nodes[c + 1] = temp;
-								++s;
-								temp = isort->nodes[s];
-								c = s - 1;
-							}
-						}
-
-						// set destinations back to starting positions
-						const float x_padding = 0.68f;
-						const float node_width = 1.0f;
-						const float total_width = ((node_width + x_padding) * 
-								                  (float)INSERTION_SORT_SIZE) - x_padding;
-						float x = total_width / -2.0f;
-						const float y = 0.0f;
-						const float z = 0.0f;
-						for(int i = 0; i < INSERTION_SORT_SIZE; ++i) {
-							ISortNode* node = &isort->nodes[i];
-							node->x_dest = x;
-							node->y_dest = y;
-							node->x_vel  = ISort_SetVelocity(node->cube.cube_vertices[0].x, x);
-							node->y_vel  = 0.0f;
-							x += (node_width + x_padding);
-						}
+			// only cycle once per press
+			static bool a_was_down = false;
+			if(input->a.is_down && !a_was_down && !isort->sorted) {
+				isort->algorithm = (SortAlgorithm)((isort->algorithm + 1) % SORT_NUM_ALGORITHMS);
+			}
+			a_was_down = input->a.is_down;
 
-						isort->current_state = ISORT_INITIALIZING;
+			if(input->s.is_down) {
+				// array is sorted, go back to original positions
+				if(isort->sorted) {
+					for(int i = 0; i < isort->size; ++i) {
+						ISortNode* node = &isort->nodes[i];
+						ISort_SetColor(node, 0.0f, 0.0f, 1.0f);
+						ISort_MoveNode(node, ISort_SlotX(isort, i), ISort_SlotY(isort, i));
+						isort->slots[i] = i;
 					}
-					// begin sorting
-					else {
-						isort->nodes[isort->selected_val_index].y_dest = isort->nodes[1].cube.cube_vertices[0].y + 
-							 											 isort_y_lift_val;
-						isort->nodes[isort->selected_val_index].y_vel  = ISort_SetVelocity(isort->nodes[1].cube.cube_vertices[0].y,
-																                           isort->nodes[1].y_dest);
-
-						isort->current_state = ISORT_LIFTING_SELECTED_VALUE;
+
+					isort->sorted = false;
+					isort->current_state = ISORT_INITIALIZING;
+				}
+				// begin sorting
+				else {
+					for(int i = 0; i < isort->size; ++i) {
+						isort->values[i] = isort->nodes[isort->slots[i]].val;
 					}
+					SortTrace_Start(isort->trace, isort->algorithm, isort->values, isort->size);
+					isort->event_step = 0;
+
+					isort->current_state = ISORT_PLAYING;
 				}
 			}
 		} break;
 
-		case ISORT_LIFTING_SELECTED_VALUE:
+		case ISORT_PLAYING:
 		{
-			ISortNode* node = &isort->nodes[isort->selected_val_index];
-			if(ISort_AnimationFinished(node->y_dest, node->cube.cube_vertices[0].y)) {
-				isort->nodes[isort->selected_val_index].y_vel = 0.0f;
-				isort->compare_val_index = isort->selected_val_index - 1;
-				isort->nodes[isort->compare_val_index].x_dest = isort->nodes[isort->selected_val_index].cube.cube_vertices[0].x;
-				isort->current_state = ISORT_COMPARING;
+			if(isort->event_step && ISort_EventFinished(isort)) {
+				isort->event_step = 0;
 			}
-		} break;
 
-		case ISORT_COMPARING: 
-		{
-			ISortNode* selected_node = &isort->nodes[isort->selected_val_index];
-			if(0 <= isort->compare_val_index) {
-				ISortNode* compare_node = &isort->nodes[isort->compare_val_index];
-				
-				// highlight compare_node
-				int num_cube_vertices = STRUCT_MEMBER_SIZE(GameCube, cube_vertices) / sizeof(Vertex);
-				for(int j = 0; j < num_cube_vertices; ++j) {
-					compare_node->cube.cube_vertices[j].r = 1.0f;
-					compare_node->cube.cube_vertices[j].g = 0.0f;
-					compare_node->cube.cube_vertices[j].b = 0.0f;
+			if(isort->event_step == 0) {
+				if(isort_events_per_frame == 1) {
+					SortEvent event;
+					if(SortTrace_Read(isort->trace, &event, 1)) {
+						ISort_StartEvent(isort, event, false);
+					}
 				}
-
-				static int timer = 30 / (int)isort_units_per_second;
-				if(timer == 0) {
-					timer = 30 / (int)isort_units_per_second;
-
-					if(selected_node->val < compare_node->val) {
-						// leave trace for left node
-						// this nodes old location will be the left
-						// nodes new location if it needs to shift
-						if(0 < isort->compare_val_index) {
-							ISortNode* left_node = &isort->nodes[isort->compare_val_index - 1];
-							left_node->x_dest = compare_node->cube.cube_vertices[0].x;
+				else {
+					SortEvent events[256];
+					int num_played = 0;
+					while(num_played < isort_events_per_frame) {
+						int max = isort_events_per_frame - num_played;
+						int count = SortTrace_Read(isort->trace, events, (max < 256) ? max : 256);
+						if(count == 0) {
+							break;
 						}
-
-						// leave trace for selected node
-						// this nodes old location will also be the destination
-						// of the selected node if no more right shifts occur
-						selected_node->x_dest = compare_node->cube.cube_vertices[0].x;
-
-						// give this node some right velocity and let it shift
-						compare_node->x_vel  = ISort_SetVelocity(compare_node->cube.cube_vertices[0].x, compare_node->x_dest);
-						isort->current_state = ISORT_SHIFTING_RIGHT;
-					}
-					else {
-						// un-highlight compare node
-						for(int j = 0; j < num_cube_vertices; ++j) {
-							compare_node->cube.cube_vertices[j].r = 0.0f;
-							compare_node->cube.cube_vertices[j].g = 0.0f;
-							compare_node->cube.cube_vertices[j].b = 1.0f;
+						for(int i = 0; i < count; ++i) {
+							ISort_StartEvent(isort, events[i], true);
 						}
-
-						// set vel for selected to go left
-						selected_node->x_vel = ISort_SetVelocity(selected_node->cube.cube_vertices[0].x, selected_node->x_dest);
-
-						isort->current_state = ISORT_SHIFTING_LEFT;
+						num_played += count;
 					}
 				}
-				else {
-					--timer;
-				}
 			}
-			else {
-				selected_node->x_vel = ISort_SetVelocity(selected_node->cube.cube_vertices[0].x, selected_node->x_dest);
 
-				isort->current_state = ISORT_SHIFTING_LEFT;
-			}
-		} break;
+			if((isort->event_step == 0) && SortTrace_Finished(isort->trace)) {
+				SortTrace_Stop(isort->trace);
+				assert(isort->held < 0);
 
-		case ISORT_SHIFTING_RIGHT:
-		{
-			ISortNode* compare_node = &isort->nodes[isort->compare_val_index];
-			if(ISort_AnimationFinished(compare_node->cube.cube_vertices[0].x,
-						               compare_node->x_dest)) 
-			{
-				// un-highlight node when done shifting
-				int num_cube_vertices = STRUCT_MEMBER_SIZE(GameCube, cube_vertices) / sizeof(Vertex);
-		        for(int j = 0; j < num_cube_vertices; ++j) {
-		        	compare_node->cube.cube_vertices[j].r = 0.0f;
-		        	compare_node->cube.cube_vertices[j].g = 0.0f;
-		        	compare_node->cube.cube_vertices[j].b = 1.0f;
-		        }
-
-				compare_node->x_vel = 0.0f;
-				isort->compare_val_index -= 1;
-				isort->current_state = ISORT_COMPARING;
-			}
-		} break;
-
-		case ISORT_SHIFTING_LEFT:
-		{
-			ISortNode* selected_node = &isort->nodes[isort->selected_val_index];
-			if(ISort_AnimationFinished(selected_node->cube.cube_vertices[0].x,
-									   selected_node->x_dest))
-			{
-				selected_node->x_vel = 0.0f;
-				selected_node->y_dest = 0.5f;
-				selected_node->y_vel = ISort_SetVelocity(selected_node->cube.cube_vertices[0].y, selected_node->y_dest);
-				isort->current_state = ISORT_SHIFTING_DOWN;
-			}
-		} break;
-
-		case ISORT_SHIFTING_DOWN:
-		{
-			ISortNode* selected_node = &isort->nodes[isort->selected_val_index];
-			if(ISort_AnimationFinished(selected_node->cube.cube_vertices[0].y,
-									   selected_node->y_dest)) 
-			{
-				selected_node->y_vel = 0.0f;
-
-				// UPDATE ARRAY VALS HERE
-				int s = isort->selected_val_index;
-				int c = isort->compare_val_index;
-				ISortNode temp = isort->nodes[s];
-				--s;
-				while(c < s) {
-					isort->nodes[s + 1] = isort->nodes[s];
-					--s;
+				// highlight all nodes to show it is sorted
+				for(int i = 0; i < isort->size; ++i) {
+					ISort_SetColor(&isort->nodes[i], 1.0f, 1.0f, 0.0f);
+					assert(isort->nodes[isort->slots[i]].val == isort->values[i]);
 				}
-				isort->nodes[s + 1] = temp;
-
-				isort->selected_val_index += 1;
-
-				if(isort->selected_val_index == INSERTION_SORT_SIZE) {
-					// highlight all nodes to show it is sorted
-					for(int i = 0; i < INSERTION_SORT_SIZE; ++i) {
-						ISortNode* node = &isort->nodes[i];
-						int num_cube_vertices = STRUCT_MEMBER_SIZE(GameCube, cube_vertices) / sizeof(Vertex);
-						for(int j = 0; j < num_cube_vertices; ++j) {
-							node->cube.cube_vertices[j].r = 1.0f;
-							node->cube.cube_vertices[j].g = 1.0f;
-							node->cube.cube_vertices[j].b = 0.0f;
-						}
-					}
 
-					isort->current_state = ISORT_STATIC;
-				}
-				else {
-					isort->nodes[isort->selected_val_index].y_dest = isort->nodes[isort->selected_val_index].cube.cube_vertices[0].y + 1.3f;
-					isort->nodes[isort->selected_val_index].y_vel  = ISort_SetVelocity(isort->nodes[isort->selected_val_index].cube.cube_vertices[0].y,
-							                                                           isort->nodes[isort->selected_val_index].y_dest);
-					isort->current_state = ISORT_LIFTING_SELECTED_VALUE;
-				}
+				isort->sorted = true;
+				isort->current_state = ISORT_STATIC;
 			}
 		} break;
 
@@ -475,7 +680,7 @@ INTERNAL void ISort_DrawBackground(GameBackground gb, float window_width, float
 	glUseProgram(gb.shader);
 
 	int projection_location = glGetUniformLocation(gb.shader, "projection");
-	glm::mat4 projection = glm::perspective(glm::radians(75.0f), window_width / window_height, 0.1f, 100.0f);
+	glm::mat4 projection = glm::perspective(glm::radians(isort_fov), window_width / window_height, 0.1f, 100.0f);
 	glUniformMatrix4fv(projection_location, 1, GL_FALSE, glm::value_ptr(projection));
 
 	glDisable(GL_DEPTH_TEST);
@@ -498,35 +703,38 @@ INTERNAL void ISort_Draw(ISort* isort, float window_width, float window_height)
 	ISort_DrawBackground(isort->background, window_width, window_height);
 
 	GLCall(glBindVertexArray(isort->vao));
-	GLCall(glBindBuffer(GL_ARRAY_BUFFER, isort->vbo));
+	GLCall(glBindBuffer(GL_ARRAY_BUFFER, isort->instance_vbo));
 	GLCall(glUseProgram(isort->shader));
 
-	unsigned int buffer_size = INSERTION_SORT_SIZE * sizeof(GameCube);
-	GLCall(glBufferData(GL_ARRAY_BUFFER, buffer_size, NULL, GL_DYNAMIC_DRAW));
-	for(int i = 0; i < INSERTION_SORT_SIZE; ++i) {
-		GLCall(glBufferSubData(GL_ARRAY_BUFFER, i * sizeof(GameCube), sizeof(GameCube), 
-					           &isort->nodes[i].cube));
-	}
+	// the nodes are the instance data as they are
+	GLCall(glBufferData(GL_ARRAY_BUFFER, isort->size * sizeof(ISortNode), isort->nodes, GL_STREAM_DRAW));
 	
 	int model_location = glGetUniformLocation(isort->shader, "model");
 	int view_location = glGetUniformLocation(isort->shader, "view");
 	int projection_location = glGetUniformLocation(isort->shader, "projection");
+	int value_segments_location = glGetUniformLocation(isort->shader, "value_segments");
+
+	// big arrays put the camera further back than the usual far plane
+	float far_plane = 10.0f - isort->camera.z;
+	if(far_plane < 100.0f) {
+		far_plane = 100.0f;
+	}
 
 	glm::mat4 model = glm::mat4(1.0f);
 	glm::mat4 view = glm::mat4(1.0f);
 	view = glm::translate(view, glm::vec3(isort->camera.x, 
 					                      isort->camera.y, 
 					                      isort->camera.z));
-	glm::mat4 projection = glm::perspective(glm::radians(75.0f), 
+	glm::mat4 projection = glm::perspective(glm::radians(isort_fov), 
 			                                window_width / window_height, 
-											0.1f, 100.0f);
+											0.1f, far_plane);
 
 	glUniformMatrix4fv(model_location, 1, GL_FALSE, glm::value_ptr(model));
 	glUniformMatrix4fv(view_location, 1, GL_FALSE, glm::value_ptr(view));
 	glUniformMatrix4fv(projection_location, 1, GL_FALSE, glm::value_ptr(projection));
+	glUniform2uiv(value_segments_location, MAX_DIGITS, &isort->value_segments[0][0]);
 
-	unsigned int vertices_per_cube = sizeof(GameCube) / sizeof(Vertex);
-	GLCall(glDrawArrays(GL_LINES, 0, INSERTION_SORT_SIZE * VERTICES_PER_CUBE));
+	GLCall(glDrawArraysInstanced(GL_LINES, 0, isort->num_template_vertices, isort->size));
 
 	GLCall(glBindBuffer(GL_ARRAY_BUFFER, 0));
 	GLCall(glBindVertexArray(0));
@@ -0,0 +1,263 @@
+/*
+ * Sort traces. A sort runs on plain ints and writes down what it does
+ * as a stream of small events (compare these two slots, lift this value
+ * out, move it over there, ...) that a view plays back at whatever
+ * speed it wants, see insertion_sort.cpp. The sorts don't know about
+ * the animation, so adding one is just writing the sort, and with no
+ * trace they run at full speed, e.g. for timing them.
+ *
+ * An insertion sort of a big array makes billions of events so they
+ * aren't all kept around. The sort runs on its own thread and writes
+ * into a ring buffer, waiting whenever the player falls behind by a
+ * whole buffer. Like thread_pool.cpp this only needs the C++ standard
+ * library.
+ *
+ */
+
+#if !defined(SORT_TRACE_CPP)
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <thread>
+
+#define SORT_TRACE_CAPACITY (1 << 16) // events, has to be a power of two
+#define SORT_HELD 0x0FFFFFFF // slot of the held value in a compare
+
+typedef enum {
+	SORT_EVENT_COMPARE, // a against b
+	SORT_EVENT_LIFT,    // the value in a is taken out and held
+	SORT_EVENT_MOVE,    // the value in a goes to the empty slot b
+	SORT_EVENT_DROP,    // the held value goes into the empty slot a
+	SORT_EVENT_SWAP     // the values in a and b trade places
+} SortEventType;
+
+typedef struct {
+	uint32_t type : 4;
+	uint32_t a : 28;
+	uint32_t b;
+} SortEvent;
+
+typedef enum {
+	SORT_INSERTION,
+	SORT_SELECTION,
+	SORT_NUM_ALGORITHMS // THIS NEEDS TO BE THE LAST ENUM IN THE LIST
+} SortAlgorithm;
+
+typedef struct {
+	SortEvent* events; // SORT_TRACE_CAPACITY of them
+
+	// totals so far, so written - read events are waiting
+	std::atomic<uint64_t> written;
+	std::atomic<uint64_t> read;
+	std::atomic<bool> done;   // the sort returned, nothing more is coming
+	std::atomic<bool> cancel; // the sort should stop where it is
+
+	// the sort sleeps on this while the buffer is full
+	std::mutex mutex;
+	std::condition_variable space;
+
+	std::thread thread;
+	bool running;
+} SortTrace;
+
+SortTrace* SortTrace_Create() {
+	SortTrace* trace = (SortTrace*)calloc(1, sizeof(SortTrace));
+	if(!trace) {
+		fprintf(stderr, "Couldn't malloc for SortTrace\n");
+		return NULL;
+	}
+	SortEvent* events = (SortEvent*)calloc(SORT_TRACE_CAPACITY, sizeof(SortEvent));
+	if(!events) {
+		fprintf(stderr, "Couldn't malloc for SortTrace events\n");
+		free(trace);
+		return NULL;
+	}
+
+	// the atomics, mutex and thread still need constructing
+	new (trace) SortTrace();
+	trace->events = events;
+	trace->written.store(0, std::memory_order_relaxed);
+	trace->read.store(0, std::memory_order_relaxed);
+	trace->done.store(false, std::memory_order_relaxed);
+	trace->cancel.store(false, std::memory_order_relaxed);
+	trace->running = false;
+
+	return trace;
+}
+
+static inline bool SortTrace_Cancelled(const SortTrace* trace) {
+	return trace && trace->cancel.load(std::memory_order_relaxed);
+}
+
+// Does nothing without a trace. Once cancelled events are dropped
+// instead of waiting on a player that's gone.
+static void SortTrace_Emit(SortTrace* trace, SortEventType type, int a, int b) {
+	if(trace == NULL) {
+		return;
+	}
+
+	uint64_t written = trace->written.load(std::memory_order_relaxed);
+	if((written - trace->read.load(std::memory_order_acquire)) == SORT_TRACE_CAPACITY) {
+		std::unique_lock<std::mutex> lock(trace->mutex);
+		while(!trace->cancel.load(std::memory_order_relaxed) &&
+		      ((written - trace->read.load(std::memory_order_acquire)) == SORT_TRACE_CAPACITY)) {
+			trace->space.wait(lock);
+		}
+	}
+	if(trace->cancel.load(std::memory_order_relaxed)) {
+		return;
+	}
+
+	SortEvent* event = &trace->events[written & (SORT_TRACE_CAPACITY - 1)];
+	event->type = type;
+	event->a = (uint32_t)a;
+	event->b = (uint32_t)b;
+	trace->written.store(written + 1, std::memory_order_release);
+}
+
+/****************************************
+ * Sorts                                *
+ ****************************************/
+// Each outer pass checks for a cancel, so a stopped sort of a big
+// array returns after one more pass at most
+
+void Sort_Insertion(int* values, int count, SortTrace* trace) {
+	for(int s = 1; (s < count) && !SortTrace_Cancelled(trace); ++s) {
+		int held = values[s];
+		SortTrace_Emit(trace, SORT_EVENT_LIFT, s, 0);
+
+		int c = s - 1;
+		while(0 <= c) {
+			SortTrace_Emit(trace, SORT_EVENT_COMPARE, SORT_HELD, c);
+			if(!(held < values[c])) {
+				break;
+			}
+			values[c + 1] = values[c];
+			SortTrace_Emit(trace, SORT_EVENT_MOVE, c, c + 1);
+			--c;
+		}
+
+		values[c + 1] = held;
+		SortTrace_Emit(trace, SORT_EVENT_DROP, c + 1, 0);
+	}
+}
+
+void Sort_Selection(int* values, int count, SortTrace* trace) {
+	for(int i = 0; ((i + 1) < count) && !SortTrace_Cancelled(trace); ++i) {
+		int min = i;
+		for(int j = i + 1; j < count; ++j) {
+			SortTrace_Emit(trace, SORT_EVENT_COMPARE, j, min);
+			if(values[j] < values[min]) {
+				min = j;
+			}
+		}
+
+		if(min != i) {
+			int temp = values[i];
+			values[i] = values[min];
+			values[min] = temp;
+			SortTrace_Emit(trace, SORT_EVENT_SWAP, i, min);
+		}
+	}
+}
+
+void Sort_Run(SortAlgorithm algorithm, int* values, int count, SortTrace* trace) {
+	switch(algorithm) {
+		case SORT_INSERTION: Sort_Insertion(values, count, trace); break;
+		case SORT_SELECTION: Sort_Selection(values, count, trace); break;
+		default: assert(!"unknown SortAlgorithm"); break;
+	}
+}
+
+/****************************************
+ * Playing a trace                      *
+ ****************************************/
+static void SortTrace_ThreadMain(SortTrace* trace, SortAlgorithm algorithm, int* values, int count) {
+	Sort_Run(algorithm, values, count, trace);
+	trace->done.store(true, std::memory_order_release);
+}
+
+// Stops the sort if it's still going and waits for it to return
+void SortTrace_Stop(SortTrace* trace) {
+	assert(trace);
+
+	if(!trace->running) {
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(trace->mutex);
+		trace->cancel.store(true, std::memory_order_relaxed);
+	}
+	trace->space.notify_all();
+	trace->thread.join();
+	trace->running = false;
+}
+
+// Sorts values on another thread. values has to be left alone
+// until the trace is finished or stopped.
+void SortTrace_Start(SortTrace* trace, SortAlgorithm algorithm, int* values, int count) {
+	assert(trace);
+	assert(values);
+
+	SortTrace_Stop(trace);
+	trace->written.store(0, std::memory_order_relaxed);
+	trace->read.store(0, std::memory_order_relaxed);
+	trace->done.store(false, std::memory_order_relaxed);
+	trace->cancel.store(false, std::memory_order_relaxed);
+	trace->thread = std::thread(SortTrace_ThreadMain, trace, algorithm, values, count);
+	trace->running = true;
+}
+
+// Copies up to max waiting events into events and returns how many.
+// Never waits for the sort.
+int SortTrace_Read(SortTrace* trace, SortEvent* events, int max) {
+	assert(trace);
+
+	uint64_t read = trace->read.load(std::memory_order_relaxed);
+	uint64_t available = trace->written.load(std::memory_order_acquire) - read;
+	int count = (available < (uint64_t)max) ? (int)available : max;
+	for(int i = 0; i < count; ++i) {
+		events[i] = trace->events[(read + i) & (SORT_TRACE_CAPACITY - 1)];
+	}
+	if(count == 0) {
+		return 0;
+	}
+	trace->read.store(read + count, std::memory_order_release);
+
+	// a sort that just found the buffer full holds the mutex
+	// until it's waiting, so the notify can't be missed
+	{
+		std::lock_guard<std::mutex> lock(trace->mutex);
+	}
+	trace->space.notify_one();
+	return count;
+}
+
+// True once the sort returned and every event it wrote was read
+bool SortTrace_Finished(SortTrace* trace) {
+	assert(trace);
+
+	return trace->done.load(std::memory_order_acquire) &&
+	       (trace->read.load(std::memory_order_relaxed) == trace->written.load(std::memory_order_acquire));
+}
+
+void SortTrace_Destroy(SortTrace* trace) {
+	if(!trace) {
+		return;
+	}
+
+	SortTrace_Stop(trace);
+	free(trace->events);
+	trace->~SortTrace();
+	free(trace);
+}
+
+#define SORT_TRACE_CPP
+#endif
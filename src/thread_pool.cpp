@@ -0,0 +1,211 @@
+/*
+ * Small fork/join thread pool for divide and conquer work, e.g. the
+ * AVL set operations. It only depends on the C++ standard library so
+ * it can be used by the platform build and the headless benchmark.
+ *
+ * A forked task goes on a shared queue that the worker threads pull
+ * from. Joining a task that isn't done yet runs other queued tasks
+ * in the meantime instead of blocking, so nested forks can't deadlock
+ * and the joining thread keeps doing useful work.
+ *
+ */
+
+#if !defined(THREAD_POOL_CPP)
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <thread>
+
+typedef void ThreadPoolFunction(void* data);
+
+typedef struct ThreadPoolTask {
+	ThreadPoolFunction* function;
+	void* data;
+	std::atomic<bool> done;
+	struct ThreadPoolTask* next;
+} ThreadPoolTask;
+
+typedef struct {
+	std::thread* threads;
+	int num_threads;
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	ThreadPoolTask* queue_head;
+	ThreadPoolTask* queue_tail;
+	bool stop;
+} ThreadPool;
+
+// Pops the oldest task (usually the biggest piece of work) or returns NULL
+static ThreadPoolTask* ThreadPool_PopTask(ThreadPool* pool) {
+	std::lock_guard<std::mutex> lock(pool->mutex);
+
+	ThreadPoolTask* task = pool->queue_head;
+	if(task) {
+		pool->queue_head = task->next;
+		if(pool->queue_head == NULL) {
+			pool->queue_tail = NULL;
+		}
+	}
+	return task;
+}
+
+static inline void ThreadPool_RunTask(ThreadPoolTask* task) {
+	task->function(task->data);
+	task->done.store(true, std::memory_order_release);
+}
+
+static void ThreadPool_WorkerLoop(ThreadPool* pool) {
+	for(;;) {
+		ThreadPoolTask* task = NULL;
+		{
+			std::unique_lock<std::mutex> lock(pool->mutex);
+			while(!pool->stop && (pool->queue_head == NULL)) {
+				pool->wake.wait(lock);
+			}
+			if(pool->stop) {
+				return;
+			}
+
+			task = pool->queue_head;
+			pool->queue_head = task->next;
+			if(pool->queue_head == NULL) {
+				pool->queue_tail = NULL;
+			}
+		}
+
+		ThreadPool_RunTask(task);
+	}
+}
+
+/* num_threads is the total number of threads doing work including the
+ * one that calls ThreadPool_Join, so 1 means everything runs inline.
+ * 0 picks one per hardware thread.
+ */
+ThreadPool* ThreadPool_Create(int num_threads) {
+	if(num_threads <= 0) {
+		num_threads = (int)std::thread::hardware_concurrency();
+		if(num_threads <= 0) {
+			num_threads = 1;
+		}
+	}
+
+	ThreadPool* pool = (ThreadPool*)calloc(1, sizeof(ThreadPool));
+	if(!pool) {
+		fprintf(stderr, "Couldn't malloc for ThreadPool\n");
+		return NULL;
+	}
+	std::thread* threads = NULL;
+	if(num_threads > 1) {
+		threads = (std::thread*)calloc((size_t)(num_threads - 1), sizeof(std::thread));
+		if(!threads) {
+			fprintf(stderr, "Couldn't malloc for ThreadPool threads\n");
+			free(pool);
+			return NULL;
+		}
+	}
+
+	// the mutex, condition variable and threads still need constructing
+	new (pool) ThreadPool();
+	pool->queue_head = NULL;
+	pool->queue_tail = NULL;
+	pool->stop = false;
+	pool->num_threads = num_threads;
+	pool->threads = threads;
+	for(int i = 0; i < (num_threads - 1); ++i) {
+		new (&pool->threads[i]) std::thread(ThreadPool_WorkerLoop, pool);
+	}
+
+	return pool;
+}
+
+void ThreadPool_Destroy(ThreadPool* pool) {
+	if(!pool) {
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(pool->mutex);
+		pool->stop = true;
+	}
+	pool->wake.notify_all();
+	for(int i = 0; i < (pool->num_threads - 1); ++i) {
+		pool->threads[i].join();
+		pool->threads[i].~thread();
+	}
+	free(pool->threads);
+	pool->~ThreadPool();
+	free(pool);
+}
+
+// task has to stay alive until ThreadPool_Join returns for it
+void ThreadPool_Fork(ThreadPool* pool, ThreadPoolTask* task) {
+	assert(pool);
+	assert(task);
+
+	task->done.store(false, std::memory_order_relaxed);
+	task->next = NULL;
+	if(pool->num_threads <= 1) {
+		ThreadPool_RunTask(task);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(pool->mutex);
+		if(pool->queue_tail) {
+			pool->queue_tail->next = task;
+		}
+		else {
+			pool->queue_head = task;
+		}
+		pool->queue_tail = task;
+	}
+	pool->wake.notify_one();
+}
+
+void ThreadPool_Join(ThreadPool* pool, ThreadPoolTask* task) {
+	assert(pool);
+	assert(task);
+
+	while(!task->done.load(std::memory_order_acquire)) {
+		ThreadPoolTask* other = ThreadPool_PopTask(pool);
+		if(other) {
+			ThreadPool_RunTask(other);
+		}
+		else {
+			std::this_thread::yield();
+		}
+	}
+}
+
+template <typename Function>
+static void ThreadPool_CallFunction(void* data) {
+	(*(Function*)data)();
+}
+
+/* Runs left and right in parallel when there is a pool, otherwise one
+ * after the other. right goes on the queue and left runs right here.
+ */
+template <typename Left, typename Right>
+void ThreadPool_Parallel(ThreadPool* pool, Left left, Right right) {
+	if((pool == NULL) || (pool->num_threads <= 1)) {
+		left();
+		right();
+		return;
+	}
+
+	ThreadPoolTask task;
+	task.function = ThreadPool_CallFunction<Right>;
+	task.data = &right;
+	ThreadPool_Fork(pool, &task);
+	left();
+	ThreadPool_Join(pool, &task);
+}
+
+#define THREAD_POOL_CPP
+#endif
@@ -198,6 +198,46 @@ INTERNAL void Win32ProcessPendingMessages(GameInput* new_input) {
 							Win32ProcessKeyboardMessage(&new_input->v, is_down, was_down);
 						} break;
 
+						case 'J':
+						{
+							Win32ProcessKeyboardMessage(&new_input->j, is_down, was_down);
+						} break;
+
+						case 'B':
+						{
+							Win32ProcessKeyboardMessage(&new_input->b, is_down, was_down);
+						} break;
+
+						case 'F':
+						{
+							Win32ProcessKeyboardMessage(&new_input->f, is_down, was_down);
+						} break;
+
+						case 'D':
+						{
+							Win32ProcessKeyboardMessage(&new_input->d, is_down, was_down);
+						} break;
+
+						case 'R':
+						{
+							Win32ProcessKeyboardMessage(&new_input->r, is_down, was_down);
+						} break;
+
+						case 'M':
+						{
+							Win32ProcessKeyboardMessage(&new_input->m, is_down, was_down);
+						} break;
+
+						case 'K':
+						{
+							Win32ProcessKeyboardMessage(&new_input->k, is_down, was_down);
+						} break;
+
+						case 'H':
+						{
+							Win32ProcessKeyboardMessage(&new_input->h, is_down, was_down);
+						} break;
+
 						case VK_UP:
 						{
 							Win32ProcessKeyboardMessage(&new_input->arrow_up, is_down, was_down);
@@ -0,0 +1,35 @@
+#version 330 core
+
+// template vertex, see ISort_BuildTemplate
+layout (location = 0) in vec3 pos;
+layout (location = 1) in vec3 color_in;
+layout (location = 2) in int segment;
+
+// per cube
+layout (location = 3) in vec2 corner;
+layout (location = 4) in vec3 cube_color;
+layout (location = 5) in int val;
+
+uniform mat4 model;
+uniform mat4 view;
+uniform mat4 projection;
+uniform uvec2 value_segments[100];
+
+out vec3 color_to_frag;
+
+void main() {
+	color_to_frag = (segment < 0) ? cube_color : color_in;
+
+	if(0 <= segment) {
+		uvec2 mask = value_segments[val];
+		uint bits = (segment < 32) ? mask.x : mask.y;
+		if(((bits >> uint(segment % 32)) & 1u) == 0u) {
+			// both ends of a line val doesn't use land outside the
+			// clip volume so the whole line gets clipped away
+			gl_Position = vec4(2.0, 2.0, 2.0, 1.0);
+			return;
+		}
+	}
+
+	gl_Position = projection * view * model * vec4(pos.x + corner.x, pos.y + corner.y, pos.z, 1.0f);
+}